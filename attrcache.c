@@ -0,0 +1,213 @@
+/*
+ * attrcache.c - attribute cache
+ * Copyright (C) 2012 Benoit Vidis <contact@benoitvidis.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include "memcachefs.h"
+#include "attrcache.h"
+#include "stats.h"
+
+/*
+ * Entries are kept in a fixed hash table. Each lock covers every
+ * ATTR_CACHE_LOCKS-th bucket so that lookups of unrelated paths from
+ * different FUSE threads do not serialize on one mutex. Expired entries
+ * are dropped lazily while walking a bucket.
+ */
+
+static unsigned int attr_cache_hash(const char *path)
+{
+    unsigned int hash = 0;
+
+    while(*path){
+        hash += (unsigned char)*path++;
+        hash += (hash << 10);
+        hash ^= (hash >> 6);
+    }
+    hash += (hash << 3);
+    hash ^= (hash >> 11);
+    hash += (hash << 15);
+    return hash;
+}
+
+static void attr_entry_free(attr_entry_t *entry)
+{
+    free(entry->path);
+    free(entry);
+}
+
+attr_cache_t *attr_cache_new(unsigned int timeout)
+{
+    int i;
+    attr_cache_t *cache;
+
+    cache = (attr_cache_t*)malloc(sizeof(attr_cache_t));
+    if(!cache){
+        return NULL;
+    }
+    memset(cache, 0, sizeof(attr_cache_t));
+    cache->timeout = timeout;
+    for(i=0; i<ATTR_CACHE_LOCKS; i++){
+        pthread_mutex_init(&cache->locks[i], NULL);
+    }
+    return cache;
+}
+
+void attr_cache_free(attr_cache_t *cache)
+{
+    int i;
+    attr_entry_t *entry;
+    attr_entry_t *next;
+
+    for(i=0; i<ATTR_CACHE_BUCKETS; i++){
+        for(entry = cache->buckets[i]; entry; entry = next){
+            next = entry->next;
+            attr_entry_free(entry);
+        }
+    }
+    for(i=0; i<ATTR_CACHE_LOCKS; i++){
+        pthread_mutex_destroy(&cache->locks[i]);
+    }
+    free(cache);
+}
+
+/*
+ * Look path up without counting a hit or a miss, for the lookups done
+ * on the way to something else, so that the counters only reflect the
+ * getattr calls.
+ */
+int attr_cache_peek(attr_cache_t *cache, const char *path, attr_t *attr)
+{
+    unsigned int index;
+    attr_entry_t **prev;
+    attr_entry_t *entry;
+    time_t now;
+    int ret = 0;
+
+    if(!cache->timeout){
+        return 0;
+    }
+    now = time(NULL);
+    index = attr_cache_hash(path) % ATTR_CACHE_BUCKETS;
+
+    pthread_mutex_lock(&cache->locks[index % ATTR_CACHE_LOCKS]);
+    prev = &cache->buckets[index];
+    while((entry = *prev)){
+        if(entry->expire <= now){
+            *prev = entry->next;
+            attr_entry_free(entry);
+            continue;
+        }
+        if(!strcmp(entry->path, path)){
+            *attr = entry->attr;
+            ret = 1;
+            break;
+        }
+        prev = &entry->next;
+    }
+    pthread_mutex_unlock(&cache->locks[index % ATTR_CACHE_LOCKS]);
+
+    return ret;
+}
+
+int attr_cache_get(attr_cache_t *cache, const char *path, attr_t *attr)
+{
+    int ret;
+
+    if(!cache->timeout){
+        return 0;
+    }
+    ret = attr_cache_peek(cache, path, attr);
+    stats_add(ret?STATS_ATTR_HITS:STATS_ATTR_MISSES, 1);
+    return ret;
+}
+
+void attr_cache_set(attr_cache_t *cache, const char *path, const attr_t *attr)
+{
+    unsigned int index;
+    attr_entry_t **prev;
+    attr_entry_t *entry;
+    attr_entry_t *found = NULL;
+    time_t now;
+
+    if(!cache->timeout){
+        return;
+    }
+    now = time(NULL);
+    index = attr_cache_hash(path) % ATTR_CACHE_BUCKETS;
+
+    pthread_mutex_lock(&cache->locks[index % ATTR_CACHE_LOCKS]);
+    prev = &cache->buckets[index];
+    while((entry = *prev)){
+        if(!strcmp(entry->path, path)){
+            found = entry;
+        }else if(entry->expire <= now){
+            *prev = entry->next;
+            attr_entry_free(entry);
+            continue;
+        }
+        prev = &entry->next;
+    }
+    if(!found){
+        found = (attr_entry_t*)malloc(sizeof(attr_entry_t));
+        if(found){
+            found->path = strdup(path);
+            if(!found->path){
+                free(found);
+                found = NULL;
+            }
+        }
+        if(found){
+            found->next = cache->buckets[index];
+            cache->buckets[index] = found;
+        }
+    }
+    if(found){
+        found->attr = *attr;
+        found->expire = now + cache->timeout;
+    }
+    pthread_mutex_unlock(&cache->locks[index % ATTR_CACHE_LOCKS]);
+}
+
+void attr_cache_invalidate(attr_cache_t *cache, const char *path)
+{
+    unsigned int index;
+    attr_entry_t **prev;
+    attr_entry_t *entry;
+
+    if(!cache->timeout){
+        return;
+    }
+    index = attr_cache_hash(path) % ATTR_CACHE_BUCKETS;
+
+    pthread_mutex_lock(&cache->locks[index % ATTR_CACHE_LOCKS]);
+    prev = &cache->buckets[index];
+    while((entry = *prev)){
+        if(!strcmp(entry->path, path)){
+            *prev = entry->next;
+            attr_entry_free(entry);
+            break;
+        }
+        prev = &entry->next;
+    }
+    pthread_mutex_unlock(&cache->locks[index % ATTR_CACHE_LOCKS]);
+}
@@ -0,0 +1,41 @@
+/*
+ * attrcache.h - attribute cache
+ * Copyright (C) 2012 Benoit Vidis <contact@benoitvidis.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#define ATTR_CACHE_BUCKETS 4096
+#define ATTR_CACHE_LOCKS 32
+
+typedef struct attr_entry{
+    struct attr_entry *next;
+    char *path;
+    attr_t attr;
+    time_t expire;
+}attr_entry_t;
+
+typedef struct{
+    attr_entry_t *buckets[ATTR_CACHE_BUCKETS];
+    pthread_mutex_t locks[ATTR_CACHE_LOCKS];
+    unsigned int timeout;
+}attr_cache_t;
+
+attr_cache_t *attr_cache_new(unsigned int timeout);
+void attr_cache_free(attr_cache_t *cache);
+int attr_cache_peek(attr_cache_t *cache, const char *path, attr_t *attr);
+int attr_cache_get(attr_cache_t *cache, const char *path, attr_t *attr);
+void attr_cache_set(attr_cache_t *cache, const char *path, const attr_t *attr);
+void attr_cache_invalidate(attr_cache_t *cache, const char *path);
@@ -0,0 +1,581 @@
+/*
+ * bench.c - micro-benchmarks of the filesystem operations
+ * Copyright (C) 2012 Benoit Vidis <contact@benoitvidis.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+/*
+ * memcachefs-bench [-l usec] [-s servers] [-t threads] [-n ops] [-k keys]
+ *                  [-b bytes] [-o opt[,opt...]] [bench...]
+ *
+ * Calls the operations of memcachefs from threads of its own, as FUSE
+ * would but without a mount, against fakemc servers answering each
+ * round-trip after -l microseconds. The benchmarks are getattr (lookups
+ * of -k files in random order), create (mknod, write of 4096 bytes and
+ * close), read (sequential reads of 128k through files of -b bytes),
+ * readdir (listings of a directory of -k files) and rename. -n ops are
+ * shared among the threads of each. -o takes the mount options;
+ * -o backend=memory leaves the servers out, for the cost of the
+ * operations themselves.
+ *
+ * For each benchmark, prints the operations per second, the percentiles
+ * of their latency in microseconds and the round-trips each one took.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <fuse/fuse.h>
+
+static struct fuse_context *bench_context(void);
+
+// the operations are only reachable from within memcachefs.c, and the
+// context of their caller only exists under FUSE
+#define main memcachefs_main
+#define fuse_get_context bench_context
+#include "memcachefs.c"
+#undef main
+#undef fuse_get_context
+
+#include "memstore.h"
+#include "fakemc.h"
+
+#define BENCH_IO (128 * 1024)
+#define BENCH_SMALL 4096
+
+typedef struct{
+    unsigned int index;
+    unsigned long ops;          // to run
+    unsigned long long *ns;     // time each one took
+    unsigned long long bytes;
+    unsigned long errors;
+    unsigned int seed;
+    struct fuse_file_info fi;
+    int open;
+    char *buf;
+}bench_thread_t;
+
+typedef struct{
+    const char *name;
+    int (*setup)(void);                     // once, untimed
+    int (*prepare)(bench_thread_t *t);      // by each thread, untimed
+    int (*op)(bench_thread_t *t, unsigned long i);  // bytes or -errno
+    void (*finish)(bench_thread_t *t);
+}bench_t;
+
+static struct fuse_context bench_ctx;
+static unsigned int bench_threads = 4;
+static unsigned long bench_ops = 20000;
+static unsigned int bench_keys = 1000;
+static size_t bench_size = 16 * 1024 * 1024;
+static fakemc_t **bench_servers;
+static unsigned int bench_nservers = 1;
+static pthread_barrier_t bench_barrier;
+
+static struct fuse_context *bench_context(void)
+{
+    return &bench_ctx;
+}
+
+/*
+ * Store a file the way cp(1) would, writing the first BENCH_IO bytes of
+ * buf over and over.
+ */
+static int bench_file(const char *path, const char *buf, size_t len)
+{
+    struct fuse_file_info fi;
+    size_t off;
+    size_t n;
+    int ret;
+
+    ret = memcachefs_oper.mknod(path, S_IFREG | 0644, 0);
+    if(ret){
+        return ret;
+    }
+    memset(&fi, 0, sizeof(fi));
+    fi.flags = O_WRONLY;
+    ret = memcachefs_oper.open(path, &fi);
+    if(ret){
+        return ret;
+    }
+    for(off = 0; off < len && ret >= 0; off += n){
+        n = (len - off < BENCH_IO)?len - off:BENCH_IO;
+        ret = memcachefs_oper.write(path, buf, n, off, &fi);
+    }
+    if(ret >= 0){
+        ret = memcachefs_oper.flush(path, &fi);
+    }
+    memcachefs_oper.release(path, &fi);
+    return (ret < 0)?ret:(int)len;
+}
+
+/*
+ * Files of the thread, -k of them among all the threads.
+ */
+static int bench_files(bench_thread_t *t, const char *fmt)
+{
+    char path[64];
+    unsigned int i;
+    int ret;
+
+    for(i = t->index; i < bench_keys; i += bench_threads){
+        snprintf(path, sizeof(path), fmt, i);
+        ret = bench_file(path, t->buf, 64);
+        if(ret < 0){
+            return ret;
+        }
+    }
+    return 0;
+}
+
+static int bench_getattr_prepare(bench_thread_t *t)
+{
+    return bench_files(t, "/ga%u");
+}
+
+static int bench_getattr(bench_thread_t *t, unsigned long i)
+{
+    char path[64];
+    struct stat st;
+
+    snprintf(path, sizeof(path), "/ga%u", rand_r(&t->seed) % bench_keys);
+    return memcachefs_oper.getattr(path, &st);
+}
+
+static int bench_create(bench_thread_t *t, unsigned long i)
+{
+    char path[64];
+
+    snprintf(path, sizeof(path), "/cr%u-%lu", t->index, i);
+    return bench_file(path, t->buf, BENCH_SMALL);
+}
+
+static int bench_read_prepare(bench_thread_t *t)
+{
+    char path[64];
+    int ret;
+
+    snprintf(path, sizeof(path), "/rd%u", t->index);
+    ret = bench_file(path, t->buf, bench_size);
+    return (ret < 0)?ret:0;
+}
+
+/*
+ * Read through the file, opening it again at the start of each pass.
+ */
+static int bench_read(bench_thread_t *t, unsigned long i)
+{
+    char path[64];
+    off_t off = (off_t)i * BENCH_IO % bench_size;
+    int ret;
+
+    snprintf(path, sizeof(path), "/rd%u", t->index);
+    if(!off || !t->open){
+        if(t->open){
+            memcachefs_oper.release(path, &t->fi);
+        }
+        memset(&t->fi, 0, sizeof(t->fi));
+        t->fi.flags = O_RDONLY;
+        ret = memcachefs_oper.open(path, &t->fi);
+        t->open = !ret;
+        if(ret){
+            return ret;
+        }
+    }
+    return memcachefs_oper.read(path, t->buf, BENCH_IO, off, &t->fi);
+}
+
+static void bench_read_finish(bench_thread_t *t)
+{
+    char path[64];
+
+    if(t->open){
+        snprintf(path, sizeof(path), "/rd%u", t->index);
+        memcachefs_oper.release(path, &t->fi);
+        t->open = 0;
+    }
+}
+
+static int bench_readdir_setup(void)
+{
+    return memcachefs_oper.mkdir("/rdir", 0755);
+}
+
+static int bench_readdir_prepare(bench_thread_t *t)
+{
+    return bench_files(t, "/rdir/f%u");
+}
+
+static int bench_fill(void *buf, const char *name, const struct stat *st,
+                      off_t off)
+{
+    (*(unsigned int*)buf)++;
+    return 0;
+}
+
+static int bench_readdir(bench_thread_t *t, unsigned long i)
+{
+    struct fuse_file_info fi;
+    unsigned int count = 0;
+    int ret;
+
+    memset(&fi, 0, sizeof(fi));
+    ret = memcachefs_oper.opendir("/rdir", &fi);
+    if(ret){
+        return ret;
+    }
+    ret = memcachefs_oper.readdir("/rdir", &count, bench_fill, 0, &fi);
+    memcachefs_oper.releasedir("/rdir", &fi);
+    if(!ret && count < bench_keys){
+        ret = -ENOENT;
+    }
+    return ret;
+}
+
+static int bench_rename_prepare(bench_thread_t *t)
+{
+    char path[64];
+    unsigned long i;
+    int ret;
+
+    for(i=0; i<t->ops; i++){
+        snprintf(path, sizeof(path), "/rn%u-%lu", t->index, i);
+        ret = bench_file(path, t->buf, BENCH_SMALL);
+        if(ret < 0){
+            return ret;
+        }
+    }
+    return 0;
+}
+
+static int bench_rename(bench_thread_t *t, unsigned long i)
+{
+    char from[64];
+    char to[64];
+
+    snprintf(from, sizeof(from), "/rn%u-%lu", t->index, i);
+    snprintf(to, sizeof(to), "/mv%u-%lu", t->index, i);
+    return memcachefs_oper.rename(from, to);
+}
+
+static bench_t benches[] = {
+    {"getattr", NULL, bench_getattr_prepare, bench_getattr, NULL},
+    {"create", NULL, NULL, bench_create, NULL},
+    {"read", NULL, bench_read_prepare, bench_read, bench_read_finish},
+    {"readdir", bench_readdir_setup, bench_readdir_prepare, bench_readdir,
+     NULL},
+    {"rename", NULL, bench_rename_prepare, bench_rename, NULL},
+    {NULL, NULL, NULL, NULL, NULL},
+};
+
+static bench_t *bench_current;
+
+static void *bench_run(void *arg)
+{
+    bench_thread_t *t = (bench_thread_t*)arg;
+    unsigned long long start;
+    unsigned long i;
+    int ret = 0;
+
+    if(bench_current->prepare){
+        ret = bench_current->prepare(t);
+        if(ret){
+            fprintf(stderr, "%s: preparing: %s\n", bench_current->name,
+                    strerror(-ret));
+            t->errors++;
+        }
+    }
+    pthread_barrier_wait(&bench_barrier);
+    for(i=0; i<t->ops && !ret; i++){
+        start = stats_now();
+        ret = bench_current->op(t, i);
+        t->ns[i] = stats_now() - start;
+        if(ret < 0){
+            t->errors++;
+        }else{
+            t->bytes += ret;
+        }
+        ret = 0;
+    }
+    if(bench_current->finish){
+        bench_current->finish(t);
+    }
+    return NULL;
+}
+
+static int bench_cmp(const void *a, const void *b)
+{
+    unsigned long long na = *(const unsigned long long*)a;
+    unsigned long long nb = *(const unsigned long long*)b;
+
+    return (na < nb)?-1:(na > nb);
+}
+
+static unsigned long long bench_batches(void)
+{
+    unsigned long long n = 0;
+    unsigned int i;
+
+    for(i=0; i<bench_nservers; i++){
+        n += bench_servers[i]->batches;
+    }
+    return n;
+}
+
+static double bench_pct(unsigned long long *ns, unsigned long n, double p)
+{
+    return n?ns[(unsigned long)((n - 1) * p)] / 1000.0:0;
+}
+
+/*
+ * Run a benchmark on every thread at once and print its line.
+ */
+static int bench_one(bench_t *bench)
+{
+    bench_thread_t *threads;
+    pthread_t *tids;
+    unsigned long long *ns;
+    unsigned long long start;
+    unsigned long long elapsed;
+    unsigned long long bytes = 0;
+    unsigned long long batches;
+    unsigned long errors = 0;
+    unsigned long n = 0;
+    unsigned int i;
+    int ret = 0;
+
+    if(bench->setup && (ret = bench->setup())){
+        fprintf(stderr, "%s: %s\n", bench->name, strerror(-ret));
+        return -1;
+    }
+    threads = (bench_thread_t*)calloc(bench_threads, sizeof(bench_thread_t));
+    tids = (pthread_t*)calloc(bench_threads, sizeof(pthread_t));
+    ns = (unsigned long long*)malloc((bench_ops + 1) *
+                                     sizeof(unsigned long long));
+    if(!threads || !tids || !ns){
+        perror("malloc()");
+        exit(EXIT_FAILURE);
+    }
+    for(i=0; i<bench_threads; i++){
+        threads[i].index = i;
+        threads[i].seed = i + 1;
+        threads[i].ops = bench_ops / bench_threads +
+                         (i < bench_ops % bench_threads);
+        threads[i].ns = ns + n;
+        n += threads[i].ops;
+        threads[i].buf = (char*)malloc(BENCH_IO);
+        if(!threads[i].buf){
+            perror("malloc()");
+            exit(EXIT_FAILURE);
+        }
+        memset(threads[i].buf, 'a' + i % 26, BENCH_IO);
+    }
+
+    bench_current = bench;
+    pthread_barrier_init(&bench_barrier, NULL, bench_threads + 1);
+    for(i=0; i<bench_threads; i++){
+        if(pthread_create(&tids[i], NULL, bench_run, &threads[i])){
+            perror("pthread_create()");
+            exit(EXIT_FAILURE);
+        }
+    }
+    pthread_barrier_wait(&bench_barrier);
+    batches = bench_batches();
+    start = stats_now();
+    for(i=0; i<bench_threads; i++){
+        pthread_join(tids[i], NULL);
+    }
+    elapsed = stats_now() - start;
+    batches = bench_batches() - batches;
+    pthread_barrier_destroy(&bench_barrier);
+
+    for(i=0; i<bench_threads; i++){
+        bytes += threads[i].bytes;
+        errors += threads[i].errors;
+        free(threads[i].buf);
+    }
+    qsort(ns, n, sizeof(unsigned long long), bench_cmp);
+    printf("%-8s %8lu %11.1f %9.1f %9.1f %9.1f %9.1f %9.1f %7.2f",
+           bench->name, n, n * 1e9 / (elapsed?elapsed:1),
+           bench_pct(ns, n, 0.5), bench_pct(ns, n, 0.9),
+           bench_pct(ns, n, 0.99), bench_pct(ns, n, 0.999),
+           bench_pct(ns, n, 1), n?(double)batches / n:0);
+    if(bytes){
+        printf(" %9.1f", bytes * 1e9 / (elapsed?elapsed:1) / 1048576);
+    }
+    printf("\n");
+    if(errors){
+        fprintf(stderr, "%s: %lu errors\n", bench->name, errors);
+        ret = -1;
+    }
+    free(ns);
+    free(tids);
+    free(threads);
+    return ret;
+}
+
+static void bench_usage(void)
+{
+    fprintf(stderr, "Usage: memcachefs-bench [-l usec] [-s servers] "
+            "[-t threads] [-n ops] [-k keys] [-b bytes] [-o opt[,opt...]] "
+            "[bench...]\n");
+}
+
+/*
+ * Hand the mount options to the parser of memcachefs, one at a time.
+ */
+static int bench_options(char *opts)
+{
+    struct fuse_args args = FUSE_ARGS_INIT(0, NULL);
+    char *arg;
+    char *save;
+    int ret = 0;
+
+    for(arg = strtok_r(opts, ",", &save); arg;
+        arg = strtok_r(NULL, ",", &save)){
+        memcachefs_opt_proc(&opt, arg, FUSE_OPT_KEY_OPT, &args);
+    }
+    if(args.argc){
+        fprintf(stderr, "unknown option %s\n", args.argv[0]);
+        ret = -1;
+    }
+    fuse_opt_free_args(&args);
+    return ret;
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned int latency = 100;
+    unsigned int i;
+    size_t len;
+    int c;
+    int ret = EXIT_SUCCESS;
+    int found;
+    bench_t *bench;
+
+    while((c = getopt(argc, argv, "l:s:t:n:k:b:o:h")) != -1){
+        switch(c){
+        case 'l':
+            latency = atoi(optarg);
+            break;
+        case 's':
+            bench_nservers = atoi(optarg);
+            break;
+        case 't':
+            bench_threads = atoi(optarg);
+            break;
+        case 'n':
+            bench_ops = strtoul(optarg, NULL, 10);
+            break;
+        case 'k':
+            bench_keys = atoi(optarg);
+            break;
+        case 'b':
+            bench_size = strtoul(optarg, NULL, 10);
+            break;
+        case 'o':
+            if(bench_options(optarg)){
+                return EXIT_FAILURE;
+            }
+            break;
+        default:
+            bench_usage();
+            return EXIT_FAILURE;
+        }
+    }
+    if(!bench_nservers || !bench_threads || !bench_ops || !bench_keys ||
+       !bench_size){
+        bench_usage();
+        return EXIT_FAILURE;
+    }
+    for(i=optind; i<argc; i++){
+        for(bench = benches; bench->name; bench++){
+            if(!strcmp(argv[i], bench->name)){
+                break;
+            }
+        }
+        if(!bench->name){
+            fprintf(stderr, "no benchmark named %s\n", argv[i]);
+            return EXIT_FAILURE;
+        }
+    }
+    bench_ctx.uid = getuid();
+    bench_ctx.gid = getgid();
+    bench_ctx.pid = getpid();
+
+    bench_servers = (fakemc_t**)calloc(bench_nservers, sizeof(fakemc_t*));
+    opt.hosts = (char*)malloc(bench_nservers * 24);
+    if(!bench_servers || !opt.hosts){
+        perror("malloc()");
+        return EXIT_FAILURE;
+    }
+    opt.hosts[0] = '\0';
+    for(i=0, len=0; i<bench_nservers; i++){
+        bench_servers[i] = fakemc_new(latency);
+        if(!bench_servers[i] || fakemc_start(bench_servers[i])){
+            fprintf(stderr, "can't start a server\n");
+            return EXIT_FAILURE;
+        }
+        len += sprintf(opt.hosts + len, "%s127.0.0.1:%s", i?",":"",
+                       bench_servers[i]->port);
+    }
+    if(memcachefs_servers(opt.hosts) || memcachefs_setup()){
+        return EXIT_FAILURE;
+    }
+#if FUSE_USE_VERSION >= 26
+    memcachefs_init(NULL);
+#else
+    memcachefs_init();
+#endif
+
+    if(pools[0]->backend == &conn_memcached){
+        printf("%u threads, %u servers, %u us latency\n", bench_threads,
+               bench_nservers, latency);
+    }else{
+        printf("%u threads, %u shards, %s backend\n", bench_threads,
+               bench_nservers, pools[0]->backend->name);
+    }
+    printf("%-8s %8s %11s %9s %9s %9s %9s %9s %7s %9s\n", "bench", "ops",
+           "ops/s", "p50 us", "p90 us", "p99 us", "p999 us", "max us",
+           "rtt/op", "MB/s");
+    for(bench = benches; bench->name; bench++){
+        found = (optind == argc);
+        for(i=optind; i<argc; i++){
+            found |= !strcmp(argv[i], bench->name);
+        }
+        if(found && bench_one(bench)){
+            ret = EXIT_FAILURE;
+        }
+    }
+
+    memcachefs_destroy(NULL);
+    memcachefs_teardown();
+    for(i=0; i<bench_nservers; i++){
+        fakemc_free(bench_servers[i]);
+    }
+    free(bench_servers);
+    return ret;
+}
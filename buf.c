@@ -0,0 +1,289 @@
+/*
+ * buf.c - file buffer allocator
+ * Copyright (C) 2012 Benoit Vidis <contact@benoitvidis.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+/*
+ * File buffers come from size classes laid out like memcached's own
+ * slabs: starting at BUF_MIN_SIZE and growing by BUF_FACTOR up to the
+ * item size limit. Released buffers go back to a per-class free list, up
+ * to cache_limit bytes overall, so that opening many small files does not
+ * keep hitting malloc. Buffers above the largest class (chunked files)
+ * are plain malloc'd memory, and so are the ones handed over by the
+ * connection with buf_adopt.
+ *
+ * A value read by several holders at once, such as the value cache and
+ * the files opened from it, is shared through a buf_ref_t instead of
+ * being copied for each. Nobody writes to it; a holder wanting to change
+ * its copy takes a buffer of its own first.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "buf.h"
+
+buf_pool_t *buf_pool_new(size_t max_size, size_t cache_limit)
+{
+    buf_pool_t *pool;
+    size_t size = BUF_MIN_SIZE;
+    int i;
+
+    pool = (buf_pool_t*)malloc(sizeof(buf_pool_t));
+    if(!pool){
+        return NULL;
+    }
+    memset(pool, 0, sizeof(buf_pool_t));
+    pool->cache_limit = cache_limit;
+
+    for(i=0; i<BUF_CLASSES - 1 && size < max_size; i++){
+        pool->classes[i].size = size;
+        pthread_mutex_init(&pool->classes[i].mutex, NULL);
+        size = (size_t)(size * BUF_FACTOR);
+        size = (size + 7) & ~(size_t)7;
+    }
+    pool->classes[i].size = max_size;
+    pthread_mutex_init(&pool->classes[i].mutex, NULL);
+    pool->nclasses = i + 1;
+    pool->max_size = max_size;
+
+    return pool;
+}
+
+void buf_pool_free(buf_pool_t *pool)
+{
+    int i;
+    buf_free_t *entry;
+
+    for(i=0; i<pool->nclasses; i++){
+        while((entry = pool->classes[i].free)){
+            pool->classes[i].free = entry->next;
+            free(entry);
+        }
+        pthread_mutex_destroy(&pool->classes[i].mutex);
+    }
+    free(pool);
+}
+
+/*
+ * Smallest class holding size bytes, -1 past the largest one.
+ */
+static int buf_class(buf_pool_t *pool, size_t size)
+{
+    int low = 0;
+    int high = pool->nclasses - 1;
+    int mid;
+
+    if(size > pool->max_size){
+        return -1;
+    }
+    while(low < high){
+        mid = (low + high) / 2;
+        if(pool->classes[mid].size < size){
+            low = mid + 1;
+        }else{
+            high = mid;
+        }
+    }
+    return low;
+}
+
+static void buf_account(buf_pool_t *pool, size_t cap)
+{
+    size_t used;
+
+    used = __sync_add_and_fetch(&pool->used, cap);
+    if(used > pool->peak){
+        pool->peak = used;
+    }
+}
+
+/*
+ * Get a buffer of at least size bytes. Its real size is stored in *cap
+ * and must be given back to buf_grow and buf_release.
+ */
+char *buf_alloc(buf_pool_t *pool, size_t size, size_t *cap)
+{
+    int index;
+    buf_class_t *class;
+    buf_free_t *entry = NULL;
+    char *buf;
+
+    if(size < BUF_MIN_SIZE){
+        size = BUF_MIN_SIZE;
+    }
+    index = buf_class(pool, size);
+    if(index < 0){
+        buf = (char*)malloc(size);
+        if(buf){
+            *cap = size;
+            __sync_fetch_and_add(&pool->large_allocs, 1);
+            buf_account(pool, size);
+        }
+        return buf;
+    }
+
+    class = &pool->classes[index];
+    pthread_mutex_lock(&class->mutex);
+    class->allocs++;
+    if(class->free){
+        entry = class->free;
+        class->free = entry->next;
+        class->nfree--;
+        class->hits++;
+    }
+    pthread_mutex_unlock(&class->mutex);
+
+    if(entry){
+        __sync_fetch_and_sub(&pool->cached, class->size);
+        buf = (char*)entry;
+    }else{
+        buf = (char*)malloc(class->size);
+        if(!buf){
+            return NULL;
+        }
+    }
+    *cap = class->size;
+    buf_account(pool, class->size);
+    return buf;
+}
+
+/*
+ * Resize a buffer to hold at least size bytes, keeping its first len
+ * bytes. Grows geometrically so that a file written by small appends
+ * only moves a logarithmic number of times.
+ */
+char *buf_grow(buf_pool_t *pool, char *buf, size_t len, size_t cap,
+               size_t size, size_t *newcap)
+{
+    char *newbuf;
+
+    if(size <= cap){
+        *newcap = cap;
+        return buf;
+    }
+    if(size < cap * 2){
+        size = cap * 2;
+    }
+    if(buf && cap > pool->max_size){
+        newbuf = (char*)realloc(buf, size);
+        if(newbuf){
+            *newcap = size;
+            buf_account(pool, size - cap);
+        }
+        return newbuf;
+    }
+    newbuf = buf_alloc(pool, size, newcap);
+    if(!newbuf){
+        return NULL;
+    }
+    if(buf){
+        memcpy(newbuf, buf, len);
+        buf_release(pool, buf, cap);
+    }
+    return newbuf;
+}
+
+/*
+ * Take over a malloc'd buffer of cap bytes, so that a received value can
+ * become a file buffer without being copied.
+ */
+char *buf_adopt(buf_pool_t *pool, void *buf, size_t cap)
+{
+    buf_account(pool, cap);
+    return (char*)buf;
+}
+
+void buf_release(buf_pool_t *pool, char *buf, size_t cap)
+{
+    int index;
+    buf_class_t *class;
+    buf_free_t *entry = (buf_free_t*)buf;
+
+    if(!buf){
+        return;
+    }
+    __sync_fetch_and_sub(&pool->used, cap);
+    index = buf_class(pool, cap);
+    if(index < 0 || pool->classes[index].size != cap ||
+       __sync_add_and_fetch(&pool->cached, cap) > pool->cache_limit){
+        if(index >= 0 && pool->classes[index].size == cap){
+            __sync_fetch_and_sub(&pool->cached, cap);
+        }
+        free(buf);
+        return;
+    }
+
+    class = &pool->classes[index];
+    pthread_mutex_lock(&class->mutex);
+    entry->next = class->free;
+    class->free = entry;
+    class->nfree++;
+    pthread_mutex_unlock(&class->mutex);
+}
+
+/*
+ * Share a malloc'd buffer of len bytes, taken over as with buf_adopt.
+ * The caller holds the first reference.
+ */
+buf_ref_t *buf_ref_new(buf_pool_t *pool, void *buf, size_t len)
+{
+    buf_ref_t *ref;
+
+    ref = (buf_ref_t*)malloc(sizeof(buf_ref_t));
+    if(!ref){
+        return NULL;
+    }
+    ref->refs = 1;
+    ref->data = buf_adopt(pool, buf, len);
+    ref->len = len;
+    return ref;
+}
+
+buf_ref_t *buf_ref_get(buf_ref_t *ref)
+{
+    __sync_fetch_and_add(&ref->refs, 1);
+    return ref;
+}
+
+void buf_ref_put(buf_pool_t *pool, buf_ref_t *ref)
+{
+    if(__sync_sub_and_fetch(&ref->refs, 1)){
+        return;
+    }
+    buf_release(pool, ref->data, ref->len);
+    free(ref);
+}
+
+void buf_pool_stats(buf_pool_t *pool, FILE *fp)
+{
+    int i;
+    buf_class_t *class;
+
+    fprintf(fp, "buffers: used %zu bytes, peak %zu bytes, cached %zu bytes, "
+            "large %lu\n", pool->used, pool->peak, pool->cached,
+            pool->large_allocs);
+    for(i=0; i<pool->nclasses; i++){
+        class = &pool->classes[i];
+        if(!class->allocs){
+            continue;
+        }
+        fprintf(fp, "  class %2d: size %7zu allocs %lu hits %lu free %zu\n",
+                i, class->size, class->allocs, class->hits, class->nfree);
+    }
+}
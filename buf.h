@@ -0,0 +1,65 @@
+/*
+ * buf.h - file buffer allocator
+ * Copyright (C) 2012 Benoit Vidis <contact@benoitvidis.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#define BUF_CLASSES 64
+#define BUF_MIN_SIZE 64
+#define BUF_FACTOR 1.25
+
+typedef struct buf_free{
+    struct buf_free *next;
+}buf_free_t;
+
+typedef struct{
+    size_t size;
+    buf_free_t *free;
+    size_t nfree;
+    unsigned long allocs;
+    unsigned long hits;
+    pthread_mutex_t mutex;
+}buf_class_t;
+
+typedef struct{
+    buf_class_t classes[BUF_CLASSES];
+    int nclasses;
+    size_t max_size;
+    size_t cache_limit;
+    size_t cached;      // bytes sitting on the free lists
+    size_t used;        // bytes handed out
+    size_t peak;
+    unsigned long large_allocs;
+}buf_pool_t;
+
+// a value shared read-only by its holders, released with the last one
+typedef struct{
+    int refs;
+    char *data;
+    size_t len;
+}buf_ref_t;
+
+buf_pool_t *buf_pool_new(size_t max_size, size_t cache_limit);
+void buf_pool_free(buf_pool_t *pool);
+char *buf_alloc(buf_pool_t *pool, size_t size, size_t *cap);
+char *buf_grow(buf_pool_t *pool, char *buf, size_t len, size_t cap,
+               size_t size, size_t *newcap);
+char *buf_adopt(buf_pool_t *pool, void *buf, size_t cap);
+void buf_release(buf_pool_t *pool, char *buf, size_t cap);
+buf_ref_t *buf_ref_new(buf_pool_t *pool, void *buf, size_t len);
+buf_ref_t *buf_ref_get(buf_ref_t *ref);
+void buf_ref_put(buf_pool_t *pool, buf_ref_t *ref);
+void buf_pool_stats(buf_pool_t *pool, FILE *fp);
@@ -0,0 +1,320 @@
+/*
+ * chunk.c - chunked storage of large files
+ * Copyright (C) 2012 Benoit Vidis <contact@benoitvidis.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+/*
+ * Files larger than a memcached item are split into fixed-size chunks.
+ * Chunk 0 lives under the file key itself, so small files and the head
+ * of large ones look the same to a plain memcached client; chunk N lives
+ * under "mcfs:chunk:N:<key>". The chunk size and the file size come from
+ * the metadata record, which acts as the manifest.
+ *
+ * Transfers of several chunks are spread over up to `threads' pooled
+ * connections. The caller's own handle always takes part, so a transfer
+ * makes progress even when the pool is exhausted. Each connection claims
+ * up to CHUNK_BATCH chunks at a time and pipelines them, and fetched
+ * chunks are received in place in the file buffer.
+ *
+ * Appending to a file only sends the new bytes: the last chunk is
+ * extended with memcached's append, and the chunks past it are set.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include "memcachefs.h"
+#include "conn.h"
+#include "handle.h"
+#include "chunk.h"
+
+// chunks pipelined by a connection at a time
+#define CHUNK_BATCH 8
+
+typedef struct{
+    handle_pool_t *pool;
+    const char *key;
+    char *buf;
+    size_t len;
+    size_t chunk;
+    const size_t *index;
+    size_t count;
+    size_t next;
+    unsigned int threads;
+    int store;
+    int error;
+    pthread_mutex_t mutex;
+}chunk_job_t;
+
+int chunk_key(const char *key, size_t index, char *buf, size_t size)
+{
+    int len;
+
+    if(index == 0){
+        len = snprintf(buf, size, "%s", key);
+    }else{
+        len = snprintf(buf, size, "%s%zu:%s", CHUNK_PREFIX, index, key);
+    }
+    if(len < 0 || len >= size || len > MEMCACHEFS_KEY_MAX){
+        return -1;
+    }
+    return len;
+}
+
+static int chunk_transfer(handle_t *handle, chunk_job_t *job,
+                          const size_t *index, size_t count)
+{
+    char ckeys[CHUNK_BATCH][MEMCACHEFS_KEY_MAX + 1];
+    conn_req_t reqs[CHUNK_BATCH];
+    int ckeylen;
+    size_t off;
+    size_t len;
+    size_t i;
+    int ret = 0;
+
+    memset(reqs, 0, sizeof(reqs));
+    for(i=0; i<count; i++){
+        ckeylen = chunk_key(job->key, index[i], ckeys[i], sizeof(ckeys[i]));
+        if(ckeylen < 0){
+            return -1;
+        }
+        off = index[i] * job->chunk;
+        len = job->len - off;
+        len = (len < job->chunk)?len:job->chunk;
+
+        reqs[i].key = ckeys[i];
+        reqs[i].keylen = ckeylen;
+        if(job->store){
+            reqs[i].op = CONN_SET;
+            reqs[i].val = job->buf + off;
+            reqs[i].len = len;
+        }else{
+            reqs[i].op = CONN_GET;
+            reqs[i].buf = job->buf + off;
+            reqs[i].bufsize = len;
+        }
+    }
+    if(conn_exec(handle->conn, reqs, count)){
+        ret = -1;
+    }
+    for(i=0; i<count; i++){
+        if(reqs[i].status != CONN_OK){
+            ret = -1;
+            continue;
+        }
+        // a chunk of the wrong size belongs to another version of the file
+        if(!job->store && reqs[i].bytes != reqs[i].bufsize){
+            ret = -1;
+        }
+        if(reqs[i].data != reqs[i].buf){
+            free(reqs[i].data);
+        }
+    }
+    return ret;
+}
+
+static void chunk_work(handle_t *handle, chunk_job_t *job)
+{
+    size_t first;
+    size_t count;
+
+    for(;;){
+        pthread_mutex_lock(&job->mutex);
+        if(job->error || job->next >= job->count){
+            pthread_mutex_unlock(&job->mutex);
+            break;
+        }
+        // leave some to the other connections while there are few left
+        count = (job->count - job->next + job->threads - 1) / job->threads;
+        count = (count < CHUNK_BATCH)?count:CHUNK_BATCH;
+        first = job->next;
+        job->next += count;
+        pthread_mutex_unlock(&job->mutex);
+
+        if(chunk_transfer(handle, job, job->index + first, count)){
+            pthread_mutex_lock(&job->mutex);
+            job->error = 1;
+            pthread_mutex_unlock(&job->mutex);
+        }
+    }
+}
+
+static void *chunk_thread(void *arg)
+{
+    chunk_job_t *job = (chunk_job_t*)arg;
+    handle_t *handle;
+
+    handle = handle_tryget(job->pool);
+    if(!handle){
+        return NULL;
+    }
+    chunk_work(handle, job);
+    handle_release(job->pool, handle->index);
+    return NULL;
+}
+
+static int chunk_run(handle_t *handle, chunk_job_t *job, unsigned int threads)
+{
+    pthread_t *tids = NULL;
+    unsigned int i;
+    unsigned int started = 0;
+
+    if(threads > job->count){
+        threads = job->count;
+    }
+    job->threads = threads?threads:1;
+    if(threads > 1){
+        tids = (pthread_t*)malloc(sizeof(pthread_t) * (threads - 1));
+    }
+    if(tids){
+        for(i=0; i<threads - 1; i++){
+            if(pthread_create(&tids[started], NULL, chunk_thread, job)){
+                break;
+            }
+            started++;
+        }
+    }
+    chunk_work(handle, job);
+    for(i=0; i<started; i++){
+        pthread_join(tids[i], NULL);
+    }
+    free(tids);
+    pthread_mutex_destroy(&job->mutex);
+
+    return job->error?-1:0;
+}
+
+int chunk_fetch(handle_pool_t *pool, handle_t *handle, const char *key,
+                char *buf, size_t len, size_t chunk,
+                const size_t *index, size_t count, unsigned int threads)
+{
+    chunk_job_t job;
+
+    memset(&job, 0, sizeof(job));
+    job.pool = pool;
+    job.key = key;
+    job.buf = buf;
+    job.len = len;
+    job.chunk = chunk;
+    job.index = index;
+    job.count = count;
+    pthread_mutex_init(&job.mutex, NULL);
+
+    return chunk_run(handle, &job, threads);
+}
+
+int chunk_store(handle_pool_t *pool, handle_t *handle, const char *key,
+                const char *buf, size_t len, size_t chunk,
+                const size_t *index, size_t count, unsigned int threads)
+{
+    chunk_job_t job;
+
+    memset(&job, 0, sizeof(job));
+    job.pool = pool;
+    job.key = key;
+    job.buf = (char *)buf;
+    job.len = len;
+    job.chunk = chunk;
+    job.index = index;
+    job.count = count;
+    job.store = 1;
+    pthread_mutex_init(&job.mutex, NULL);
+
+    return chunk_run(handle, &job, threads);
+}
+
+void chunk_delete(handle_t *handle, const char *key, size_t first,
+                  size_t last)
+{
+    char ckeys[CHUNK_BATCH][MEMCACHEFS_KEY_MAX + 1];
+    conn_req_t reqs[CHUNK_BATCH];
+    int ckeylen;
+    size_t i;
+    size_t n = 0;
+
+    memset(reqs, 0, sizeof(reqs));
+    for(i=(first?first:1); i<last; i++){
+        ckeylen = chunk_key(key, i, ckeys[n], sizeof(ckeys[n]));
+        if(ckeylen < 0){
+            continue;
+        }
+        reqs[n].op = CONN_DELETE;
+        reqs[n].key = ckeys[n];
+        reqs[n].keylen = ckeylen;
+        if(++n == CHUNK_BATCH){
+            conn_exec(handle->conn, reqs, n);
+            n = 0;
+        }
+    }
+    if(n){
+        conn_exec(handle->conn, reqs, n);
+    }
+}
+
+/*
+ * Add len bytes at the end of a file of size bytes split in chunks of
+ * chunk bytes, 0 when it is a single value.
+ */
+int chunk_append(handle_t *handle, const char *key, const char *buf,
+                 size_t len, size_t size, size_t chunk)
+{
+    char ckeys[CHUNK_BATCH][MEMCACHEFS_KEY_MAX + 1];
+    conn_req_t reqs[CHUNK_BATCH];
+    int ckeylen;
+    size_t index;
+    size_t piece;
+    size_t off = 0;
+    size_t n = 0;
+    size_t i;
+    int ret = 0;
+
+    if(!chunk){
+        chunk = size + len;
+    }
+    memset(reqs, 0, sizeof(reqs));
+    while(off < len && !ret){
+        index = (size + off) / chunk;
+        piece = (index + 1) * chunk - (size + off);
+        piece = (piece < len - off)?piece:len - off;
+        ckeylen = chunk_key(key, index, ckeys[n], sizeof(ckeys[n]));
+        if(ckeylen < 0){
+            return -1;
+        }
+        reqs[n].op = (index * chunk < size)?CONN_APPEND:CONN_SET;
+        reqs[n].key = ckeys[n];
+        reqs[n].keylen = ckeylen;
+        reqs[n].val = buf + off;
+        reqs[n].len = piece;
+        off += piece;
+        if(++n < CHUNK_BATCH && off < len){
+            continue;
+        }
+        if(conn_exec(handle->conn, reqs, n)){
+            ret = -1;
+        }
+        for(i=0; i<n; i++){
+            if(reqs[i].status != CONN_OK){
+                ret = -1;
+            }
+        }
+        n = 0;
+    }
+    return ret;
+}
@@ -0,0 +1,34 @@
+/*
+ * chunk.h - chunked storage of large files
+ * Copyright (C) 2012 Benoit Vidis <contact@benoitvidis.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#define CHUNK_PREFIX MEMCACHEFS_RESERVED "chunk:"
+// "<prefix><index>:" in front of the file key
+#define CHUNK_KEY_OVERHEAD (sizeof(CHUNK_PREFIX) + 21)
+
+int chunk_key(const char *key, size_t index, char *buf, size_t size);
+int chunk_fetch(handle_pool_t *pool, handle_t *handle, const char *key,
+                char *buf, size_t len, size_t chunk,
+                const size_t *index, size_t count, unsigned int threads);
+int chunk_store(handle_pool_t *pool, handle_t *handle, const char *key,
+                const char *buf, size_t len, size_t chunk,
+                const size_t *index, size_t count, unsigned int threads);
+void chunk_delete(handle_t *handle, const char *key, size_t first,
+                  size_t last);
+int chunk_append(handle_t *handle, const char *key, const char *buf,
+                 size_t len, size_t size, size_t chunk);
@@ -0,0 +1,951 @@
+/*
+ * conn.c - storage backends, and the memcached meta protocol client
+ * Copyright (C) 2012 Benoit Vidis <contact@benoitvidis.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+/*
+ * Everything stored goes through a conn_t, whose backend says where it
+ * ends up: on memcached servers, or in the memory of this process (see
+ * memstore.c). The backend is chosen once for the mount.
+ *
+ * A memcached connection speaks the meta protocol (mg/ms/md) of memcached
+ * 1.6. A batch of requests is written out in one go and the replies are
+ * read back in the same order, so that n requests cost one round-trip instead
+ * of n. Values are received straight into the caller's buffer when it
+ * gives one, and written from it without being copied.
+ *
+ * Replies only come back once the server read the requests. If a batch
+ * had large values going both ways, both sides could end up blocked on
+ * full socket buffers. Batches are therefore split so that no store
+ * follows a get within the requests written before reading: stores only
+ * get short replies, and gets are short requests. Nor are more than
+ * CONN_BATCH requests written before reading, since the replies to
+ * thousands of gets would fill the buffers as well.
+ *
+ * Keys holding spaces or control characters are sent base64 encoded.
+ * The socket is opened on first use, and closed on any error so that the
+ * next request starts on a clean stream.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include "memcachefs.h"
+#include "conn.h"
+#include "stats.h"
+
+static const char conn_b64[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+/*
+ * The backends mount options may name.
+ */
+static const conn_backend_t *conn_backends[] = {
+    &conn_memcached,
+    &memstore_backend,
+};
+
+const conn_backend_t *conn_backend(const char *name)
+{
+    size_t i;
+
+    if(!name){
+        return &conn_memcached;
+    }
+    for(i=0; i<sizeof(conn_backends)/sizeof(conn_backends[0]); i++){
+        if(!strcmp(conn_backends[i]->name, name)){
+            return conn_backends[i];
+        }
+    }
+    return NULL;
+}
+
+conn_t *conn_new(const conn_backend_t *backend, void *server)
+{
+    return backend->open(server);
+}
+
+void conn_free(conn_t *conn)
+{
+    conn->backend->free(conn);
+}
+
+void conn_close(conn_t *conn)
+{
+    conn->backend->close(conn);
+}
+
+/*
+ * Run a batch of requests, filling in their status and results. Values
+ * fetched into a malloc'd buffer (data != buf) belong to the caller.
+ * Returns -1 when the connection failed, the requests not answered then
+ * have status CONN_ERROR.
+ */
+int conn_exec(conn_t *conn, conn_req_t *reqs, size_t n)
+{
+    return conn->backend->exec(conn, reqs, n);
+}
+
+/*
+ * Start listing every key of the server. The connection serves nothing
+ * else until conn_list_end().
+ */
+int conn_list_start(conn_t *conn)
+{
+    return conn->backend->list_start(conn);
+}
+
+/*
+ * Get the next key of the listing, and its value size when the backend
+ * tells it (-1 otherwise). Returns 1 for an entry, 0 at the end and
+ * -errno on error.
+ */
+int conn_list_next(conn_t *conn, char *key, size_t size, ssize_t *len)
+{
+    return conn->backend->list_next(conn, key, size, len);
+}
+
+/*
+ * End a listing, done when conn_list_next() returned 0 or an error.
+ */
+void conn_list_end(conn_t *conn, int done)
+{
+    conn->backend->list_end(conn, done);
+}
+
+static void *conn_mc_server_new(server_t *server)
+{
+    conn_mc_server_t *mc;
+
+    mc = (conn_mc_server_t*)malloc(sizeof(conn_mc_server_t));
+    if(!mc){
+        return NULL;
+    }
+    mc->host = server->host;
+    mc->port = server->port;
+    mc->no_metadump = 0;
+    return mc;
+}
+
+static void conn_mc_server_free(void *server)
+{
+    free(server);
+}
+
+static conn_t *conn_mc_open(void *server)
+{
+    conn_mc_t *conn;
+
+    conn = (conn_mc_t*)malloc(sizeof(conn_mc_t));
+    if(!conn){
+        return NULL;
+    }
+    memset(conn, 0, sizeof(conn_mc_t));
+    conn->rbuf = (char*)malloc(CONN_RBUF_SIZE);
+    if(!conn->rbuf){
+        free(conn);
+        return NULL;
+    }
+    conn->conn.backend = &conn_memcached;
+    conn->fd = -1;
+    conn->server = (conn_mc_server_t*)server;
+    conn->state = CONN_LIST_END;
+    return &conn->conn;
+}
+
+static void conn_mc_close(conn_t *c)
+{
+    conn_mc_t *conn = (conn_mc_t*)c;
+
+    if(conn->fd >= 0){
+        close(conn->fd);
+        conn->fd = -1;
+    }
+    conn->rstart = 0;
+    conn->rend = 0;
+    conn->niov = 0;
+    conn->ncmds = 0;
+}
+
+static void conn_mc_free(conn_t *c)
+{
+    conn_mc_t *conn = (conn_mc_t*)c;
+
+    conn_mc_close(c);
+    free(conn->classes);
+    free(conn->rbuf);
+    free(conn);
+}
+
+static int conn_connect(conn_mc_t *conn)
+{
+    int fd = -1;
+    int one = 1;
+    struct addrinfo hints;
+    struct addrinfo *res;
+    struct addrinfo *ai;
+
+    if(conn->fd >= 0){
+        return 0;
+    }
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if(getaddrinfo(conn->server->host, conn->server->port, &hints, &res)){
+        return -1;
+    }
+    for(ai = res; ai; ai = ai->ai_next){
+        fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if(fd < 0){
+            continue;
+        }
+        if(!connect(fd, ai->ai_addr, ai->ai_addrlen)){
+            break;
+        }
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+    if(fd < 0){
+        return -1;
+    }
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    conn->fd = fd;
+    return 0;
+}
+
+/*
+ * Write out the gathered iovecs.
+ */
+static int conn_flush(conn_mc_t *conn)
+{
+    struct msghdr msg;
+    struct iovec *iov = conn->iov;
+    int niov = conn->niov;
+    ssize_t ret;
+
+    while(niov){
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = niov;
+        ret = sendmsg(conn->fd, &msg, MSG_NOSIGNAL);
+        if(ret < 0){
+            if(errno == EINTR){
+                continue;
+            }
+            return -1;
+        }
+        stats_add(STATS_BYTES_SENT, ret);
+        while(niov && ret >= iov->iov_len){
+            ret -= iov->iov_len;
+            iov++;
+            niov--;
+        }
+        if(niov){
+            iov->iov_base = (char*)iov->iov_base + ret;
+            iov->iov_len -= ret;
+        }
+    }
+    conn->niov = 0;
+    conn->ncmds = 0;
+    return 0;
+}
+
+static void conn_push(conn_mc_t *conn, const void *buf, size_t len)
+{
+    conn->iov[conn->niov].iov_base = (void*)buf;
+    conn->iov[conn->niov].iov_len = len;
+    conn->niov++;
+}
+
+/*
+ * Write the key into a command, base64 encoded when it can't go as is.
+ * Returns the length written, -1 when it does not fit.
+ */
+static int conn_key(const char *key, size_t keylen, char *buf, size_t size,
+                    int *b64)
+{
+    size_t i;
+    size_t n = 0;
+    unsigned int v;
+
+    *b64 = 0;
+    for(i=0; i<keylen; i++){
+        if((unsigned char)key[i] <= ' ' || key[i] == 0x7f){
+            *b64 = 1;
+            break;
+        }
+    }
+    if(!*b64){
+        if(keylen >= size){
+            return -1;
+        }
+        memcpy(buf, key, keylen);
+        return keylen;
+    }
+    if((keylen + 2) / 3 * 4 >= size){
+        return -1;
+    }
+    for(i=0; i<keylen; i+=3){
+        v = (unsigned char)key[i] << 16;
+        if(i + 1 < keylen){
+            v |= (unsigned char)key[i + 1] << 8;
+        }
+        if(i + 2 < keylen){
+            v |= (unsigned char)key[i + 2];
+        }
+        buf[n++] = conn_b64[(v >> 18) & 63];
+        buf[n++] = conn_b64[(v >> 12) & 63];
+        buf[n++] = (i + 1 < keylen)?conn_b64[(v >> 6) & 63]:'=';
+        buf[n++] = (i + 2 < keylen)?conn_b64[v & 63]:'=';
+    }
+    return n;
+}
+
+/*
+ * Queue the command of a request, flushing when the batch is full.
+ */
+static int conn_queue(conn_mc_t *conn, conn_req_t *req)
+{
+    char *cmd;
+    int len;
+    int klen;
+    int b64;
+    const char *flags = "";
+    size_t size = CONN_CMD_MAX;
+
+    if(conn->ncmds == CONN_BATCH && conn_flush(conn)){
+        return -1;
+    }
+    cmd = conn->cmds[conn->ncmds];
+    switch(req->op){
+    case CONN_GET:
+    case CONN_STAT:
+    case CONN_DELETE:
+        len = snprintf(cmd, size, "%s ", (req->op == CONN_DELETE)?"md":"mg");
+        break;
+    default:
+        len = snprintf(cmd, size, "ms ");
+    }
+    klen = conn_key(req->key, req->keylen, cmd + len, size - len, &b64);
+    if(klen < 0){
+        return -1;
+    }
+    len += klen;
+    switch(req->op){
+    case CONN_GET:
+        flags = " v c f";
+        break;
+    case CONN_STAT:
+        flags = " s c f";
+        break;
+    case CONN_DELETE:
+        break;
+    case CONN_SET:
+        flags = " MS";
+        break;
+    case CONN_ADD:
+        flags = " ME";
+        break;
+    case CONN_APPEND:
+        flags = " MA";
+        break;
+    }
+    if(req->op >= CONN_SET && req->op <= CONN_APPEND){
+        len += snprintf(cmd + len, size - len, " %zu", req->len);
+    }
+    len += snprintf(cmd + len, size - len, "%s%s", b64?" b":"", flags);
+    if(req->flags && (req->op == CONN_SET || req->op == CONN_ADD)){
+        len += snprintf(cmd + len, size - len, " F%u", req->flags);
+    }
+    if(req->cas && req->op != CONN_GET && req->op != CONN_STAT){
+        len += snprintf(cmd + len, size - len, " C%llu", req->cas);
+    }
+    len += snprintf(cmd + len, size - len, "\r\n");
+    if(len >= size){
+        return -1;
+    }
+    conn->ncmds++;
+    conn_push(conn, cmd, len);
+    if(req->op >= CONN_SET && req->op <= CONN_APPEND){
+        if(req->len){
+            conn_push(conn, req->val, req->len);
+        }
+        conn_push(conn, "\r\n", 2);
+    }
+    return 0;
+}
+
+/*
+ * Read more of the reply into the read buffer.
+ */
+static int conn_fill(conn_mc_t *conn)
+{
+    ssize_t len;
+
+    if(conn->rstart == conn->rend){
+        conn->rstart = 0;
+        conn->rend = 0;
+    }else if(conn->rstart){
+        memmove(conn->rbuf, conn->rbuf + conn->rstart,
+                conn->rend - conn->rstart);
+        conn->rend -= conn->rstart;
+        conn->rstart = 0;
+    }
+    if(conn->rend == CONN_RBUF_SIZE){
+        return -1;
+    }
+    for(;;){
+        len = read(conn->fd, conn->rbuf + conn->rend,
+                   CONN_RBUF_SIZE - conn->rend);
+        if(len < 0 && errno == EINTR){
+            continue;
+        }
+        if(len <= 0){
+            return -1;
+        }
+        stats_add(STATS_BYTES_RECEIVED, len);
+        conn->rend += len;
+        return 0;
+    }
+}
+
+/*
+ * Next line of the reply without its line end, NULL on error. It stays
+ * valid until the connection is read again.
+ */
+static char *conn_line(conn_mc_t *conn)
+{
+    char *line;
+    char *eol;
+
+    for(;;){
+        eol = memchr(conn->rbuf + conn->rstart, '\n',
+                     conn->rend - conn->rstart);
+        if(eol){
+            line = conn->rbuf + conn->rstart;
+            conn->rstart = eol - conn->rbuf + 1;
+            if(eol > line && eol[-1] == '\r'){
+                eol--;
+            }
+            *eol = '\0';
+            return line;
+        }
+        if(conn_fill(conn)){
+            return NULL;
+        }
+    }
+}
+
+/*
+ * Read a value of len bytes and its line end into dst, or drop it when
+ * dst is NULL. Large values go straight from the socket to dst.
+ */
+static int conn_value(conn_mc_t *conn, char *dst, size_t len)
+{
+    size_t n;
+    ssize_t ret;
+
+    len += 2;
+    while(len){
+        if(conn->rstart == conn->rend && dst && len > 2 &&
+           len - 2 >= CONN_RBUF_SIZE / 2){
+            ret = read(conn->fd, dst, len - 2);
+            if(ret < 0 && errno == EINTR){
+                continue;
+            }
+            if(ret <= 0){
+                return -1;
+            }
+            stats_add(STATS_BYTES_RECEIVED, ret);
+            dst += ret;
+            len -= ret;
+            continue;
+        }
+        if(conn->rstart == conn->rend && conn_fill(conn)){
+            return -1;
+        }
+        n = conn->rend - conn->rstart;
+        n = (n < len)?n:len;
+        if(dst && len > 2){
+            // the line end is not part of the value
+            ret = (n < len - 2)?n:len - 2;
+            memcpy(dst, conn->rbuf + conn->rstart, ret);
+            dst += ret;
+        }
+        conn->rstart += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/*
+ * Pick the s<size>, c<cas> and f<flags> flags of a reply line.
+ */
+static void conn_flags(conn_req_t *req, char *flags)
+{
+    char *tok;
+    char *save;
+
+    for(tok = strtok_r(flags, " ", &save); tok;
+        tok = strtok_r(NULL, " ", &save)){
+        if(tok[0] == 's'){
+            req->bytes = strtoull(tok + 1, NULL, 10);
+        }else if(tok[0] == 'c'){
+            req->cas = strtoull(tok + 1, NULL, 10);
+        }else if(tok[0] == 'f'){
+            req->flags = strtoul(tok + 1, NULL, 10);
+        }
+    }
+}
+
+/*
+ * Read the reply of a request. Returns -1 when the stream can't be
+ * trusted anymore.
+ */
+static int conn_reply(conn_mc_t *conn, conn_req_t *req)
+{
+    char *line;
+    char *end;
+    size_t len;
+    char *dst;
+
+    line = conn_line(conn);
+    if(!line){
+        return -1;
+    }
+    if(!strncmp(line, "VA ", 3)){
+        len = strtoull(line + 3, &end, 10);
+        conn_flags(req, end);
+        req->bytes = len;
+        if(req->buf && len <= req->bufsize){
+            dst = req->buf;
+        }else{
+            dst = (char*)malloc(len?len:1);
+        }
+        if(conn_value(conn, dst, len)){
+            if(dst != req->buf){
+                free(dst);
+            }
+            return -1;
+        }
+        if(!dst){
+            req->status = CONN_ERROR;
+            return 0;
+        }
+        req->data = dst;
+        req->status = CONN_OK;
+    }else if(!strncmp(line, "HD", 2)){
+        conn_flags(req, line + 2);
+        req->status = CONN_OK;
+    }else if(!strcmp(line, "EN") || !strcmp(line, "NF")){
+        req->status = CONN_MISS;
+    }else if(!strcmp(line, "NS") || !strcmp(line, "EX")){
+        req->status = CONN_NOTSTORED;
+    }else if(!strncmp(line, "SERVER_ERROR", 12)){
+        req->status = CONN_ERROR;
+    }else{
+        // ERROR, CLIENT_ERROR or garbage: the stream is out of step
+        req->status = CONN_ERROR;
+        return -1;
+    }
+    return 0;
+}
+
+static int conn_is_store(const conn_req_t *req)
+{
+    return req->op >= CONN_SET && req->op <= CONN_APPEND;
+}
+
+static int conn_mc_exec(conn_t *c, conn_req_t *reqs, size_t n)
+{
+    conn_mc_t *conn = (conn_mc_t*)c;
+    size_t i;
+    size_t first = 0;
+    size_t end;
+    int gets;
+    unsigned long long start;
+
+    for(i=0; i<n; i++){
+        reqs[i].status = CONN_ERROR;
+        reqs[i].data = NULL;
+        reqs[i].bytes = 0;
+        if(reqs[i].op == CONN_GET || reqs[i].op == CONN_STAT){
+            reqs[i].cas = 0;
+            reqs[i].flags = 0;
+        }
+    }
+    if(conn_connect(conn)){
+        return -1;
+    }
+    while(first < n){
+        gets = 0;
+        for(end = first; end < n && end - first < CONN_BATCH; end++){
+            if(conn_is_store(&reqs[end]) && gets){
+                break;
+            }
+            gets |= !conn_is_store(&reqs[end]);
+        }
+        start = stats_now();
+        for(i=first; i<end; i++){
+            if(conn_queue(conn, &reqs[i])){
+                break;
+            }
+        }
+        if(i < end || conn_flush(conn)){
+            stats_time(STATS_RTT, start, 1);
+            conn_mc_close(&conn->conn);
+            return -1;
+        }
+        for(i=first; i<end; i++){
+            if(conn_reply(conn, &reqs[i])){
+                stats_time(STATS_RTT, start, 1);
+                conn_mc_close(&conn->conn);
+                return -1;
+            }
+        }
+        stats_time(STATS_RTT, start, 0);
+        first = end;
+    }
+    return 0;
+}
+
+/*
+ * Get a value into a malloc'd buffer, NULL when missing.
+ */
+void *conn_get(conn_t *conn, const char *key, size_t *len)
+{
+    conn_req_t req;
+
+    memset(&req, 0, sizeof(req));
+    req.op = CONN_GET;
+    req.key = key;
+    req.keylen = strlen(key);
+    if(conn_exec(conn, &req, 1) || req.status != CONN_OK){
+        return NULL;
+    }
+    *len = req.bytes;
+    return req.data;
+}
+
+/*
+ * Store a value with CONN_SET, CONN_ADD or CONN_APPEND. Returns 0 when
+ * stored.
+ */
+int conn_store(conn_t *conn, int op, const char *key, const void *val,
+               size_t len)
+{
+    conn_req_t req;
+
+    memset(&req, 0, sizeof(req));
+    req.op = op;
+    req.key = key;
+    req.keylen = strlen(key);
+    req.val = (const char*)val;
+    req.len = len;
+    if(conn_exec(conn, &req, 1) || req.status != CONN_OK){
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Returns 0 when the key was deleted.
+ */
+int conn_delete(conn_t *conn, const char *key)
+{
+    conn_req_t req;
+
+    memset(&req, 0, sizeof(req));
+    req.op = CONN_DELETE;
+    req.key = key;
+    req.keylen = strlen(key);
+    if(conn_exec(conn, &req, 1) || req.status != CONN_OK){
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Send a raw text protocol command, for the ones without a meta form.
+ * Read the reply with conn_line().
+ */
+static int conn_send(conn_mc_t *conn, const char *cmd)
+{
+    if(conn_connect(conn)){
+        return -1;
+    }
+    conn->niov = 0;
+    conn_push(conn, cmd, strlen(cmd));
+    if(conn_flush(conn)){
+        conn_mc_close(&conn->conn);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Ask for the items of the current slab class.
+ */
+static int conn_mc_cachedump(conn_mc_t *conn)
+{
+    char cmd[64];
+
+    snprintf(cmd, sizeof(cmd), "stats cachedump %d 0\r\n",
+             conn->classes[conn->class]);
+    return conn_send(conn, cmd);
+}
+
+/*
+ * Read the slab classes holding items, then ask for the first of them.
+ */
+static int conn_mc_items(conn_mc_t *conn)
+{
+    char *line;
+    char *tmp;
+    int class;
+    int *classes;
+
+    if(conn_send(conn, "stats items\r\n")){
+        return -1;
+    }
+    while((line = conn_line(conn))){
+        if(!strcmp(line, "END")){
+            break;
+        }
+        // STAT items:<class>:number <count>
+        if(strncmp(line, "STAT items:", 11)){
+            return -1;
+        }
+        class = strtol(line + 11, &tmp, 10);
+        if(strncmp(tmp, ":number ", 8)){
+            continue;
+        }
+        classes = (int*)realloc(conn->classes,
+                                sizeof(int) * (conn->nclasses + 1));
+        if(!classes){
+            return -1;
+        }
+        conn->classes = classes;
+        conn->classes[conn->nclasses++] = class;
+    }
+    if(!line){
+        return -1;
+    }
+
+    conn->state = CONN_LIST_CACHEDUMP;
+    conn->class = 0;
+    if(!conn->nclasses){
+        return 0;
+    }
+    return conn_mc_cachedump(conn);
+}
+
+/*
+ * `lru_crawler metadump all' walks every item, when the server knows it.
+ * Older servers fall back to `stats items' followed by a `stats cachedump'
+ * per slab class, which memcached caps at 2MB of reply per class. A server
+ * answering ERROR to metadump is not asked again; the others still are.
+ */
+static int conn_mc_list_start(conn_t *c)
+{
+    conn_mc_t *conn = (conn_mc_t*)c;
+    char *line;
+
+    conn->first = NULL;
+    conn->nclasses = 0;
+    conn->class = 0;
+    if(!conn->server->no_metadump){
+        if(conn_send(conn, "lru_crawler metadump all\r\n")){
+            return -EIO;
+        }
+        line = conn_line(conn);
+        if(!line){
+            return -EIO;
+        }
+        if(!strncmp(line, "key=", 4) || !strcmp(line, "END")){
+            conn->state = CONN_LIST_METADUMP;
+            conn->first = line;
+            return 0;
+        }
+        // BUSY means another listing holds the crawler, try again later
+        if(strncmp(line, "BUSY", 4)){
+            conn->server->no_metadump = 1;
+        }
+    }
+    if(conn_mc_items(conn)){
+        return -EIO;
+    }
+    return 0;
+}
+
+/*
+ * Copy a url-encoded metadump key.
+ */
+static int conn_unescape(const char *src, size_t len, char *dst, size_t size)
+{
+    size_t i;
+    size_t n = 0;
+    unsigned int c;
+
+    for(i=0; i<len; i++){
+        if(n + 1 >= size){
+            return -1;
+        }
+        if(src[i] == '%' && i + 2 < len && sscanf(src + i + 1, "%2x", &c) == 1){
+            dst[n++] = (char)c;
+            i += 2;
+        }else{
+            dst[n++] = src[i];
+        }
+    }
+    dst[n] = '\0';
+    return 0;
+}
+
+/*
+ * key=<key> exp=<exptime> la=<last access> cas=<cas> ...
+ */
+static int conn_metadump(char *line, char *key, size_t size, ssize_t *len)
+{
+    char *end;
+
+    if(!strcmp(line, "END")){
+        return 0;
+    }
+    if(strncmp(line, "key=", 4)){
+        return -1;
+    }
+    line += 4;
+    end = strchr(line, ' ');
+    if(!end){
+        end = line + strlen(line);
+    }
+    if(conn_unescape(line, end - line, key, size)){
+        return -1;
+    }
+    // size= counts the item header as well, it is no file size
+    *len = -1;
+    return 1;
+}
+
+/*
+ * ITEM <key> [<bytes> b; <exptime> s]
+ */
+static int conn_cachedump(char *line, char *key, size_t size, ssize_t *len)
+{
+    char *start;
+    char *end;
+    size_t bytes;
+
+    if(strncmp(line, "ITEM ", 5)){
+        return -1;
+    }
+    start = line + 5;
+    end = strchr(start, ' ');
+    if(!end || end - start >= size){
+        return -1;
+    }
+    memcpy(key, start, end - start);
+    key[end - start] = '\0';
+    if(sscanf(end + 1, "[%zu b;", &bytes) == 1){
+        *len = bytes;
+    }else{
+        *len = -1;
+    }
+    return 1;
+}
+
+static int conn_mc_list_next(conn_t *c, char *key, size_t size,
+                             ssize_t *len)
+{
+    conn_mc_t *conn = (conn_mc_t*)c;
+    char *line = conn->first;
+    int ret;
+
+    conn->first = NULL;
+    while(conn->state != CONN_LIST_END){
+        if(conn->state == CONN_LIST_CACHEDUMP &&
+           conn->class >= conn->nclasses){
+            conn->state = CONN_LIST_END;
+            break;
+        }
+        if(!line && !(line = conn_line(conn))){
+            return -EIO;
+        }
+        if(conn->state == CONN_LIST_METADUMP){
+            ret = conn_metadump(line, key, size, len);
+            if(!ret){
+                conn->state = CONN_LIST_END;
+                break;
+            }
+        }else if(!strcmp(line, "END")){
+            line = NULL;
+            conn->class++;
+            if(conn->class < conn->nclasses && conn_mc_cachedump(conn)){
+                return -EIO;
+            }
+            continue;
+        }else{
+            ret = conn_cachedump(line, key, size, len);
+        }
+        if(ret < 0){
+            return -EIO;
+        }
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * A listing dropped halfway closes the connection, since the rest of the
+ * reply is still on its way.
+ */
+static void conn_mc_list_end(conn_t *c, int done)
+{
+    conn_mc_t *conn = (conn_mc_t*)c;
+
+    if(!done || conn->state != CONN_LIST_END){
+        conn_mc_close(c);
+    }
+    conn->state = CONN_LIST_END;
+    conn->first = NULL;
+    free(conn->classes);
+    conn->classes = NULL;
+    conn->nclasses = 0;
+}
+
+const conn_backend_t conn_memcached = {
+    "memcached",
+    conn_mc_server_new,
+    conn_mc_server_free,
+    conn_mc_open,
+    conn_mc_free,
+    conn_mc_close,
+    conn_mc_exec,
+    conn_mc_list_start,
+    conn_mc_list_next,
+    conn_mc_list_end,
+};
@@ -0,0 +1,140 @@
+/*
+ * conn.h - storage backends, and the memcached meta protocol client
+ * Copyright (C) 2012 Benoit Vidis <contact@benoitvidis.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+// read buffer of a connection, also the longest line it can take
+#define CONN_RBUF_SIZE (64 * 1024)
+// requests gathered before writing them out
+#define CONN_BATCH 64
+// longest command line, key and flags included
+#define CONN_CMD_MAX (MEMCACHEFS_KEY_MAX * 2 + 64)
+
+enum{
+    CONN_GET,       // value, size and cas
+    CONN_STAT,      // size and cas only
+    CONN_SET,
+    CONN_ADD,
+    CONN_APPEND,
+    CONN_DELETE,
+};
+
+enum{
+    CONN_OK,
+    CONN_MISS,      // no such key
+    CONN_NOTSTORED, // add of an existing key, append to a missing one,
+                    // key changed since the cas given
+    CONN_ERROR,
+};
+
+typedef struct{
+    int op;
+    const char *key;
+    size_t keylen;
+    // value to store
+    const char *val;
+    size_t len;
+    // gets receive into buf when given and large enough, else malloc
+    char *buf;
+    size_t bufsize;
+    // results
+    int status;
+    char *data;
+    size_t bytes;
+    // cas of the key got, or the one a store or delete expects, 0 for any
+    unsigned long long cas;
+    // item flags of the value got, or of the one set
+    unsigned int flags;
+}conn_req_t;
+
+struct conn;
+
+/*
+ * A storage engine behind the connections. exec runs the gets, stats,
+ * stores and deletes of a batch; a listing is list_start, list_next
+ * until it returns 0 or -errno, then list_end.
+ */
+typedef struct{
+    const char *name;
+    // state shared by the connections to one server
+    void *(*server_new)(server_t *server);
+    void (*server_free)(void *server);
+    struct conn *(*open)(void *server);
+    void (*free)(struct conn *conn);
+    // drop what is left of an exchange that failed or was abandoned
+    void (*close)(struct conn *conn);
+    int (*exec)(struct conn *conn, conn_req_t *reqs, size_t n);
+    int (*list_start)(struct conn *conn);
+    int (*list_next)(struct conn *conn, char *key, size_t size,
+                     ssize_t *len);
+    void (*list_end)(struct conn *conn, int done);
+}conn_backend_t;
+
+// the part common to the connections of every backend, which put it
+// first in their own
+typedef struct conn{
+    const conn_backend_t *backend;
+}conn_t;
+
+enum{
+    CONN_LIST_METADUMP,
+    CONN_LIST_CACHEDUMP,
+    CONN_LIST_END,
+};
+
+// a memcached server, shared by its connections
+typedef struct{
+    const char *host;
+    const char *port;
+    int no_metadump;    // answered ERROR to lru_crawler metadump
+}conn_mc_server_t;
+
+// a connection to a memcached server
+typedef struct{
+    conn_t conn;
+    int fd;
+    conn_mc_server_t *server;
+    char *rbuf;
+    size_t rstart;
+    size_t rend;
+    char cmds[CONN_BATCH][CONN_CMD_MAX];
+    struct iovec iov[CONN_BATCH * 3];
+    int niov;
+    int ncmds;
+    // listing in progress
+    int state;
+    char *first;        // line read ahead by the start of the listing
+    int *classes;
+    size_t nclasses;
+    size_t class;
+}conn_mc_t;
+
+extern const conn_backend_t conn_memcached;
+extern const conn_backend_t memstore_backend;
+
+const conn_backend_t *conn_backend(const char *name);
+conn_t *conn_new(const conn_backend_t *backend, void *server);
+void conn_free(conn_t *conn);
+void conn_close(conn_t *conn);
+int conn_exec(conn_t *conn, conn_req_t *reqs, size_t n);
+void *conn_get(conn_t *conn, const char *key, size_t *len);
+int conn_store(conn_t *conn, int op, const char *key, const void *val,
+               size_t len);
+int conn_delete(conn_t *conn, const char *key);
+int conn_list_start(conn_t *conn);
+int conn_list_next(conn_t *conn, char *key, size_t size, ssize_t *len);
+void conn_list_end(conn_t *conn, int done);
@@ -0,0 +1,294 @@
+/*
+ * dedup.c - content-defined blocks shared between files
+ * Copyright (C) 2012 Benoit Vidis <contact@benoitvidis.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+/*
+ * With -odedup=1 a file is stored as a list of blocks, each under the
+ * SHA-256 of its bytes. Files with content in common share its blocks,
+ * which are only sent when their server does not have them yet.
+ *
+ * Blocks are cut where a gear hash of the bytes before matches a mask,
+ * as in FastCDC: an insertion only changes the blocks around it, and
+ * the ones after keep their hash. The mask is harder below DEDUP_AVG
+ * bytes and easier past it, which keeps most blocks close to that size.
+ *
+ * The list is the value of the file, marked with DEDUP_FLAG, one
+ * "<hash> <length>\n" line per block. Blocks are not deleted along with
+ * a file, as other files may use them: memcached evicts them once they
+ * are not read anymore.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include "memcachefs.h"
+#include "dedup.h"
+
+// cut points below and past DEDUP_AVG: 18 and 14 bits of the hash
+#define DEDUP_MASK_S 0xffffc00000000000ULL
+#define DEDUP_MASK_L 0xfffc000000000000ULL
+
+static uint64_t dedup_gear[256];
+static pthread_once_t dedup_once = PTHREAD_ONCE_INIT;
+
+/*
+ * The gear table has to be the same for every client, it is derived
+ * from a fixed seed.
+ */
+static void dedup_init(void)
+{
+    uint64_t seed = 0x6d636673626c6b73ULL;
+    uint64_t z;
+    int i;
+
+    for(i=0; i<256; i++){
+        seed += 0x9e3779b97f4a7c15ULL;
+        z = seed;
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        dedup_gear[i] = z ^ (z >> 31);
+    }
+}
+
+/*
+ * Length of the block at the start of len bytes.
+ */
+static size_t dedup_cut(const unsigned char *buf, size_t len)
+{
+    uint64_t hash = 0;
+    size_t avg = DEDUP_AVG;
+    size_t max = DEDUP_MAX;
+    size_t i;
+
+    if(len <= DEDUP_MIN){
+        return len;
+    }
+    max = (len < max)?len:max;
+    avg = (avg < max)?avg:max;
+    for(i=DEDUP_MIN; i<avg; i++){
+        hash = (hash << 1) + dedup_gear[buf[i]];
+        if(!(hash & DEDUP_MASK_S)){
+            return i + 1;
+        }
+    }
+    for(; i<max; i++){
+        hash = (hash << 1) + dedup_gear[buf[i]];
+        if(!(hash & DEDUP_MASK_L)){
+            return i + 1;
+        }
+    }
+    return max;
+}
+
+static const uint32_t dedup_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+    0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+    0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+    0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+    0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+    0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+#define DEDUP_ROR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void dedup_sha256_block(uint32_t *h, const unsigned char *p)
+{
+    uint32_t w[64];
+    uint32_t v[8];
+    uint32_t s0;
+    uint32_t s1;
+    uint32_t t1;
+    uint32_t t2;
+    int i;
+
+    for(i=0; i<16; i++){
+        w[i] = (uint32_t)p[i * 4] << 24 | (uint32_t)p[i * 4 + 1] << 16 |
+               (uint32_t)p[i * 4 + 2] << 8 | p[i * 4 + 3];
+    }
+    for(i=16; i<64; i++){
+        s0 = DEDUP_ROR(w[i - 15], 7) ^ DEDUP_ROR(w[i - 15], 18) ^
+             (w[i - 15] >> 3);
+        s1 = DEDUP_ROR(w[i - 2], 17) ^ DEDUP_ROR(w[i - 2], 19) ^
+             (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+    memcpy(v, h, sizeof(v));
+    for(i=0; i<64; i++){
+        s1 = DEDUP_ROR(v[4], 6) ^ DEDUP_ROR(v[4], 11) ^ DEDUP_ROR(v[4], 25);
+        t1 = v[7] + s1 + ((v[4] & v[5]) ^ (~v[4] & v[6])) + dedup_k[i] + w[i];
+        s0 = DEDUP_ROR(v[0], 2) ^ DEDUP_ROR(v[0], 13) ^ DEDUP_ROR(v[0], 22);
+        t2 = s0 + ((v[0] & v[1]) ^ (v[0] & v[2]) ^ (v[1] & v[2]));
+        memmove(v + 1, v, sizeof(uint32_t) * 7);
+        v[4] += t1;
+        v[0] = t1 + t2;
+    }
+    for(i=0; i<8; i++){
+        h[i] += v[i];
+    }
+}
+
+/*
+ * Write the SHA-256 of len bytes of buf in hex to hex.
+ */
+static void dedup_sha256(const unsigned char *buf, size_t len, char *hex)
+{
+    uint32_t h[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+        0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+    };
+    unsigned char tail[128];
+    size_t full = len & ~(size_t)63;
+    size_t rest = len - full;
+    size_t ntail = (rest < 56)?64:128;
+    uint64_t bits = (uint64_t)len * 8;
+    size_t i;
+
+    for(i=0; i<full; i+=64){
+        dedup_sha256_block(h, buf + i);
+    }
+    memset(tail, 0, sizeof(tail));
+    memcpy(tail, buf + full, rest);
+    tail[rest] = 0x80;
+    for(i=0; i<8; i++){
+        tail[ntail - 1 - i] = bits >> (i * 8);
+    }
+    for(i=0; i<ntail; i+=64){
+        dedup_sha256_block(h, tail + i);
+    }
+    for(i=0; i<8; i++){
+        sprintf(hex + i * 8, "%08x", h[i]);
+    }
+}
+
+/*
+ * Cut len bytes of buf into blocks and name them. Returns -1 when out of
+ * memory.
+ */
+int dedup_split(const char *buf, size_t len, dedup_list_t *list)
+{
+    const unsigned char *b = (const unsigned char*)buf;
+    dedup_block_t *block;
+    size_t off = 0;
+    size_t size = 0;
+
+    pthread_once(&dedup_once, dedup_init);
+    memset(list, 0, sizeof(dedup_list_t));
+    while(off < len){
+        if(list->count == size){
+            size = size?size * 2:16;
+            block = (dedup_block_t*)realloc(list->blocks,
+                                            sizeof(dedup_block_t) * size);
+            if(!block){
+                dedup_list_free(list);
+                return -1;
+            }
+            list->blocks = block;
+        }
+        block = &list->blocks[list->count++];
+        block->off = off;
+        block->len = dedup_cut(b + off, len - off);
+        strcpy(block->key, DEDUP_PREFIX);
+        dedup_sha256(b + off, block->len, block->key + strlen(DEDUP_PREFIX));
+        off += block->len;
+    }
+    list->size = len;
+    return 0;
+}
+
+/*
+ * The value listing the blocks of a file, malloc'd.
+ */
+char *dedup_encode(const dedup_list_t *list, size_t *len)
+{
+    char *buf;
+    size_t line = DEDUP_HASH_LEN + 24;
+    size_t n = 0;
+    size_t i;
+
+    buf = (char*)malloc(list->count * line + 1);
+    if(!buf){
+        return NULL;
+    }
+    for(i=0; i<list->count; i++){
+        n += sprintf(buf + n, "%s %zu\n",
+                     list->blocks[i].key + strlen(DEDUP_PREFIX),
+                     list->blocks[i].len);
+    }
+    *len = n;
+    return buf;
+}
+
+/*
+ * Read a list of blocks back. Returns -1 when it is not one.
+ */
+int dedup_decode(const char *buf, size_t len, dedup_list_t *list)
+{
+    const char *end = buf + len;
+    const char *eol;
+    char *num;
+    size_t count = 0;
+    size_t i;
+    dedup_block_t *block;
+
+    memset(list, 0, sizeof(dedup_list_t));
+    for(i=0; i<len; i++){
+        count += (buf[i] == '\n');
+    }
+    list->blocks = (dedup_block_t*)malloc(sizeof(dedup_block_t) *
+                                          (count?count:1));
+    if(!list->blocks){
+        return -1;
+    }
+    while(buf < end){
+        eol = memchr(buf, '\n', end - buf);
+        if(!eol || eol - buf <= DEDUP_HASH_LEN + 1 ||
+           buf[DEDUP_HASH_LEN] != ' ' ||
+           strspn(buf, "0123456789abcdef") != DEDUP_HASH_LEN){
+            dedup_list_free(list);
+            return -1;
+        }
+        block = &list->blocks[list->count++];
+        strcpy(block->key, DEDUP_PREFIX);
+        memcpy(block->key + strlen(DEDUP_PREFIX), buf, DEDUP_HASH_LEN);
+        block->key[strlen(DEDUP_PREFIX) + DEDUP_HASH_LEN] = '\0';
+        block->off = list->size;
+        block->len = strtoul(buf + DEDUP_HASH_LEN + 1, &num, 10);
+        if(num != eol || !block->len || block->len > DEDUP_MAX){
+            dedup_list_free(list);
+            return -1;
+        }
+        list->size += block->len;
+        buf = eol + 1;
+    }
+    return 0;
+}
+
+void dedup_list_free(dedup_list_t *list)
+{
+    free(list->blocks);
+    list->blocks = NULL;
+    list->count = 0;
+}
@@ -0,0 +1,47 @@
+/*
+ * dedup.h - content-defined blocks shared between files
+ * Copyright (C) 2012 Benoit Vidis <contact@benoitvidis.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#define DEDUP_PREFIX MEMCACHEFS_RESERVED "blk:"
+// item flag marking a value which is the list of blocks of a file
+#define DEDUP_FLAG 0x40000
+// blocks are cut past DEDUP_MIN bytes, around DEDUP_AVG, at DEDUP_MAX
+#define DEDUP_MIN (16 * 1024)
+#define DEDUP_AVG (64 * 1024)
+#define DEDUP_MAX (256 * 1024)
+// hex SHA-256 of a block
+#define DEDUP_HASH_LEN 64
+// key of a block: the prefix and the hash of its bytes
+#define DEDUP_KEY_MAX (sizeof(DEDUP_PREFIX) + DEDUP_HASH_LEN)
+
+typedef struct{
+    char key[DEDUP_KEY_MAX];
+    size_t off;
+    size_t len;
+}dedup_block_t;
+
+typedef struct{
+    dedup_block_t *blocks;
+    size_t count;
+    size_t size;        // of the file
+}dedup_list_t;
+
+int dedup_split(const char *buf, size_t len, dedup_list_t *list);
+char *dedup_encode(const dedup_list_t *list, size_t *len);
+int dedup_decode(const char *buf, size_t len, dedup_list_t *list);
+void dedup_list_free(dedup_list_t *list);
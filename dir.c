@@ -0,0 +1,323 @@
+/*
+ * dir.c - directory index objects
+ * Copyright (C) 2012 Benoit Vidis <contact@benoitvidis.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+/*
+ * Every directory below the top one has an index item listing its
+ * entries, so that reading it costs a single get whatever the number of
+ * keys on the servers. The item is a sorted list of lines:
+ *
+ *   <type> <name>
+ *
+ * with type DIR_FILE or DIR_DIR. Updates read the item and store it back
+ * with the cas it was read with, starting over when another client
+ * changed it in between.
+ *
+ * The files at the top are found by listing the servers, since other
+ * memcached clients store keys there too. Its index only lists the
+ * directories, and is created by the first mkdir.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include "memcachefs.h"
+#include "conn.h"
+#include "dir.h"
+
+/*
+ * Key of the index of the directory path, "/" included.
+ */
+int dir_key(const char *path, char *buf, size_t size)
+{
+    int len;
+
+    len = snprintf(buf, size, "%s%s", DIR_PREFIX, path + 1);
+    if(len < 0 || len >= size || len > MEMCACHEFS_KEY_MAX){
+        return -1;
+    }
+    return len;
+}
+
+static int dir_is_top(const char *path)
+{
+    return !strcmp(path, "/");
+}
+
+/*
+ * Find the line of name in an index, or the one it would go before.
+ * Returns 1 when found, with the length of its line in linelen.
+ */
+static int dir_find(const char *data, size_t len, const char *name,
+                    size_t *at, size_t *linelen)
+{
+    size_t namelen = strlen(name);
+    size_t pos = 0;
+    size_t end;
+    size_t n;
+    const char *eol;
+    int cmp;
+
+    while(pos < len){
+        eol = (const char*)memchr(data + pos, '\n', len - pos);
+        end = eol?(size_t)(eol - data) + 1:len;
+        n = (end - pos > 3)?end - pos - 3:0;
+        cmp = memcmp(data + pos + 2, name, (n < namelen)?n:namelen);
+        if(!cmp){
+            cmp = (n > namelen) - (n < namelen);
+        }
+        if(cmp >= 0){
+            *at = pos;
+            *linelen = end - pos;
+            return !cmp;
+        }
+        pos = end;
+    }
+    *at = len;
+    *linelen = 0;
+    return 0;
+}
+
+/*
+ * Add name to the index of path with the given type, or remove it when
+ * type is 0. Indexes of up to max bytes are kept.
+ */
+static int dir_update(conn_t *conn, const char *path, const char *name,
+                      int type, size_t max)
+{
+    char key[MEMCACHEFS_KEY_MAX + 1];
+    conn_req_t reqs[2];
+    const char *data;
+    char *val;
+    size_t namelen = strlen(name);
+    size_t len;
+    size_t at;
+    size_t linelen;
+    size_t vallen;
+    int found;
+    int tries;
+    int status;
+
+    if(dir_key(path, key, sizeof(key)) < 0){
+        return -ENAMETOOLONG;
+    }
+    if(!namelen || strchr(name, '\n')){
+        return -EINVAL;
+    }
+    for(tries=0; tries<DIR_RETRIES; tries++){
+        memset(reqs, 0, sizeof(reqs));
+        reqs[0].op = CONN_GET;
+        reqs[0].key = key;
+        reqs[0].keylen = strlen(key);
+        if(conn_exec(conn, reqs, 1) || reqs[0].status == CONN_ERROR){
+            return -EIO;
+        }
+        if(reqs[0].status == CONN_MISS && !dir_is_top(path)){
+            return -ENOENT;
+        }
+        data = reqs[0].data?reqs[0].data:"";
+        len = reqs[0].bytes;
+        found = dir_find(data, len, name, &at, &linelen);
+        if((found && data[at] == type) || (!found && !type)){
+            free(reqs[0].data);
+            return 0;
+        }
+        vallen = len - linelen * found + (type?namelen + 3:0);
+        if(type && vallen > max){
+            free(reqs[0].data);
+            return -ENOSPC;
+        }
+        val = (char*)malloc(vallen?vallen:1);
+        if(!val){
+            free(reqs[0].data);
+            return -ENOMEM;
+        }
+        memcpy(val, data, at);
+        if(type){
+            val[at] = type;
+            val[at + 1] = ' ';
+            memcpy(val + at + 2, name, namelen);
+            val[at + namelen + 2] = '\n';
+        }
+        memcpy(val + vallen - (len - at - linelen * found),
+               data + at + linelen * found, len - at - linelen * found);
+
+        reqs[1].op = (reqs[0].status == CONN_MISS)?CONN_ADD:CONN_SET;
+        reqs[1].key = key;
+        reqs[1].keylen = reqs[0].keylen;
+        reqs[1].val = val;
+        reqs[1].len = vallen;
+        reqs[1].cas = reqs[0].cas;
+        conn_exec(conn, reqs + 1, 1);
+        status = reqs[1].status;
+        free(val);
+        free(reqs[0].data);
+        if(status == CONN_OK){
+            return 0;
+        }
+        if(status == CONN_ERROR){
+            return -EIO;
+        }
+    }
+    return -EAGAIN;
+}
+
+/*
+ * Create the empty index of a new directory.
+ */
+int dir_create(conn_t *conn, const char *path)
+{
+    char key[MEMCACHEFS_KEY_MAX + 1];
+    conn_req_t req;
+
+    if(dir_key(path, key, sizeof(key)) < 0){
+        return -ENAMETOOLONG;
+    }
+    memset(&req, 0, sizeof(req));
+    req.op = CONN_ADD;
+    req.key = key;
+    req.keylen = strlen(key);
+    req.val = "";
+    conn_exec(conn, &req, 1);
+    if(req.status == CONN_NOTSTORED){
+        return -EEXIST;
+    }
+    return (req.status == CONN_OK)?0:-EIO;
+}
+
+/*
+ * Delete the index of a directory, as long as it is empty.
+ */
+int dir_remove(conn_t *conn, const char *path)
+{
+    char key[MEMCACHEFS_KEY_MAX + 1];
+    conn_req_t req;
+    int tries;
+
+    if(dir_key(path, key, sizeof(key)) < 0){
+        return -ENAMETOOLONG;
+    }
+    for(tries=0; tries<DIR_RETRIES; tries++){
+        memset(&req, 0, sizeof(req));
+        req.op = CONN_STAT;
+        req.key = key;
+        req.keylen = strlen(key);
+        conn_exec(conn, &req, 1);
+        if(req.status != CONN_OK){
+            return (req.status == CONN_MISS)?-ENOENT:-EIO;
+        }
+        if(req.bytes){
+            return -ENOTEMPTY;
+        }
+        // an entry added since makes the cas differ
+        req.op = CONN_DELETE;
+        conn_exec(conn, &req, 1);
+        if(req.status == CONN_OK || req.status == CONN_MISS){
+            return 0;
+        }
+        if(req.status == CONN_ERROR){
+            return -EIO;
+        }
+    }
+    return -EAGAIN;
+}
+
+int dir_link(conn_t *conn, const char *path, const char *name, int type,
+             size_t max)
+{
+    return dir_update(conn, path, name, type, max);
+}
+
+int dir_unlink(conn_t *conn, const char *path, const char *name)
+{
+    return dir_update(conn, path, name, 0, 0);
+}
+
+/*
+ * Read the index of path. The names point into the item fetched, which
+ * goes away with the list.
+ */
+int dir_list(conn_t *conn, const char *path, dir_list_t **list)
+{
+    char key[MEMCACHEFS_KEY_MAX + 1];
+    conn_req_t req;
+    dir_list_t *l;
+    size_t count = 0;
+    size_t i;
+    char *line;
+    char *eol;
+    char *end;
+
+    if(dir_key(path, key, sizeof(key)) < 0){
+        return -ENAMETOOLONG;
+    }
+    memset(&req, 0, sizeof(req));
+    req.op = CONN_GET;
+    req.key = key;
+    req.keylen = strlen(key);
+    conn_exec(conn, &req, 1);
+    if(req.status == CONN_ERROR ||
+       (req.status == CONN_MISS && !dir_is_top(path))){
+        return (req.status == CONN_MISS)?-ENOENT:-EIO;
+    }
+    for(i=0; i<req.bytes; i++){
+        count += (req.data[i] == '\n');
+    }
+    l = (dir_list_t*)calloc(1, sizeof(dir_list_t));
+    if(l){
+        l->names = (char**)malloc((count?count:1) * sizeof(char*));
+        l->types = (char*)malloc(count?count:1);
+    }
+    if(!l || !l->names || !l->types){
+        free(req.data);
+        dir_list_free(l);
+        return -ENOMEM;
+    }
+    l->data = req.data;
+    line = req.data;
+    end = req.data + req.bytes;
+    while(line && line < end){
+        eol = (char*)memchr(line, '\n', end - line);
+        if(!eol){
+            break;
+        }
+        *eol = '\0';
+        if(eol - line > 2){
+            l->types[l->count] = line[0];
+            l->names[l->count] = line + 2;
+            l->count++;
+        }
+        line = eol + 1;
+    }
+    *list = l;
+    return 0;
+}
+
+void dir_list_free(dir_list_t *list)
+{
+    if(!list){
+        return;
+    }
+    free(list->data);
+    free(list->names);
+    free(list->types);
+    free(list);
+}
@@ -0,0 +1,44 @@
+/*
+ * dir.h - directory index objects
+ * Copyright (C) 2012 Benoit Vidis <contact@benoitvidis.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#define DIR_PREFIX MEMCACHEFS_RESERVED "dir:"
+// updates losing the race against other clients before giving up
+#define DIR_RETRIES 16
+
+// entry types, the first byte of their line
+enum{
+    DIR_FILE = 'f',
+    DIR_DIR = 'd',
+};
+
+typedef struct{
+    char *data;
+    size_t count;
+    char **names;
+    char *types;
+}dir_list_t;
+
+int dir_key(const char *path, char *buf, size_t size);
+int dir_create(conn_t *conn, const char *path);
+int dir_remove(conn_t *conn, const char *path);
+int dir_link(conn_t *conn, const char *path, const char *name, int type,
+             size_t max);
+int dir_unlink(conn_t *conn, const char *path, const char *name);
+int dir_list(conn_t *conn, const char *path, dir_list_t **list);
+void dir_list_free(dir_list_t *list);
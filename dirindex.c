@@ -0,0 +1,564 @@
+/*
+ * dirindex.c - in-memory index of the cache keys
+ * Copyright (C) 2012 Benoit Vidis <contact@benoitvidis.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+/*
+ * The index keeps the names of every file at the top of the filesystem in
+ * a hash table, so that readdir answers from memory instead of sweeping
+ * the server. Keys with a '/' are in directories, which have their own
+ * index item (see dir.c). A background thread rebuilds it from a full
+ * listing, and the filesystem operations that create or remove files
+ * update it in between. With several servers, a refresh lists all of
+ * them at once, one thread each, and merges their keys.
+ *
+ * Reloads are driven by the listings: the first one loads the index, and
+ * later ones have it reloaded once it is `interval' seconds old. An
+ * index nobody lists is never reloaded, so idle mounts cost the servers
+ * nothing. The first listing after an idle spell is therefore answered
+ * from an index as old as the spell, while it is reloaded: streaming it
+ * from the servers too would list them twice. Only when the last reload
+ * failed is an index older than twice the interval left unused.
+ *
+ * A refresh builds a new table without holding the lock. Changes made
+ * locally meanwhile are applied to the current table and recorded in a
+ * journal, which is replayed onto the new table before it replaces the
+ * old one, so that the listing does not lose them.
+ *
+ * readdir works on a snapshot: a flat array of the names, shared by all
+ * the listings opened until the index changes again.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include "memcachefs.h"
+#include "conn.h"
+#include "handle.h"
+#include "dirstream.h"
+#include "dirindex.h"
+
+static unsigned int dirindex_hash(const char *name)
+{
+    unsigned int hash = 0;
+
+    while(*name){
+        hash += (unsigned char)*name++;
+        hash += (hash << 10);
+        hash ^= (hash >> 6);
+    }
+    hash += (hash << 3);
+    hash ^= (hash >> 11);
+    hash += (hash << 15);
+    return hash;
+}
+
+static dirindex_table_t *dirindex_table_new(void)
+{
+    dirindex_table_t *table;
+
+    table = (dirindex_table_t*)malloc(sizeof(dirindex_table_t));
+    if(!table){
+        return NULL;
+    }
+    memset(table, 0, sizeof(dirindex_table_t));
+    table->nbuckets = DIRINDEX_BUCKETS;
+    table->buckets = (dirindex_entry_t**)calloc(table->nbuckets,
+                                                sizeof(dirindex_entry_t*));
+    if(!table->buckets){
+        free(table);
+        return NULL;
+    }
+    return table;
+}
+
+static void dirindex_table_free(dirindex_table_t *table)
+{
+    size_t i;
+    dirindex_entry_t *entry;
+    dirindex_entry_t *next;
+
+    if(!table){
+        return;
+    }
+    for(i=0; i<table->nbuckets; i++){
+        for(entry = table->buckets[i]; entry; entry = next){
+            next = entry->next;
+            free(entry);
+        }
+    }
+    free(table->buckets);
+    free(table);
+}
+
+/*
+ * Double the buckets once the chains get longer than two on average.
+ * Failing to do so only makes the chains longer.
+ */
+static void dirindex_table_grow(dirindex_table_t *table)
+{
+    size_t i;
+    size_t nbuckets = table->nbuckets * 2;
+    dirindex_entry_t **buckets;
+    dirindex_entry_t *entry;
+    dirindex_entry_t *next;
+    unsigned int index;
+
+    buckets = (dirindex_entry_t**)calloc(nbuckets, sizeof(dirindex_entry_t*));
+    if(!buckets){
+        return;
+    }
+    for(i=0; i<table->nbuckets; i++){
+        for(entry = table->buckets[i]; entry; entry = next){
+            next = entry->next;
+            index = dirindex_hash(entry->name) % nbuckets;
+            entry->next = buckets[index];
+            buckets[index] = entry;
+        }
+    }
+    free(table->buckets);
+    table->buckets = buckets;
+    table->nbuckets = nbuckets;
+}
+
+static int dirindex_table_add(dirindex_table_t *table, const char *name)
+{
+    unsigned int index;
+    size_t len = strlen(name);
+    dirindex_entry_t *entry;
+
+    index = dirindex_hash(name) % table->nbuckets;
+    for(entry = table->buckets[index]; entry; entry = entry->next){
+        if(!strcmp(entry->name, name)){
+            return 0;
+        }
+    }
+    entry = (dirindex_entry_t*)malloc(sizeof(dirindex_entry_t) + len + 1);
+    if(!entry){
+        return -1;
+    }
+    memcpy(entry->name, name, len + 1);
+    entry->next = table->buckets[index];
+    table->buckets[index] = entry;
+    table->count++;
+    table->bytes += len + 1;
+    if(table->count > table->nbuckets * 2){
+        dirindex_table_grow(table);
+    }
+    return 1;
+}
+
+static int dirindex_table_remove(dirindex_table_t *table, const char *name)
+{
+    unsigned int index;
+    dirindex_entry_t **prev;
+    dirindex_entry_t *entry;
+
+    index = dirindex_hash(name) % table->nbuckets;
+    for(prev = &table->buckets[index]; (entry = *prev); prev = &entry->next){
+        if(!strcmp(entry->name, name)){
+            *prev = entry->next;
+            table->count--;
+            table->bytes -= strlen(entry->name) + 1;
+            free(entry);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void dirindex_journal_clear(dirindex_t *index)
+{
+    dirindex_change_t *change;
+    dirindex_change_t *next;
+
+    for(change = index->journal; change; change = next){
+        next = change->next;
+        free(change);
+    }
+    index->journal = NULL;
+    index->journal_tail = &index->journal;
+}
+
+dirindex_t *dirindex_new(handle_pool_t **pools, unsigned int npools,
+                         unsigned int interval)
+{
+    dirindex_t *index;
+
+    index = (dirindex_t*)malloc(sizeof(dirindex_t));
+    if(!index){
+        return NULL;
+    }
+    memset(index, 0, sizeof(dirindex_t));
+    index->pools = pools;
+    index->npools = npools;
+    index->interval = interval;
+    index->journal_tail = &index->journal;
+    pthread_mutex_init(&index->mutex, NULL);
+    pthread_cond_init(&index->cond, NULL);
+    return index;
+}
+
+void dirindex_free(dirindex_t *index)
+{
+    dirindex_stop(index);
+    dirindex_table_free(index->table);
+    if(index->snap){
+        dirindex_snap_release(index->snap);
+    }
+    dirindex_journal_clear(index);
+    pthread_mutex_destroy(&index->mutex);
+    pthread_cond_destroy(&index->cond);
+    free(index);
+}
+
+typedef struct{
+    handle_pool_t *pool;
+    dirindex_table_t *table;
+    int started;
+    int ret;
+}dirindex_list_t;
+
+/*
+ * List the keys of one server into its own table.
+ */
+static void *dirindex_list(void *arg)
+{
+    dirindex_list_t *list = (dirindex_list_t*)arg;
+    dirstream_t *ds;
+    const char *key;
+    ssize_t size;
+    int ret;
+
+    list->table = dirindex_table_new();
+    ds = dirstream_new(list->pool);
+    if(!list->table || !ds){
+        if(ds){
+            dirstream_free(ds);
+        }
+        list->ret = -ENOMEM;
+        return NULL;
+    }
+    while((ret = dirstream_next(ds, &key, &size)) > 0){
+        if(strncmp(key, MEMCACHEFS_RESERVED, strlen(MEMCACHEFS_RESERVED)) &&
+           !strchr(key, '/') && dirindex_table_add(list->table, key) < 0){
+            ret = -ENOMEM;
+            break;
+        }
+    }
+    dirstream_free(ds);
+    if(ret){
+        fprintf(stderr, "error: can't list the keys of %s:%s (%s)\n",
+                list->pool->host, list->pool->port, strerror(-ret));
+    }
+    list->ret = ret;
+    return NULL;
+}
+
+/*
+ * Add the names of src to dst.
+ */
+static int dirindex_table_merge(dirindex_table_t *dst, dirindex_table_t *src)
+{
+    size_t i;
+    dirindex_entry_t *entry;
+
+    for(i=0; i<src->nbuckets; i++){
+        for(entry = src->buckets[i]; entry; entry = entry->next){
+            if(dirindex_table_add(dst, entry->name) < 0){
+                return -ENOMEM;
+            }
+        }
+    }
+    return 0;
+}
+
+/*
+ * Rebuild the index from a full listing of the servers.
+ */
+int dirindex_refresh(dirindex_t *index)
+{
+    int ret = 0;
+    unsigned int i;
+    dirindex_list_t *lists;
+    pthread_t *threads;
+    dirindex_table_t *table = NULL;
+    dirindex_change_t *change;
+
+    lists = (dirindex_list_t*)calloc(index->npools, sizeof(dirindex_list_t));
+    threads = (pthread_t*)calloc(index->npools, sizeof(pthread_t));
+    if(!lists || !threads){
+        free(lists);
+        free(threads);
+        return -ENOMEM;
+    }
+
+    pthread_mutex_lock(&index->mutex);
+    index->refreshing = 1;
+    index->tried = time(NULL);
+    pthread_mutex_unlock(&index->mutex);
+
+    for(i=0; i<index->npools; i++){
+        lists[i].pool = index->pools[i];
+    }
+    for(i=1; i<index->npools; i++){
+        lists[i].started = !pthread_create(&threads[i], NULL, dirindex_list,
+                                           &lists[i]);
+    }
+    dirindex_list(&lists[0]);
+    for(i=1; i<index->npools; i++){
+        if(lists[i].started){
+            pthread_join(threads[i], NULL);
+        }else{
+            dirindex_list(&lists[i]);
+        }
+    }
+    for(i=0; i<index->npools && !ret; i++){
+        ret = lists[i].ret;
+    }
+    if(!ret){
+        table = lists[0].table;
+        lists[0].table = NULL;
+        for(i=1; i<index->npools && !ret; i++){
+            ret = dirindex_table_merge(table, lists[i].table);
+        }
+    }
+    for(i=0; i<index->npools; i++){
+        dirindex_table_free(lists[i].table);
+    }
+    free(lists);
+    free(threads);
+    if(ret){
+        dirindex_table_free(table);
+        table = NULL;
+    }
+
+    pthread_mutex_lock(&index->mutex);
+    if(!ret){
+        for(change = index->journal; change; change = change->next){
+            if(change->add){
+                dirindex_table_add(table, change->name);
+            }else{
+                dirindex_table_remove(table, change->name);
+            }
+        }
+        dirindex_table_free(index->table);
+        index->table = table;
+        table = NULL;
+        if(index->snap){
+            dirindex_snap_release(index->snap);
+            index->snap = NULL;
+        }
+        index->ready = 1;
+        index->loaded = index->tried;
+    }
+    dirindex_journal_clear(index);
+    index->refreshing = 0;
+    pthread_mutex_unlock(&index->mutex);
+
+    dirindex_table_free(table);
+    return ret;
+}
+
+/*
+ * Reload the index when it was listed since the last reload, at most
+ * once per interval.
+ */
+static void *dirindex_run(void *arg)
+{
+    dirindex_t *index = (dirindex_t*)arg;
+    struct timespec deadline;
+
+    pthread_mutex_lock(&index->mutex);
+    while(!index->stop){
+        if(!index->wanted){
+            pthread_cond_wait(&index->cond, &index->mutex);
+            continue;
+        }
+        if(index->tried && time(NULL) < index->tried + index->interval){
+            deadline.tv_sec = index->tried + index->interval;
+            deadline.tv_nsec = 0;
+            pthread_cond_timedwait(&index->cond, &index->mutex, &deadline);
+            continue;
+        }
+        index->wanted = 0;
+        pthread_mutex_unlock(&index->mutex);
+        dirindex_refresh(index);
+        pthread_mutex_lock(&index->mutex);
+    }
+    pthread_mutex_unlock(&index->mutex);
+    return NULL;
+}
+
+/*
+ * Start the refresh thread, which waits for the first listing. Without
+ * an interval, the index stays empty and listings go to the server.
+ */
+int dirindex_start(dirindex_t *index)
+{
+    if(!index->interval || index->running){
+        return 0;
+    }
+    index->stop = 0;
+    if(pthread_create(&index->thread, NULL, dirindex_run, index)){
+        return -1;
+    }
+    index->running = 1;
+    return 0;
+}
+
+void dirindex_stop(dirindex_t *index)
+{
+    if(!index->running){
+        return;
+    }
+    pthread_mutex_lock(&index->mutex);
+    index->stop = 1;
+    pthread_cond_signal(&index->cond);
+    pthread_mutex_unlock(&index->mutex);
+    pthread_join(index->thread, NULL);
+    index->running = 0;
+}
+
+static void dirindex_change(dirindex_t *index, const char *name, int add)
+{
+    int ret;
+    size_t len = strlen(name);
+    dirindex_change_t *change;
+
+    if(strchr(name, '/')){
+        return;
+    }
+    pthread_mutex_lock(&index->mutex);
+    if(!index->ready && !index->refreshing){
+        pthread_mutex_unlock(&index->mutex);
+        return;
+    }
+    if(index->refreshing){
+        change = (dirindex_change_t*)malloc(sizeof(dirindex_change_t) +
+                                            len + 1);
+        if(change){
+            change->next = NULL;
+            change->add = add;
+            memcpy(change->name, name, len + 1);
+            *index->journal_tail = change;
+            index->journal_tail = &change->next;
+        }
+    }
+    ret = 0;
+    if(index->table){
+        if(add){
+            ret = dirindex_table_add(index->table, name);
+        }else{
+            ret = dirindex_table_remove(index->table, name);
+        }
+    }
+    if(ret && index->snap){
+        dirindex_snap_release(index->snap);
+        index->snap = NULL;
+    }
+    pthread_mutex_unlock(&index->mutex);
+}
+
+void dirindex_add(dirindex_t *index, const char *name)
+{
+    dirindex_change(index, name, 1);
+}
+
+void dirindex_remove(dirindex_t *index, const char *name)
+{
+    dirindex_change(index, name, 0);
+}
+
+static dirindex_snap_t *dirindex_snap_new(dirindex_table_t *table)
+{
+    size_t i;
+    size_t n = 0;
+    size_t len;
+    char *ptr;
+    dirindex_snap_t *snap;
+    dirindex_entry_t *entry;
+
+    snap = (dirindex_snap_t*)malloc(sizeof(dirindex_snap_t));
+    if(!snap){
+        return NULL;
+    }
+    snap->refs = 1;
+    snap->count = table->count;
+    snap->names = (char**)malloc(sizeof(char*) * (table->count + 1));
+    snap->data = (char*)malloc(table->bytes + 1);
+    if(!snap->names || !snap->data){
+        free(snap->names);
+        free(snap->data);
+        free(snap);
+        return NULL;
+    }
+    ptr = snap->data;
+    for(i=0; i<table->nbuckets; i++){
+        for(entry = table->buckets[i]; entry; entry = entry->next){
+            len = strlen(entry->name) + 1;
+            memcpy(ptr, entry->name, len);
+            snap->names[n++] = ptr;
+            ptr += len;
+        }
+    }
+    return snap;
+}
+
+/*
+ * Get the current listing, NULL until the index was loaded or when it
+ * is too old and could not be reloaded. Either way, a listing asks for
+ * the next reload. Give it back with dirindex_snap_release().
+ */
+dirindex_snap_t *dirindex_snapshot(dirindex_t *index)
+{
+    dirindex_snap_t *snap = NULL;
+
+    pthread_mutex_lock(&index->mutex);
+    if(!index->wanted){
+        index->wanted = 1;
+        pthread_cond_signal(&index->cond);
+    }
+    // loaded lags tried when the last reload failed
+    if(index->ready && (index->refreshing || index->loaded == index->tried ||
+                        time(NULL) < index->loaded + 2 * index->interval)){
+        if(!index->snap){
+            index->snap = dirindex_snap_new(index->table);
+        }
+        snap = index->snap;
+        if(snap){
+            __sync_fetch_and_add(&snap->refs, 1);
+        }
+    }
+    pthread_mutex_unlock(&index->mutex);
+    return snap;
+}
+
+void dirindex_snap_release(dirindex_snap_t *snap)
+{
+    if(__sync_sub_and_fetch(&snap->refs, 1)){
+        return;
+    }
+    free(snap->names);
+    free(snap->data);
+    free(snap);
+}
@@ -0,0 +1,76 @@
+/*
+ * dirindex.h - in-memory index of the cache keys
+ * Copyright (C) 2012 Benoit Vidis <contact@benoitvidis.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#define DIRINDEX_BUCKETS 4096
+
+typedef struct dirindex_entry{
+    struct dirindex_entry *next;
+    char name[];
+}dirindex_entry_t;
+
+typedef struct{
+    dirindex_entry_t **buckets;
+    size_t nbuckets;
+    size_t count;
+    size_t bytes;
+}dirindex_table_t;
+
+typedef struct dirindex_change{
+    struct dirindex_change *next;
+    int add;
+    char name[];
+}dirindex_change_t;
+
+typedef struct{
+    int refs;
+    size_t count;
+    char **names;
+    char *data;
+}dirindex_snap_t;
+
+typedef struct{
+    handle_pool_t **pools;
+    unsigned int npools;
+    unsigned int interval;
+    dirindex_table_t *table;
+    dirindex_snap_t *snap;
+    int ready;
+    int refreshing;
+    int wanted;         // read since the last reload
+    time_t loaded;      // start of the last reload done
+    time_t tried;       // start of the last reload tried
+    dirindex_change_t *journal;
+    dirindex_change_t **journal_tail;
+    int running;
+    int stop;
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+}dirindex_t;
+
+dirindex_t *dirindex_new(handle_pool_t **pools, unsigned int npools,
+                         unsigned int interval);
+void dirindex_free(dirindex_t *index);
+int dirindex_start(dirindex_t *index);
+void dirindex_stop(dirindex_t *index);
+int dirindex_refresh(dirindex_t *index);
+void dirindex_add(dirindex_t *index, const char *name);
+void dirindex_remove(dirindex_t *index, const char *name);
+dirindex_snap_t *dirindex_snapshot(dirindex_t *index);
+void dirindex_snap_release(dirindex_snap_t *snap);
@@ -0,0 +1,140 @@
+/*
+ * dirstream.c - streamed listing of the cache keys
+ * Copyright (C) 2012 Benoit Vidis <contact@benoitvidis.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+/*
+ * A listing is read from the backend and handed out key by key, so that
+ * neither side has to hold the whole key space in memory when the
+ * backend streams it.
+ *
+ * It runs on a connection of its own, opened at the first entry and
+ * closed at the end of the listing. A listing left unfinished, by
+ * `ls | head' or a stalled reader, then holds no connection of the pool
+ * from the other operations.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include "memcachefs.h"
+#include "conn.h"
+#include "handle.h"
+#include "dirstream.h"
+
+dirstream_t *dirstream_new(handle_pool_t *pool)
+{
+    dirstream_t *ds;
+
+    ds = (dirstream_t*)malloc(sizeof(dirstream_t));
+    if(!ds){
+        return NULL;
+    }
+    memset(ds, 0, sizeof(dirstream_t));
+    ds->pool = pool;
+    ds->state = DIRSTREAM_START;
+    return ds;
+}
+
+/*
+ * End the listing and close its connection.
+ */
+static void dirstream_done(dirstream_t *ds, int done)
+{
+    if(ds->conn){
+        conn_list_end(ds->conn, done);
+        conn_free(ds->conn);
+        ds->conn = NULL;
+    }
+}
+
+void dirstream_free(dirstream_t *ds)
+{
+    dirstream_done(ds, ds->state == DIRSTREAM_END);
+    free(ds);
+}
+
+void dirstream_rewind(dirstream_t *ds)
+{
+    dirstream_done(ds, ds->state == DIRSTREAM_END);
+    ds->state = DIRSTREAM_START;
+    ds->again = 0;
+}
+
+/*
+ * Have the next dirstream_next() return the same entry again, for a
+ * caller whose buffer was full.
+ */
+void dirstream_unget(dirstream_t *ds)
+{
+    ds->again = 1;
+}
+
+static int dirstream_fail(dirstream_t *ds, int err)
+{
+    dirstream_done(ds, 0);
+    ds->state = DIRSTREAM_END;
+    return err;
+}
+
+/*
+ * Get the next key of the listing, and its value size when the backend
+ * told it (-1 otherwise). Returns 1 for an entry, 0 at the end and
+ * -errno on error. The key stays valid until the next call.
+ */
+int dirstream_next(dirstream_t *ds, const char **key, ssize_t *size)
+{
+    int ret;
+
+    if(ds->again){
+        ds->again = 0;
+        *key = ds->key;
+        *size = ds->size;
+        return 1;
+    }
+    if(ds->state == DIRSTREAM_END){
+        return 0;
+    }
+    if(ds->state == DIRSTREAM_START){
+        ds->conn = conn_new(ds->pool->backend, ds->pool->server);
+        if(!ds->conn){
+            return dirstream_fail(ds, -ENOMEM);
+        }
+        ds->state = DIRSTREAM_LIST;
+        ret = conn_list_start(ds->conn);
+        if(ret < 0){
+            return dirstream_fail(ds, ret);
+        }
+    }
+    ret = conn_list_next(ds->conn, ds->key, sizeof(ds->key), &ds->size);
+    if(ret < 0){
+        return dirstream_fail(ds, ret);
+    }
+    if(!ret){
+        ds->state = DIRSTREAM_END;
+        dirstream_done(ds, 1);
+        return 0;
+    }
+    *key = ds->key;
+    *size = ds->size;
+    return 1;
+}
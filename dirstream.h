@@ -0,0 +1,39 @@
+/*
+ * dirstream.h - streamed listing of the cache keys
+ * Copyright (C) 2012 Benoit Vidis <contact@benoitvidis.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+enum{
+    DIRSTREAM_START,
+    DIRSTREAM_LIST,
+    DIRSTREAM_END,
+};
+
+typedef struct{
+    handle_pool_t *pool;
+    conn_t *conn;       // of its own, not one of the pool's
+    int state;
+    int again;
+    char key[MEMCACHEFS_KEY_MAX + 1];
+    ssize_t size;
+}dirstream_t;
+
+dirstream_t *dirstream_new(handle_pool_t *pool);
+void dirstream_free(dirstream_t *ds);
+void dirstream_rewind(dirstream_t *ds);
+int dirstream_next(dirstream_t *ds, const char **key, ssize_t *size);
+void dirstream_unget(dirstream_t *ds);
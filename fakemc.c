@@ -0,0 +1,490 @@
+/*
+ * fakemc.c - memcached stand-in for the benchmarks
+ * Copyright (C) 2012 Benoit Vidis <contact@benoitvidis.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+/*
+ * A memcached listening on a loopback port of the benchmark process,
+ * speaking the part of the meta protocol conn.c uses and answering the
+ * `lru_crawler metadump' of dirstream.c. Items live in a memstore_t.
+ * Every request already received is answered together, after waiting
+ * `latency' microseconds, so that a batch of requests costs one
+ * round-trip as it would over a network.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "memcachefs.h"
+#include "conn.h"
+#include "memstore.h"
+#include "fakemc.h"
+
+typedef struct{
+    fakemc_t *srv;
+    int fd;
+    char *rbuf;
+    size_t rsize;
+    size_t rlen;
+    char *wbuf;
+    size_t wsize;
+    size_t wlen;
+}fakemc_conn_t;
+
+static const char fakemc_b64[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+fakemc_t *fakemc_new(unsigned int latency)
+{
+    fakemc_t *srv;
+
+    srv = (fakemc_t*)malloc(sizeof(fakemc_t));
+    if(!srv){
+        return NULL;
+    }
+    memset(srv, 0, sizeof(fakemc_t));
+    srv->store = memstore_new();
+    if(!srv->store){
+        free(srv);
+        return NULL;
+    }
+    srv->latency = latency;
+    srv->fd = -1;
+    pthread_mutex_init(&srv->mutex, NULL);
+    pthread_cond_init(&srv->cond, NULL);
+    return srv;
+}
+
+void fakemc_free(fakemc_t *srv)
+{
+    fakemc_stop(srv);
+    memstore_free(srv->store);
+    pthread_mutex_destroy(&srv->mutex);
+    pthread_cond_destroy(&srv->cond);
+    free(srv);
+}
+
+static int fakemc_out(fakemc_conn_t *c, const char *data, size_t len)
+{
+    char *wbuf;
+    size_t size;
+
+    if(c->wlen + len > c->wsize){
+        for(size = c->wsize?c->wsize:4096; size < c->wlen + len; size *= 2);
+        wbuf = (char*)realloc(c->wbuf, size);
+        if(!wbuf){
+            return -1;
+        }
+        c->wbuf = wbuf;
+        c->wsize = size;
+    }
+    memcpy(c->wbuf + c->wlen, data, len);
+    c->wlen += len;
+    return 0;
+}
+
+static int fakemc_line(fakemc_conn_t *c, const char *line)
+{
+    return fakemc_out(c, line, strlen(line));
+}
+
+/*
+ * Decode a base64 key in place, returning its length or -1.
+ */
+static int fakemc_unbase64(char *key)
+{
+    const char *p;
+    size_t i;
+    size_t n = 0;
+    unsigned int v = 0;
+    unsigned int bits = 0;
+
+    for(i=0; key[i] && key[i] != '='; i++){
+        p = strchr(fakemc_b64, key[i]);
+        if(!p){
+            return -1;
+        }
+        v = (v << 6) | (p - fakemc_b64);
+        bits += 6;
+        if(bits >= 8){
+            bits -= 8;
+            key[n++] = (v >> bits) & 0xff;
+        }
+    }
+    return n;
+}
+
+/*
+ * Answer `lru_crawler metadump' with the url-encoded key of each item.
+ */
+static int fakemc_dump(const char *key, size_t keylen, size_t len, void *arg)
+{
+    fakemc_conn_t *c = (fakemc_conn_t*)arg;
+    char line[MEMCACHEFS_KEY_MAX * 3 + 64];
+    size_t n;
+    size_t i;
+
+    n = snprintf(line, sizeof(line), "key=");
+    for(i=0; i<keylen && n + 4 < sizeof(line); i++){
+        if((key[i] >= 'a' && key[i] <= 'z') ||
+           (key[i] >= 'A' && key[i] <= 'Z') ||
+           (key[i] >= '0' && key[i] <= '9') || strchr("-_.~/:", key[i])){
+            line[n++] = key[i];
+        }else{
+            n += sprintf(line + n, "%%%02X", (unsigned char)key[i]);
+        }
+    }
+    snprintf(line + n, sizeof(line) - n,
+             " exp=-1 la=0 cas=0 fetch=no cls=1 size=%zu\r\n", len);
+    return fakemc_line(c, line);
+}
+
+/*
+ * Answer a request of a meta command, whose tokens follow its key.
+ */
+static int fakemc_meta(fakemc_conn_t *c, conn_req_t *req, char **toks,
+                       int ntoks)
+{
+    char line[128];
+    char ret[96];
+    size_t n = 0;
+    int i;
+
+    memstore_exec(c->srv->store, req, 1);
+    if(req->status == CONN_ERROR){
+        return fakemc_line(c, "SERVER_ERROR out of memory\r\n");
+    }
+    if(req->status == CONN_MISS){
+        return fakemc_line(c, (req->op == CONN_GET || req->op == CONN_STAT)?
+                           "EN\r\n":"NF\r\n");
+    }
+    if(req->status == CONN_NOTSTORED){
+        return fakemc_line(c, req->cas?"EX\r\n":"NS\r\n");
+    }
+    ret[0] = '\0';
+    if(req->op == CONN_GET || req->op == CONN_STAT){
+        for(i=0; i<ntoks; i++){
+            if(toks[i][0] == 's'){
+                n += snprintf(ret + n, sizeof(ret) - n, " s%zu", req->bytes);
+            }else if(toks[i][0] == 'c'){
+                n += snprintf(ret + n, sizeof(ret) - n, " c%llu", req->cas);
+            }else if(toks[i][0] == 'f'){
+                n += snprintf(ret + n, sizeof(ret) - n, " f%u", req->flags);
+            }
+        }
+    }
+    if(!req->data){
+        snprintf(line, sizeof(line), "HD%s\r\n", ret);
+        return fakemc_line(c, line);
+    }
+    snprintf(line, sizeof(line), "VA %zu%s\r\n", req->bytes, ret);
+    i = fakemc_line(c, line) || fakemc_out(c, req->data, req->bytes) ||
+        fakemc_line(c, "\r\n");
+    free(req->data);
+    return i?-1:0;
+}
+
+/*
+ * Handle the request at the start of buf. Returns the bytes it took, 0
+ * when it is not all there yet and -1 to drop the connection.
+ */
+static ssize_t fakemc_request(fakemc_conn_t *c, char *buf, size_t len)
+{
+    char line[FAKEMC_LINE_MAX];
+    char *toks[16];
+    char *save;
+    char *eol;
+    int ntoks = 0;
+    int keylen;
+    int args;           // first token after the key, or the value size
+    int i;
+    size_t used;
+    conn_req_t req;
+
+    eol = memchr(buf, '\n', len);
+    if(!eol){
+        return (len >= FAKEMC_LINE_MAX)?-1:0;
+    }
+    used = eol - buf + 1;
+    if(used >= sizeof(line)){
+        return -1;
+    }
+    memcpy(line, buf, used);
+    line[used - 1] = '\0';
+    if(used > 1 && line[used - 2] == '\r'){
+        line[used - 2] = '\0';
+    }
+    for(toks[0] = strtok_r(line, " ", &save); toks[ntoks] && ntoks < 15;
+        toks[++ntoks] = strtok_r(NULL, " ", &save));
+    if(!ntoks){
+        return used;
+    }
+
+    if(!strcmp(toks[0], "lru_crawler") && ntoks > 1 &&
+       !strcmp(toks[1], "metadump")){
+        if(memstore_list(c->srv->store, fakemc_dump, c) ||
+           fakemc_line(c, "END\r\n")){
+            return -1;
+        }
+        return used;
+    }
+    if(!strcmp(toks[0], "mn")){
+        return fakemc_line(c, "MN\r\n")?-1:used;
+    }
+    if(!strcmp(toks[0], "version")){
+        return fakemc_line(c, "VERSION 1.6.0-fakemc\r\n")?-1:used;
+    }
+    if(strcmp(toks[0], "mg") && strcmp(toks[0], "ms") &&
+       strcmp(toks[0], "md")){
+        return fakemc_line(c, "ERROR\r\n")?-1:used;
+    }
+    if(ntoks < 2 || (!strcmp(toks[0], "ms") && ntoks < 3)){
+        return fakemc_line(c, "CLIENT_ERROR bad command line\r\n")?-1:used;
+    }
+
+    memset(&req, 0, sizeof(req));
+    req.key = toks[1];
+    keylen = strlen(toks[1]);
+    for(i=2; i<ntoks; i++){
+        if(!strcmp(toks[i], "b")){
+            keylen = fakemc_unbase64(toks[1]);
+        }else if(toks[i][0] == 'C'){
+            req.cas = strtoull(toks[i] + 1, NULL, 10);
+        }else if(toks[i][0] == 'F'){
+            req.flags = strtoul(toks[i] + 1, NULL, 10);
+        }
+    }
+    if(keylen <= 0){
+        return fakemc_line(c, "CLIENT_ERROR bad key\r\n")?-1:used;
+    }
+    req.keylen = keylen;
+
+    args = 2;
+    if(!strcmp(toks[0], "md")){
+        req.op = CONN_DELETE;
+    }else if(!strcmp(toks[0], "mg")){
+        req.op = CONN_STAT;
+        for(i=2; i<ntoks; i++){
+            if(!strcmp(toks[i], "v")){
+                req.op = CONN_GET;
+            }
+        }
+    }else{
+        req.op = CONN_SET;
+        req.len = strtoull(toks[2], NULL, 10);
+        for(i=3; i<ntoks; i++){
+            if(!strcmp(toks[i], "ME")){
+                req.op = CONN_ADD;
+            }else if(!strcmp(toks[i], "MA")){
+                req.op = CONN_APPEND;
+            }
+        }
+        // parsed again once the value is all there, and only then counted
+        if(len < used + req.len + 2){
+            return 0;
+        }
+        req.val = buf + used;
+        used += req.len + 2;
+        args = 3;
+    }
+    __sync_fetch_and_add(&c->srv->requests, 1);
+    return fakemc_meta(c, &req, toks + args, ntoks - args)?-1:used;
+}
+
+/*
+ * Write out the replies gathered, a round-trip after the requests.
+ */
+static int fakemc_flush(fakemc_conn_t *c)
+{
+    struct timespec ts;
+    size_t off = 0;
+    ssize_t ret;
+
+    if(!c->wlen){
+        return 0;
+    }
+    if(c->srv->latency){
+        ts.tv_sec = c->srv->latency / 1000000;
+        ts.tv_nsec = (c->srv->latency % 1000000) * 1000;
+        while(nanosleep(&ts, &ts) && errno == EINTR);
+    }
+    while(off < c->wlen){
+        ret = write(c->fd, c->wbuf + off, c->wlen - off);
+        if(ret < 0 && errno == EINTR){
+            continue;
+        }
+        if(ret <= 0){
+            return -1;
+        }
+        off += ret;
+    }
+    c->wlen = 0;
+    __sync_fetch_and_add(&c->srv->batches, 1);
+    return 0;
+}
+
+static void *fakemc_serve(void *arg)
+{
+    fakemc_conn_t *c = (fakemc_conn_t*)arg;
+    fakemc_t *srv = c->srv;
+    ssize_t ret;
+    size_t off;
+    char *rbuf;
+
+    for(;;){
+        if(c->rlen == c->rsize){
+            rbuf = (char*)realloc(c->rbuf, c->rsize * 2);
+            if(!rbuf){
+                break;
+            }
+            c->rbuf = rbuf;
+            c->rsize *= 2;
+        }
+        ret = read(c->fd, c->rbuf + c->rlen, c->rsize - c->rlen);
+        if(ret < 0 && errno == EINTR){
+            continue;
+        }
+        if(ret <= 0){
+            break;
+        }
+        c->rlen += ret;
+        for(off = 0; off < c->rlen; off += ret){
+            ret = fakemc_request(c, c->rbuf + off, c->rlen - off);
+            if(ret <= 0){
+                break;
+            }
+        }
+        memmove(c->rbuf, c->rbuf + off, c->rlen - off);
+        c->rlen -= off;
+        if(ret < 0 || fakemc_flush(c)){
+            break;
+        }
+    }
+    close(c->fd);
+    free(c->rbuf);
+    free(c->wbuf);
+    free(c);
+    pthread_mutex_lock(&srv->mutex);
+    srv->conns--;
+    pthread_cond_broadcast(&srv->cond);
+    pthread_mutex_unlock(&srv->mutex);
+    return NULL;
+}
+
+static void *fakemc_accept(void *arg)
+{
+    fakemc_t *srv = (fakemc_t*)arg;
+    fakemc_conn_t *c;
+    pthread_t thread;
+    int fd;
+    int one = 1;
+
+    while((fd = accept(srv->fd, NULL, NULL)) >= 0 || errno == EINTR){
+        if(fd < 0){
+            continue;
+        }
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        c = (fakemc_conn_t*)calloc(1, sizeof(fakemc_conn_t));
+        if(c){
+            c->rsize = CONN_RBUF_SIZE;
+            c->rbuf = (char*)malloc(c->rsize);
+        }
+        if(!c || !c->rbuf){
+            free(c);
+            close(fd);
+            continue;
+        }
+        c->srv = srv;
+        c->fd = fd;
+        pthread_mutex_lock(&srv->mutex);
+        srv->conns++;
+        pthread_mutex_unlock(&srv->mutex);
+        if(pthread_create(&thread, NULL, fakemc_serve, c)){
+            close(fd);
+            free(c->rbuf);
+            free(c);
+            pthread_mutex_lock(&srv->mutex);
+            srv->conns--;
+            pthread_mutex_unlock(&srv->mutex);
+            continue;
+        }
+        pthread_detach(thread);
+    }
+    return NULL;
+}
+
+/*
+ * Listen on a free loopback port, left in srv->port.
+ */
+int fakemc_start(fakemc_t *srv)
+{
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+
+    srv->fd = socket(AF_INET, SOCK_STREAM, 0);
+    if(srv->fd < 0){
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if(bind(srv->fd, (struct sockaddr*)&addr, sizeof(addr)) ||
+       listen(srv->fd, 128) ||
+       getsockname(srv->fd, (struct sockaddr*)&addr, &len)){
+        close(srv->fd);
+        srv->fd = -1;
+        return -1;
+    }
+    snprintf(srv->port, sizeof(srv->port), "%u", ntohs(addr.sin_port));
+    if(pthread_create(&srv->thread, NULL, fakemc_accept, srv)){
+        close(srv->fd);
+        srv->fd = -1;
+        return -1;
+    }
+    srv->running = 1;
+    return 0;
+}
+
+/*
+ * Stop listening, then wait for the clients to hang up.
+ */
+void fakemc_stop(fakemc_t *srv)
+{
+    if(!srv->running){
+        return;
+    }
+    shutdown(srv->fd, SHUT_RDWR);
+    pthread_join(srv->thread, NULL);
+    close(srv->fd);
+    srv->fd = -1;
+    srv->running = 0;
+    pthread_mutex_lock(&srv->mutex);
+    while(srv->conns){
+        pthread_cond_wait(&srv->cond, &srv->mutex);
+    }
+    pthread_mutex_unlock(&srv->mutex);
+}
@@ -0,0 +1,41 @@
+/*
+ * fakemc.h - memcached stand-in for the benchmarks
+ * Copyright (C) 2012 Benoit Vidis <contact@benoitvidis.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+// longest request line, key and flags included
+#define FAKEMC_LINE_MAX 1024
+
+typedef struct{
+    memstore_t *store;
+    unsigned int latency;       // microseconds before each batch of replies
+    int fd;                     // listening socket
+    char port[8];
+    pthread_t thread;
+    int running;
+    unsigned int conns;         // connections being served
+    // counters
+    unsigned long long requests;
+    unsigned long long batches; // replies written out together
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+}fakemc_t;
+
+fakemc_t *fakemc_new(unsigned int latency);
+void fakemc_free(fakemc_t *srv);
+int fakemc_start(fakemc_t *srv);
+void fakemc_stop(fakemc_t *srv);
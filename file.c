@@ -0,0 +1,144 @@
+/*
+ * file.c - open file table
+ * Copyright (C) 2012 Benoit Vidis <contact@benoitvidis.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+/*
+ * The state of an open file (its buffer, attributes and chunk map) is
+ * kept here rather than in a connection handle, so that open files only
+ * borrow a handle for the duration of an actual memcached request.
+ *
+ * Files are stored in pages of FILE_PAGE_SIZE entries which are never
+ * moved once allocated, so that file_get can look up fi->fh without
+ * taking the table mutex.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include "memcachefs.h"
+#include "buf.h"
+#include "file.h"
+
+static void file_buf_release(file_table_t *table, file_t *file)
+{
+    if(file->shared){
+        buf_ref_put(table->bufs, file->shared);
+        file->shared = NULL;
+    }else{
+        buf_release(table->bufs, file->buf, file->buf_size);
+    }
+}
+
+file_table_t *file_table_new(buf_pool_t *bufs)
+{
+    file_table_t *table;
+
+    table = (file_table_t*)malloc(sizeof(file_table_t));
+    if(!table){
+        return NULL;
+    }
+    memset(table, 0, sizeof(file_table_t));
+    table->bufs = bufs;
+    pthread_mutex_init(&table->mutex, NULL);
+    return table;
+}
+
+void file_table_free(file_table_t *table)
+{
+    size_t i;
+    file_t *file;
+
+    for(i=0; i<table->num; i++){
+        file = table->pages[i / FILE_PAGE_SIZE][i % FILE_PAGE_SIZE];
+        file_buf_release(table, file);
+        free(file->loaded);
+        pthread_mutex_destroy(&file->lock);
+        free(file);
+    }
+    for(i=0; i<FILE_PAGES; i++){
+        free(table->pages[i]);
+    }
+    pthread_mutex_destroy(&table->mutex);
+    free(table);
+}
+
+/*
+ * Get an unused file entry, its index is meant for fi->fh.
+ * Returns NULL when the table is full or out of memory.
+ */
+file_t *file_new(file_table_t *table)
+{
+    file_t *file = NULL;
+    file_t ***page;
+
+    pthread_mutex_lock(&table->mutex);
+    if(table->free){
+        file = table->free;
+        table->free = file->next;
+    }else if(table->num < FILE_PAGES * FILE_PAGE_SIZE){
+        page = &table->pages[table->num / FILE_PAGE_SIZE];
+        if(!*page){
+            *page = (file_t**)calloc(FILE_PAGE_SIZE, sizeof(file_t*));
+        }
+        if(*page){
+            file = (file_t*)malloc(sizeof(file_t));
+        }
+        if(file){
+            memset(file, 0, sizeof(file_t));
+            file->index = table->num;
+            pthread_mutex_init(&file->lock, NULL);
+            (*page)[table->num % FILE_PAGE_SIZE] = file;
+            table->num++;
+        }
+    }
+    if(file){
+        file->next = NULL;
+        file->use = 1;
+    }
+    pthread_mutex_unlock(&table->mutex);
+
+    return file;
+}
+
+file_t *file_get(file_table_t *table, uint64_t index)
+{
+    return table->pages[index / FILE_PAGE_SIZE][index % FILE_PAGE_SIZE];
+}
+
+void file_release(file_table_t *table, file_t *file)
+{
+    file_buf_release(table, file);
+    file->buf = NULL;
+    file->buf_len = 0;
+    file->buf_size = 0;
+    free(file->loaded);
+    file->loaded = NULL;
+    file->nchunks = 0;
+    file->dirty = 0;
+    file->append = 0;
+    memset(&file->attr, 0, sizeof(attr_t));
+
+    pthread_mutex_lock(&table->mutex);
+    file->use = 0;
+    file->next = table->free;
+    table->free = file;
+    pthread_mutex_unlock(&table->mutex);
+}
@@ -0,0 +1,57 @@
+/*
+ * file.h - open file table
+ * Copyright (C) 2012 Benoit Vidis <contact@benoitvidis.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#define FILE_PAGE_SIZE 1024
+#define FILE_PAGES 1024
+
+enum{
+    FILE_CHUNK_MISSING,
+    FILE_CHUNK_LOADED,
+    FILE_CHUNK_DIRTY,   // changed in buf, not stored yet
+};
+
+typedef struct file{
+    int index;
+    int use;
+    struct file *next;
+    char *buf;
+    size_t buf_len;
+    size_t buf_size;
+    buf_ref_t *shared;  // holds buf when it is a value of the value cache
+    attr_t attr;
+    char *loaded;       // per chunk, a FILE_CHUNK_* state
+    size_t nchunks;
+    int dirty;          // buf changed since it was last stored
+    int append;         // buf only holds bytes to add after attr.size
+    pthread_mutex_t lock;
+}file_t;
+
+typedef struct{
+    file_t **pages[FILE_PAGES];
+    size_t num;
+    file_t *free;
+    buf_pool_t *bufs;
+    pthread_mutex_t mutex;
+}file_table_t;
+
+file_table_t *file_table_new(buf_pool_t *bufs);
+void file_table_free(file_table_t *table);
+file_t *file_new(file_table_t *table);
+file_t *file_get(file_table_t *table, uint64_t index);
+void file_release(file_table_t *table, file_t *file);
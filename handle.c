@@ -18,42 +18,219 @@
  * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
  */
 
+
+/*
+ * Handles are kept on HANDLE_SHARDS free lists. A thread pops from and
+ * pushes to the list picked by its thread id, so concurrent FUSE workers
+ * rarely meet on the same mutex, and only fall back to the other lists
+ * when their own is empty.
+ *
+ * The pool starts with `min' handles and creates more on demand, up to
+ * `max'. When all of them are busy, up to `max_waiters' callers sleep for
+ * at most `timeout' milliseconds until one is released instead of failing
+ * straight away. Handles left idle for HANDLE_IDLE seconds above the
+ * minimum close their connection; they reconnect the next time they are
+ * used.
+ */
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <time.h>
 #include <pthread.h>
-#include <memcache.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/uio.h>
 #include "memcachefs.h"
+#include "conn.h"
 #include "handle.h"
+#include "stats.h"
+
+static unsigned int handle_shard(void)
+{
+    unsigned long id = (unsigned long)pthread_self();
+
+    id ^= id >> 17;
+    id *= 0x9e3779b1UL;
+    return (id >> 8) % HANDLE_SHARDS;
+}
+
+/*
+ * (Re)create the connection of a handle.
+ */
+static int handle_open(handle_pool_t *pool, handle_t *handle)
+{
+    if(!handle->conn){
+        handle->conn = conn_new(pool->backend, pool->server);
+        if(!handle->conn){
+            return -1;
+        }
+        __sync_fetch_and_add(&pool->live, 1);
+    }
+    return 0;
+}
 
-static pthread_mutex_t handles_mutex = PTHREAD_MUTEX_INITIALIZER;
+static void handle_close(handle_pool_t *pool, handle_t *handle)
+{
+    if(handle->conn){
+        conn_free(handle->conn);
+        handle->conn = NULL;
+        __sync_fetch_and_sub(&pool->live, 1);
+    }
+}
 
-handle_pool_t *handle_pool_new(memcachefs_opt_t *opt)
+static handle_t *handle_new(handle_pool_t *pool, int index)
+{
+    handle_t *handle;
+
+    handle = (handle_t*)malloc(sizeof(handle_t));
+    if(!handle){
+        return NULL;
+    }
+    memset(handle, 0, sizeof(handle_t));
+    handle->pool = pool;
+    handle->index = index;
+    if(handle_open(pool, handle)){
+        handle_close(pool, handle);
+        free(handle);
+        return NULL;
+    }
+    return handle;
+}
+
+static void handle_push(handle_pool_t *pool, handle_t *handle)
+{
+    handle_shard_t *shard = &pool->shards[handle_shard()];
+
+    pthread_mutex_lock(&shard->mutex);
+    handle->next = shard->free;
+    shard->free = handle;
+    pthread_mutex_unlock(&shard->mutex);
+}
+
+static handle_t *handle_pop(handle_pool_t *pool)
+{
+    unsigned int first = handle_shard();
+    unsigned int i;
+    handle_shard_t *shard;
+    handle_t *handle = NULL;
+
+    for(i=0; i<HANDLE_SHARDS && !handle; i++){
+        shard = &pool->shards[(first + i) % HANDLE_SHARDS];
+        pthread_mutex_lock(&shard->mutex);
+        handle = shard->free;
+        if(handle){
+            shard->free = handle->next;
+            handle->next = NULL;
+        }
+        pthread_mutex_unlock(&shard->mutex);
+    }
+    return handle;
+}
+
+/*
+ * Add a handle to the pool if it may still grow. Called with pool->mutex.
+ */
+static handle_t *handle_grow(handle_pool_t *pool)
+{
+    handle_t *handle;
+
+    if(pool->num >= pool->max){
+        return NULL;
+    }
+    handle = handle_new(pool, pool->num);
+    if(!handle){
+        return NULL;
+    }
+    pool->handles[pool->num] = handle;
+    pool->num++;
+    return handle;
+}
+
+/*
+ * Give back the resources of handles idle for too long, keeping at least
+ * pool->min of them alive.
+ */
+static void handle_reap(handle_pool_t *pool, time_t now)
+{
+    unsigned int i;
+    handle_shard_t *shard;
+    handle_t *handle;
+
+    for(i=0; i<HANDLE_SHARDS; i++){
+        shard = &pool->shards[i];
+        pthread_mutex_lock(&shard->mutex);
+        for(handle = shard->free; handle; handle = handle->next){
+            if(pool->live <= pool->min){
+                break;
+            }
+            if(handle->conn && now - handle->last_used >= HANDLE_IDLE){
+                handle_close(pool, handle);
+            }
+        }
+        pthread_mutex_unlock(&shard->mutex);
+        if(pool->live <= pool->min){
+            break;
+        }
+    }
+}
+
+static handle_t *handle_take(handle_pool_t *pool, handle_t *handle)
+{
+    if(handle_open(pool, handle)){
+        handle_close(pool, handle);
+        handle_push(pool, handle);
+        return NULL;
+    }
+    handle->use = 1;
+    return handle;
+}
+
+handle_pool_t *handle_pool_new(memcachefs_opt_t *opt, server_t *server)
 {
     int i;
-    int ret;
     handle_pool_t *pool;
+    handle_t *handle;
 
     pool = (handle_pool_t*)malloc(sizeof(handle_pool_t));
     if(!pool){
         return NULL;
     }
-    pool->num = opt->maxhandle;
-    pool->handles = (handle_t**)malloc(sizeof(handle_t*) * pool->num);
+    memset(pool, 0, sizeof(handle_pool_t));
+    pool->max = opt->maxhandle;
+    pool->min = (opt->minhandle < pool->max)?opt->minhandle:pool->max;
+    pool->max_waiters = opt->handle_queue;
+    pool->timeout = opt->handle_wait;
+    pool->host = server->host;
+    pool->port = server->port;
+    pool->last_reap = time(NULL);
+    pool->backend = conn_backend(opt->backend);
+    pool->handles = (handle_t**)malloc(sizeof(handle_t*) * pool->max);
     if(!pool->handles){
+        free(pool);
         return NULL;
     }
-    for(i=0; i<pool->num; i++){
-        pool->handles[i] = (handle_t*)malloc(sizeof(handle_t));
-        if(!pool->handles[i]){
+    pool->server = pool->backend->server_new(server);
+    if(!pool->server){
+        free(pool->handles);
+        free(pool);
+        return NULL;
+    }
+    memset(pool->handles, 0, sizeof(handle_t*) * pool->max);
+    for(i=0; i<HANDLE_SHARDS; i++){
+        pthread_mutex_init(&pool->shards[i].mutex, NULL);
+    }
+    pthread_mutex_init(&pool->mutex, NULL);
+    pthread_cond_init(&pool->cond, NULL);
+
+    for(i=0; i<pool->min; i++){
+        handle = handle_grow(pool);
+        if(!handle){
+            handle_pool_free(pool);
             return NULL;
         }
-        memset(pool->handles[i], 0, sizeof(handle_t));
-        pool->handles[i]->index = i;
-        pool->handles[i]->buf_size = 1024 * 1024;
-        pool->handles[i]->buf = (char*)malloc(pool->handles[i]->buf_size);
-        pool->handles[i]->mc = mc_new();
-        ret = mc_server_add(pool->handles[i]->mc, opt->host, opt->port);
+        handle_push(pool, handle);
     }
     return pool;
 }
@@ -61,37 +238,109 @@ handle_pool_t *handle_pool_new(memcachefs_opt_t *opt)
 void handle_pool_free(handle_pool_t *pool)
 {
     int i;
+
     for(i=0; i<pool->num; i++){
-        free(pool->handles[i]->buf);
-        mc_free(pool->handles[i]->mc);
+        handle_close(pool, pool->handles[i]);
         free(pool->handles[i]);
     }
+    for(i=0; i<HANDLE_SHARDS; i++){
+        pthread_mutex_destroy(&pool->shards[i].mutex);
+    }
+    pthread_mutex_destroy(&pool->mutex);
+    pthread_cond_destroy(&pool->cond);
+    pool->backend->server_free(pool->server);
     free(pool->handles);
     free(pool);
 }
 
+/*
+ * Get a free handle without waiting, NULL when all of them are busy.
+ */
+handle_t *handle_tryget(handle_pool_t *pool)
+{
+    handle_t *handle;
+
+    handle = handle_pop(pool);
+    if(!handle){
+        pthread_mutex_lock(&pool->mutex);
+        handle = handle_grow(pool);
+        pthread_mutex_unlock(&pool->mutex);
+    }
+    if(!handle){
+        return NULL;
+    }
+    return handle_take(pool, handle);
+}
+
+/*
+ * Get a free handle, waiting up to pool->timeout milliseconds for one to
+ * be released. Returns NULL on timeout or when too many callers wait.
+ */
 handle_t *handle_get(handle_pool_t *pool)
 {
-    int i;
-    handle_t *ret = NULL;
+    handle_t *handle;
+    struct timeval now;
+    struct timespec deadline;
+    int ret = 0;
+    unsigned long long start;
 
-    pthread_mutex_lock(&handles_mutex);
-    for(i=0; i< pool->num; i++){
-        if(!pool->handles[i]->use){
-            ret = pool->handles[i];
-            ret->use = 1;
+    handle = handle_tryget(pool);
+    if(handle || !pool->timeout){
+        return handle;
+    }
+    start = stats_now();
+
+    gettimeofday(&now, NULL);
+    deadline.tv_sec = now.tv_sec + pool->timeout / 1000;
+    deadline.tv_nsec = now.tv_usec * 1000 + (pool->timeout % 1000) * 1000000;
+    if(deadline.tv_nsec >= 1000000000){
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+
+    pthread_mutex_lock(&pool->mutex);
+    if(pool->waiters >= pool->max_waiters){
+        pthread_mutex_unlock(&pool->mutex);
+        return NULL;
+    }
+    __sync_fetch_and_add(&pool->waiters, 1);
+    while(!(handle = handle_pop(pool))){
+        handle = handle_grow(pool);
+        if(handle || ret == ETIMEDOUT){
             break;
         }
+        ret = pthread_cond_timedwait(&pool->cond, &pool->mutex, &deadline);
     }
-    pthread_mutex_unlock(&handles_mutex);
+    __sync_fetch_and_sub(&pool->waiters, 1);
+    pthread_mutex_unlock(&pool->mutex);
+    stats_time(STATS_HANDLE_WAIT, start, !handle);
 
-    return ret;
+    if(!handle){
+        return NULL;
+    }
+    return handle_take(pool, handle);
 }
 
 void handle_release(handle_pool_t *pool, unsigned int index)
 {
-    pthread_mutex_lock(&handles_mutex);
-    pool->handles[index]->use = 0;
-    pthread_mutex_unlock(&handles_mutex);
+    handle_t *handle = pool->handles[index];
+    time_t now;
+
+    now = time(NULL);
+    handle->use = 0;
+    handle->last_used = now;
+    handle_push(pool, handle);
+
+    if(__sync_fetch_and_add(&pool->waiters, 0)){
+        pthread_mutex_lock(&pool->mutex);
+        pthread_cond_signal(&pool->cond);
+        pthread_mutex_unlock(&pool->mutex);
+    }
+    if(pool->live > pool->min && now - pool->last_reap >= HANDLE_IDLE &&
+       !pthread_mutex_trylock(&pool->mutex)){
+        pool->last_reap = now;
+        pthread_mutex_unlock(&pool->mutex);
+        handle_reap(pool, now);
+    }
     return;
 }
@@ -18,21 +18,47 @@
  * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
  */
 
-typedef struct{
+#define HANDLE_SHARDS 8
+// seconds before an idle handle past the minimum gives its resources back
+#define HANDLE_IDLE 30
+
+struct handle_pool;
+
+typedef struct handle{
+    struct handle_pool *pool;
     int index;
     int use;
-    struct memcache *mc;
-    char *buf;
-    size_t buf_len;
-    size_t buf_size;
+    struct handle *next;
+    time_t last_used;
+    conn_t *conn;
 }handle_t;
 
 typedef struct{
+    pthread_mutex_t mutex;
+    handle_t *free;
+}handle_shard_t;
+
+typedef struct handle_pool{
     handle_t **handles;
     size_t num;
+    size_t min;
+    size_t max;
+    unsigned int live;
+    unsigned int waiters;
+    unsigned int max_waiters;
+    unsigned int timeout;
+    time_t last_reap;
+    char *host;
+    char *port;
+    const conn_backend_t *backend;
+    void *server;       // backend state shared by the connections
+    handle_shard_t shards[HANDLE_SHARDS];
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
 }handle_pool_t;
 
-handle_pool_t *handle_pool_new(memcachefs_opt_t *opt);
+handle_pool_t *handle_pool_new(memcachefs_opt_t *opt, server_t *server);
 void handle_pool_free(handle_pool_t *);
 handle_t *handle_get(handle_pool_t *pool);
+handle_t *handle_tryget(handle_pool_t *pool);
 void handle_release(handle_pool_t *pool, unsigned int index);
@@ -0,0 +1,365 @@
+/*
+ * hedge.c - hedged reads over the replicas of a file
+ * Copyright (C) 2012 Benoit Vidis <contact@benoitvidis.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+/*
+ * A hedged read asks the first replica of a file, and when no answer
+ * came after `delay', asks the next one as well and takes whichever
+ * answers first. The delay is the 95th percentile of the recent request
+ * latencies, so that only the slowest 5% of the reads cost a second
+ * request. A replica failing, or not having the key, has the next one
+ * asked at once.
+ *
+ * The requests run on a small pool of worker threads while the caller
+ * waits. A request that lost the race finishes in the background, gives
+ * its handle back and throws its answer away.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include "memcachefs.h"
+#include "conn.h"
+#include "handle.h"
+#include "hedge.h"
+
+static void hedge_deadline(struct timespec *deadline, unsigned long usec)
+{
+    struct timeval now;
+
+    gettimeofday(&now, NULL);
+    deadline->tv_sec = now.tv_sec + usec / 1000000;
+    deadline->tv_nsec = (now.tv_usec + usec % 1000000) * 1000;
+    if(deadline->tv_nsec >= 1000000000){
+        deadline->tv_sec++;
+        deadline->tv_nsec -= 1000000000;
+    }
+}
+
+static int hedge_cmp(const void *a, const void *b)
+{
+    unsigned int ua = *(const unsigned int*)a;
+    unsigned int ub = *(const unsigned int*)b;
+
+    return (ua > ub) - (ua < ub);
+}
+
+/*
+ * Record the latency of a request, in microseconds.
+ */
+static void hedge_sample(hedge_t *hedge, unsigned int usec)
+{
+    unsigned int sorted[HEDGE_SAMPLES];
+    unsigned int n;
+    unsigned int delay;
+
+    pthread_mutex_lock(&hedge->mutex);
+    hedge->samples[hedge->nsamples % HEDGE_SAMPLES] = usec;
+    hedge->nsamples++;
+    if(hedge->nsamples % HEDGE_UPDATE){
+        pthread_mutex_unlock(&hedge->mutex);
+        return;
+    }
+    n = (hedge->nsamples < HEDGE_SAMPLES)?hedge->nsamples:HEDGE_SAMPLES;
+    memcpy(sorted, hedge->samples, sizeof(unsigned int) * n);
+    pthread_mutex_unlock(&hedge->mutex);
+
+    qsort(sorted, n, sizeof(unsigned int), hedge_cmp);
+    delay = sorted[n * 95 / 100];
+    if(delay < HEDGE_DELAY_MIN){
+        delay = HEDGE_DELAY_MIN;
+    }else if(delay > HEDGE_DELAY_MAX){
+        delay = HEDGE_DELAY_MAX;
+    }
+    __sync_lock_test_and_set(&hedge->delay, delay);
+}
+
+static void hedge_call_put(hedge_call_t *call)
+{
+    if(__sync_sub_and_fetch(&call->refs, 1)){
+        return;
+    }
+    pthread_mutex_destroy(&call->mutex);
+    pthread_cond_destroy(&call->cond);
+    free(call);
+}
+
+/*
+ * Whether an answer may end the race. Errors leave it to the next
+ * replica, and so does a missing key but on the last one: a replica
+ * restarted empty must not hide the copies of the others.
+ */
+static int hedge_usable(hedge_call_t *call, unsigned int replica, int ret)
+{
+    return !ret || (ret == -ENOENT && replica == call->npools - 1);
+}
+
+/*
+ * Ask one replica. The first usable answer is handed to the caller, the
+ * later ones are disposed of.
+ */
+static void hedge_attempt(hedge_t *hedge, hedge_call_t *call,
+                          unsigned int replica)
+{
+    int ret;
+    void *out;
+    handle_t *handle = NULL;
+    struct timeval start;
+    struct timeval end;
+
+    out = malloc(call->size);
+    if(!out){
+        ret = -ENOMEM;
+    }else{
+        gettimeofday(&start, NULL);
+        handle = handle_get(call->pools[replica]);
+        if(!handle){
+            ret = -EMFILE;
+        }else{
+            ret = call->fn(handle, call->path, out);
+            handle_release(call->pools[replica], handle->index);
+            gettimeofday(&end, NULL);
+            // a refused connection fails fast, and is no latency
+            if(!ret || ret == -ENOENT){
+                hedge_sample(hedge, (end.tv_sec - start.tv_sec) * 1000000 +
+                             end.tv_usec - start.tv_usec);
+            }
+        }
+    }
+
+    pthread_mutex_lock(&call->mutex);
+    call->finished++;
+    if(call->winner < 0 && hedge_usable(call, replica, ret)){
+        memcpy(call->out, out, call->size);
+        call->ret = ret;
+        call->winner = replica;
+        if(replica){
+            __sync_fetch_and_add(&hedge->won, 1);
+        }
+    }else{
+        // a replica without the key says more than one without an answer
+        if(call->winner < 0 && call->ret != -ENOENT){
+            call->ret = ret;
+        }
+        if(!ret && call->dispose){
+            call->dispose(out);
+        }
+    }
+    pthread_cond_signal(&call->cond);
+    pthread_mutex_unlock(&call->mutex);
+    free(out);
+    hedge_call_put(call);
+}
+
+static void *hedge_worker(void *arg)
+{
+    hedge_t *hedge = (hedge_t*)arg;
+    hedge_task_t *task;
+    struct timespec deadline;
+    int ret;
+
+    pthread_mutex_lock(&hedge->mutex);
+    for(;;){
+        ret = 0;
+        while(!hedge->queue && !hedge->stop && ret != ETIMEDOUT){
+            hedge_deadline(&deadline, HEDGE_IDLE * 1000000UL);
+            hedge->idle++;
+            ret = pthread_cond_timedwait(&hedge->cond, &hedge->mutex,
+                                         &deadline);
+            hedge->idle--;
+        }
+        task = hedge->queue;
+        if(!task){
+            break;
+        }
+        hedge->queue = task->next;
+        hedge->queued--;
+        if(!hedge->queue){
+            hedge->queue_tail = &hedge->queue;
+        }
+        pthread_mutex_unlock(&hedge->mutex);
+        hedge_attempt(hedge, task->call, task->replica);
+        free(task);
+        pthread_mutex_lock(&hedge->mutex);
+    }
+    hedge->threads--;
+    pthread_cond_broadcast(&hedge->cond);
+    pthread_mutex_unlock(&hedge->mutex);
+    return NULL;
+}
+
+/*
+ * Queue a request to a replica, starting a worker when none is idle.
+ */
+static int hedge_submit(hedge_t *hedge, hedge_call_t *call,
+                        unsigned int replica)
+{
+    hedge_task_t *task;
+    pthread_t thread;
+
+    task = (hedge_task_t*)malloc(sizeof(hedge_task_t));
+    if(!task){
+        return -1;
+    }
+    task->next = NULL;
+    task->call = call;
+    task->replica = replica;
+
+    pthread_mutex_lock(&hedge->mutex);
+    if(hedge->idle <= hedge->queued && hedge->threads < hedge->max_threads){
+        if(!pthread_create(&thread, NULL, hedge_worker, hedge)){
+            pthread_detach(thread);
+            hedge->threads++;
+        }
+    }
+    if(!hedge->threads){
+        pthread_mutex_unlock(&hedge->mutex);
+        free(task);
+        return -1;
+    }
+    *hedge->queue_tail = task;
+    hedge->queue_tail = &task->next;
+    hedge->queued++;
+    pthread_cond_signal(&hedge->cond);
+    pthread_mutex_unlock(&hedge->mutex);
+    return 0;
+}
+
+hedge_t *hedge_new(unsigned int max_threads)
+{
+    hedge_t *hedge;
+
+    hedge = (hedge_t*)malloc(sizeof(hedge_t));
+    if(!hedge){
+        return NULL;
+    }
+    memset(hedge, 0, sizeof(hedge_t));
+    hedge->delay = HEDGE_DELAY_DEFAULT;
+    hedge->max_threads = max_threads?max_threads:1;
+    hedge->queue_tail = &hedge->queue;
+    pthread_mutex_init(&hedge->mutex, NULL);
+    pthread_cond_init(&hedge->cond, NULL);
+    return hedge;
+}
+
+void hedge_free(hedge_t *hedge)
+{
+    pthread_mutex_lock(&hedge->mutex);
+    hedge->stop = 1;
+    pthread_cond_broadcast(&hedge->cond);
+    while(hedge->threads){
+        pthread_cond_wait(&hedge->cond, &hedge->mutex);
+    }
+    pthread_mutex_unlock(&hedge->mutex);
+    pthread_mutex_destroy(&hedge->mutex);
+    pthread_cond_destroy(&hedge->cond);
+    free(hedge);
+}
+
+/*
+ * Launch the request to the next replica, in the calling thread when no
+ * worker can take it. Called with call->mutex held.
+ */
+static void hedge_launch(hedge_t *hedge, hedge_call_t *call)
+{
+    unsigned int replica = call->launched++;
+
+    __sync_fetch_and_add(&call->refs, 1);
+    pthread_mutex_unlock(&call->mutex);
+    if(hedge_submit(hedge, call, replica)){
+        hedge_attempt(hedge, call, replica);
+    }
+    pthread_mutex_lock(&call->mutex);
+}
+
+/*
+ * Run fn(handle, path, out) against the replicas in pools, hedging when
+ * the first one is slow. out receives the first answer, of size bytes;
+ * answers arriving later are passed to dispose when fn succeeded.
+ * Returns what fn returned for the answer taken.
+ */
+int hedge_run(hedge_t *hedge, handle_pool_t **pools, unsigned int npools,
+              hedge_fn_t fn, const char *path, void *out, size_t size,
+              hedge_dispose_t dispose)
+{
+    int ret;
+    size_t len = strlen(path);
+    hedge_call_t *call;
+    struct timespec deadline;
+
+    call = (hedge_call_t*)malloc(sizeof(hedge_call_t) + len + 1);
+    if(!call){
+        return -ENOMEM;
+    }
+    memset(call, 0, sizeof(hedge_call_t));
+    memcpy(call->path, path, len + 1);
+    call->refs = 1;
+    call->ret = -EIO;
+    call->winner = -1;
+    call->fn = fn;
+    call->dispose = dispose;
+    call->out = out;
+    call->size = size;
+    if(npools > MEMCACHEFS_REPLICA_MAX){
+        npools = MEMCACHEFS_REPLICA_MAX;
+    }
+    memcpy(call->pools, pools, sizeof(handle_pool_t*) * npools);
+    call->npools = npools;
+    pthread_mutex_init(&call->mutex, NULL);
+    pthread_cond_init(&call->cond, NULL);
+
+    pthread_mutex_lock(&call->mutex);
+    hedge_launch(hedge, call);
+    while(call->winner < 0){
+        if(call->finished == call->launched){
+            // every request so far finished without a usable answer
+            if(call->launched == call->npools){
+                break;
+            }
+            hedge_launch(hedge, call);
+            continue;
+        }
+        if(call->launched < call->npools){
+            hedge_deadline(&deadline, hedge->delay);
+            if(pthread_cond_timedwait(&call->cond, &call->mutex,
+                                      &deadline) == ETIMEDOUT &&
+               call->winner < 0){
+                __sync_fetch_and_add(&hedge->hedged, 1);
+                hedge_launch(hedge, call);
+            }
+        }else{
+            pthread_cond_wait(&call->cond, &call->mutex);
+        }
+    }
+    ret = call->ret;
+    pthread_mutex_unlock(&call->mutex);
+    hedge_call_put(call);
+    return ret;
+}
+
+void hedge_stats(hedge_t *hedge, FILE *fp)
+{
+    fprintf(fp, "hedge: delay %u us, %lu hedged, %lu won by a replica\n",
+            hedge->delay, hedge->hedged, hedge->won);
+}
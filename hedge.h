@@ -0,0 +1,80 @@
+/*
+ * hedge.h - hedged reads over the replicas of a file
+ * Copyright (C) 2012 Benoit Vidis <contact@benoitvidis.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+// latencies kept to derive the hedging delay from
+#define HEDGE_SAMPLES 256
+// recompute the delay every so many samples
+#define HEDGE_UPDATE 32
+// bounds of the delay, in microseconds
+#define HEDGE_DELAY_MIN 200
+#define HEDGE_DELAY_MAX 1000000
+// delay until enough latencies were seen
+#define HEDGE_DELAY_DEFAULT 2000
+// seconds before an idle worker thread exits
+#define HEDGE_IDLE 30
+
+typedef int (*hedge_fn_t)(handle_t *handle, const char *path, void *out);
+typedef void (*hedge_dispose_t)(void *out);
+
+typedef struct{
+    int refs;
+    int ret;
+    int winner;
+    unsigned int launched;
+    unsigned int finished;
+    hedge_fn_t fn;
+    hedge_dispose_t dispose;
+    void *out;
+    size_t size;
+    handle_pool_t *pools[MEMCACHEFS_REPLICA_MAX];
+    unsigned int npools;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    char path[];
+}hedge_call_t;
+
+typedef struct hedge_task{
+    struct hedge_task *next;
+    hedge_call_t *call;
+    unsigned int replica;
+}hedge_task_t;
+
+typedef struct{
+    unsigned int samples[HEDGE_SAMPLES];
+    unsigned int nsamples;
+    unsigned int delay;
+    unsigned long hedged;
+    unsigned long won;
+    hedge_task_t *queue;
+    hedge_task_t **queue_tail;
+    unsigned int queued;
+    unsigned int threads;
+    unsigned int idle;
+    unsigned int max_threads;
+    int stop;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+}hedge_t;
+
+hedge_t *hedge_new(unsigned int max_threads);
+void hedge_free(hedge_t *hedge);
+int hedge_run(hedge_t *hedge, handle_pool_t **pools, unsigned int npools,
+              hedge_fn_t fn, const char *path, void *out, size_t size,
+              hedge_dispose_t dispose);
+void hedge_stats(hedge_t *hedge, FILE *fp);
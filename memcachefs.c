@@ -30,575 +30,3008 @@
 #include <fcntl.h>
 #include <libgen.h>
 #include <limits.h>
+#include <time.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <semaphore.h>
 #include <sys/stat.h>
 #include <sys/types.h>
-#include <sys/socket.h>
-#include <netinet/in.h>
-#include <arpa/inet.h>
-#include <netdb.h>
+#include <sys/uio.h>
 #include <fuse/fuse.h>
-#include <memcache.h>
 #include "memcachefs.h"
+#include "conn.h"
 #include "handle.h"
+#include "buf.h"
+#include "file.h"
+#include "attrcache.h"
+#include "meta.h"
+#include "dir.h"
+#include "chunk.h"
+#include "dirstream.h"
+#include "dirindex.h"
+#include "ring.h"
+#include "hedge.h"
+#include "writeback.h"
+#include "valcache.h"
+#include "pack.h"
+#include "dedup.h"
+#include "stats.h"
+#include "trace.h"
 
 /* default options */
 memcachefs_opt_t opt = {
-    .host = NULL,
+    .hosts = NULL,
     .port = "11211",
     .verbose = 0,
     .maxhandle = 10,
+    .minhandle = 2,
+    .handle_wait = 1000,
+    .handle_queue = 128,
+    .attr_timeout = 1,
+    .chunk_size = 1000 * 1024,
+    .chunk_threads = 4,
+    .readahead = 2,
+    .buf_cache = 64 * 1024 * 1024,
+    .dir_refresh = 30,
+    .replicas = 1,
+    .writeback = 0,
+    .writeback_bytes = 64 * 1024 * 1024,
+    .writeback_age = 1000,
+    .read_cache = 32 * 1024 * 1024,
+    .inodes = 0,
+    .compress = PACK_NONE,
+    .compress_min = 256,
+    .dedup = 0,
+    .trace = 0,
+    .trace_file = NULL,
+    .backend = NULL,
 };
 
-handle_pool_t *pool;
+handle_pool_t **pools;
+ring_t *ring;
+hedge_t *hedge;
+buf_pool_t *bufs;
+file_table_t *files;
+attr_cache_t *attrs;
+dirindex_t *dirs;
+writeback_t *wback;
+val_cache_t *vals;
+pack_t *packer;
+trace_t *tracer;
+unsigned long long inode_next;
 
-static int memcachefs_connect()
+/*
+ * Each server has its own pool of handles. Every key of a file (value,
+ * metadata record and chunks) goes to the server picked for its name.
+ */
+static handle_pool_t *memcachefs_pool(const char *path)
+{
+    return pools[ring_lookup(ring, path + 1)];
+}
+
+/*
+ * Pools of the servers keeping a copy of path, the one of
+ * memcachefs_pool() first. Returns how many.
+ */
+static unsigned int memcachefs_replicas(const char *path,
+                                        handle_pool_t **replicas)
+{
+    unsigned int servers[MEMCACHEFS_REPLICA_MAX];
+    unsigned int n;
+    unsigned int i;
+
+    n = ring_lookup_n(ring, path + 1, servers, opt.replicas);
+    for(i=0; i<n; i++){
+        replicas[i] = pools[servers[i]];
+    }
+    return n;
+}
+
+/*
+ * Run a read against the copies of path, hedged when there are several.
+ */
+static int memcachefs_hedged(const char *path, hedge_fn_t fn, void *out,
+                             size_t size, hedge_dispose_t dispose)
+{
+    int ret;
+    handle_pool_t *replicas[MEMCACHEFS_REPLICA_MAX];
+    unsigned int n;
+    handle_t *handle;
+
+    n = memcachefs_replicas(path, replicas);
+    if(n > 1){
+        return hedge_run(hedge, replicas, n, fn, path, out, size, dispose);
+    }
+    handle = handle_get(replicas[0]);
+    if(!handle){
+        return -EMFILE;
+    }
+    ret = fn(handle, path, out);
+    handle_release(replicas[0], handle->index);
+    return ret;
+}
+
+/*
+ * Number of a new inode. The sequence starts at a random point, so that
+ * clients sharing the servers do not hand out the same ones.
+ */
+static unsigned long long memcachefs_inode(void)
+{
+    return __sync_add_and_fetch(&inode_next, 1);
+}
+
+static void memcachefs_inode_seed(void)
+{
+    FILE *fp;
+
+    fp = fopen("/dev/urandom", "r");
+    if(!fp || fread(&inode_next, sizeof(inode_next), 1, fp) != 1){
+        inode_next = ((unsigned long long)time(NULL) << 32) ^ getpid();
+    }
+    if(fp){
+        fclose(fp);
+    }
+    // keep clear of 0, which means no inode
+    inode_next &= ~0ULL >> 1;
+}
+
+static int memcachefs_is_reserved(const char *key)
+{
+    size_t len = strlen(STATS_DIR) - 1;
+
+    if(!strncmp(key, STATS_DIR + 1, len) && (!key[len] || key[len] == '/')){
+        return 1;
+    }
+    return !strncmp(key, MEMCACHEFS_RESERVED, strlen(MEMCACHEFS_RESERVED));
+}
+
+/*
+ * Check that a new file name can be stored, metadata record included.
+ */
+static int memcachefs_check_key(const char *path)
+{
+    const char *key = path + 1;
+
+    if(memcachefs_is_reserved(key)){
+        return -EPERM;
+    }
+    if(strlen(META_PREFIX) + strlen(key) > MEMCACHEFS_KEY_MAX ||
+       CHUNK_KEY_OVERHEAD + strlen(key) > MEMCACHEFS_KEY_MAX){
+        return -ENAMETOOLONG;
+    }
+    return 0;
+}
+
+/*
+ * Split path into the directory it is in and its name: "/a/b" gives "/a"
+ * and "b", "/b" gives "/" and "b".
+ */
+static const char *memcachefs_parent(const char *path, char *parent)
+{
+    const char *name = strrchr(path, '/');
+    size_t len = name - path;
+
+    if(!len){
+        len = 1;
+    }
+    memcpy(parent, path, len);
+    parent[len] = '\0';
+    return name + 1;
+}
+
+/*
+ * Add path to the index of its directory, or remove it. The top one only
+ * indexes what listing the servers does not find: directories and files
+ * under an inode (see dir.c). attr is NULL for a file of unknown layout.
+ */
+static int memcachefs_index(const char *path, const attr_t *attr, int add)
+{
+    int ret;
+    int type = (attr && S_ISDIR(attr->mode))?DIR_DIR:DIR_FILE;
+    char parent[MEMCACHEFS_KEY_MAX + 2];
+    const char *name;
+    handle_pool_t *pool;
+    handle_t *handle;
+
+    name = memcachefs_parent(path, parent);
+    if(!strcmp(parent, "/") && type != DIR_DIR && !(attr && attr->ino)){
+        return 0;
+    }
+    pool = memcachefs_pool(parent);
+    handle = handle_get(pool);
+    if(!handle){
+        return -EMFILE;
+    }
+    if(add){
+        ret = dir_link(handle->conn, parent, name, type, opt.chunk_size);
+    }else{
+        ret = dir_unlink(handle->conn, parent, name);
+    }
+    handle_release(pool, handle->index);
+    return ret;
+}
+
+/*
+ * Fill reqs with the requests finding the attributes of key: the size of
+ * its value and, unless the key is too long to have one, its metadata
+ * record, received into record. Returns how many.
+ */
+static size_t memcachefs_probe(const char *key, char *mkey, char *record,
+                               conn_req_t *reqs)
+{
+    int mkeylen;
+
+    memset(reqs, 0, 2 * sizeof(conn_req_t));
+    reqs[0].op = CONN_STAT;
+    reqs[0].key = key;
+    reqs[0].keylen = strlen(key);
+    mkeylen = meta_key(key, mkey, MEMCACHEFS_KEY_MAX + 1);
+    if(mkeylen < 0){
+        return 1;
+    }
+    reqs[1].op = CONN_GET;
+    reqs[1].key = mkey;
+    reqs[1].keylen = mkeylen;
+    reqs[1].buf = record;
+    reqs[1].bufsize = META_RECORD_MAX;
+    return 2;
+}
+
+/*
+ * Read the attributes out of the replies to memcachefs_probe(). Returns
+ * 0 when the record was found, 1 when only the value was, which then
+ * needs a record, 2 when that value is also packed or a list of blocks
+ * and the size of the file is still to be read from it, and -errno
+ * otherwise.
+ */
+static int memcachefs_probed(conn_req_t *reqs, size_t n, const char *record,
+                             attr_t *attr)
+{
+    if(n == 2 && reqs[1].data && reqs[1].data != record){
+        free(reqs[1].data);
+        reqs[1].status = CONN_ERROR;
+    }
+    if(n == 2 && reqs[1].status == CONN_OK &&
+       !meta_decode(record, reqs[1].bytes, attr)){
+        return 0;
+    }
+    if(reqs[0].status != CONN_OK){
+        return (reqs[0].status == CONN_MISS)?-ENOENT:-EIO;
+    }
+    attr->size = reqs[0].bytes;
+    attr->mtime = 0;
+    attr->mode = 0;
+    attr->gen = 0;
+    attr->chunk = 0;
+    attr->ino = 0;
+    return (reqs[0].flags & (PACK_FLAGS | DEDUP_FLAG))?2:1;
+}
+
+/*
+ * Find the attributes of path: from the attribute cache, then from the
+ * metadata record, and last from the value itself for keys which were
+ * stored by another memcached client. The record and the size of the
+ * value are asked for in the same round-trip, without the value. The
+ * record is then added so that the size is not asked for again.
+ */
+static int memcachefs_lookup(handle_t *handle, const char *path, attr_t *attr)
+{
+    int ret;
+    long size;
+    dedup_list_t list;
+    char *key;
+    char mkey[MEMCACHEFS_KEY_MAX + 1];
+    char record[META_RECORD_MAX];
+    conn_req_t reqs[2];
+    size_t n;
+
+    if(attr_cache_peek(attrs, path, attr)){
+        return 0;
+    }
+    key = (char *)path + 1;
+    if(memcachefs_is_reserved(key)){
+        return -ENOENT;
+    }
+    n = memcachefs_probe(key, mkey, record, reqs);
+    conn_exec(handle->conn, reqs, n);
+    ret = memcachefs_probed(reqs, n, record, attr);
+    if(ret < 0){
+        return ret;
+    }
+    if(ret == 2){
+        reqs[0].op = CONN_GET;
+        conn_exec(handle->conn, reqs, 1);
+        if(reqs[0].status != CONN_OK){
+            return (reqs[0].status == CONN_MISS)?-ENOENT:-EIO;
+        }
+        if(reqs[0].flags & DEDUP_FLAG){
+            size = dedup_decode(reqs[0].data, reqs[0].bytes, &list)?
+                   -1:(long)list.size;
+            dedup_list_free(&list);
+        }else{
+            size = pack_length(reqs[0].data, reqs[0].bytes);
+        }
+        free(reqs[0].data);
+        if(size < 0){
+            return -EIO;
+        }
+        attr->size = size;
+    }
+    if(ret){
+        meta_store(handle->conn, key, attr, 0);
+    }
+    attr_cache_set(attrs, path, attr);
+    return 0;
+}
+
+static size_t memcachefs_nchunks(const attr_t *attr)
+{
+    if(!attr->chunk){
+        return 1;
+    }
+    return (attr->size + attr->chunk - 1) / attr->chunk;
+}
+
+/*
+ * Write the chunks listed in index and the metadata record of a file to
+ * the server of handle, then drop the chunks past its new end. A single
+ * value is written as given, with the item flags of its packing.
+ */
+static int memcachefs_put(handle_t *handle, const char *path,
+                          const char *buf, size_t len, unsigned int flags,
+                          const size_t *index, size_t n, const attr_t *attr,
+                          size_t oldcount, size_t count)
+{
+    char ikey[META_INODE_KEY_MAX];
+    const char *key = meta_data_key(path + 1, attr, ikey);
+    conn_req_t req;
+
+    if(attr->chunk){
+        if(chunk_store(handle->pool, handle, key, buf, len, attr->chunk,
+                       index, n, opt.chunk_threads)){
+            return -1;
+        }
+    }else{
+        memset(&req, 0, sizeof(req));
+        req.op = CONN_SET;
+        req.key = key;
+        req.keylen = strlen(key);
+        req.val = buf;
+        req.len = len;
+        req.flags = flags;
+        if(conn_exec(handle->conn, &req, 1) || req.status != CONN_OK){
+            return -1;
+        }
+    }
+    if(meta_store(handle->conn, path + 1, attr, 1)){
+        return -1;
+    }
+    if(oldcount > count){
+        chunk_delete(handle, key, count, oldcount);
+    }
+    return 0;
+}
+
+/*
+ * Copy a write to the other replicas of path. They are best effort: a
+ * replica that missed a write keeps the previous version.
+ */
+static void memcachefs_put_replicas(handle_t *handle, const char *path,
+                                    const char *buf, size_t len,
+                                    unsigned int flags,
+                                    const size_t *index, size_t n,
+                                    const attr_t *attr, size_t oldcount,
+                                    size_t count)
+{
+    handle_pool_t *replicas[MEMCACHEFS_REPLICA_MAX];
+    unsigned int nreplicas;
+    unsigned int i;
+    handle_t *rhandle;
+
+    nreplicas = memcachefs_replicas(path, replicas);
+    for(i=0; i<nreplicas; i++){
+        if(replicas[i] == handle->pool){
+            continue;
+        }
+        rhandle = handle_get(replicas[i]);
+        if(!rhandle){
+            continue;
+        }
+        if(memcachefs_put(rhandle, path, buf, len, flags, index, n, attr,
+                          oldcount, count) && opt.verbose){
+            fprintf(stderr, "%s: can't write a copy of %s to %s:%s\n",
+                    __func__, path, replicas[i]->host, replicas[i]->port);
+        }
+        handle_release(replicas[i], rhandle->index);
+    }
+}
+
+/*
+ * Delete a file from the server of handle, its chunks too when attr says
+ * it has some. Returns -1 when neither the value nor the record was there.
+ */
+static int memcachefs_remove(handle_t *handle, const char *path,
+                             const attr_t *attr)
+{
+    char ikey[META_INODE_KEY_MAX];
+    const char *key = meta_data_key(path + 1, attr, ikey);
+    char mkey[MEMCACHEFS_KEY_MAX + 1];
+    int mkeylen;
+    conn_req_t reqs[2];
+    size_t n = 1;
+
+    if(attr && attr->chunk){
+        chunk_delete(handle, key, 1, memcachefs_nchunks(attr));
+    }
+    memset(reqs, 0, sizeof(reqs));
+    reqs[0].op = CONN_DELETE;
+    reqs[0].key = key;
+    reqs[0].keylen = strlen(key);
+    mkeylen = meta_key(path + 1, mkey, sizeof(mkey));
+    if(mkeylen >= 0){
+        reqs[1].op = CONN_DELETE;
+        reqs[1].key = mkey;
+        reqs[1].keylen = mkeylen;
+        n = 2;
+    }
+    conn_exec(handle->conn, reqs, n);
+    if(reqs[0].status != CONN_OK &&
+       (n == 1 || reqs[1].status != CONN_OK)){
+        return -1;
+    }
+    return 0;
+}
+
+static void memcachefs_remove_replicas(handle_t *handle, const char *path,
+                                       const attr_t *attr)
+{
+    handle_pool_t *replicas[MEMCACHEFS_REPLICA_MAX];
+    unsigned int nreplicas;
+    unsigned int i;
+    handle_t *rhandle;
+
+    nreplicas = memcachefs_replicas(path, replicas);
+    for(i=0; i<nreplicas; i++){
+        if(replicas[i] == handle->pool){
+            continue;
+        }
+        rhandle = handle_get(replicas[i]);
+        if(!rhandle){
+            continue;
+        }
+        memcachefs_remove(rhandle, path, attr);
+        handle_release(replicas[i], rhandle->index);
+    }
+}
+
+typedef struct{
+    unsigned int servers[MEMCACHEFS_REPLICA_MAX];
+    unsigned int nservers;
+    int done;           // fetched, or packing tried when storing
+    char *packed;
+    size_t packed_len;
+    unsigned int flags;
+}memcachefs_block_t;
+
+/*
+ * Find the servers of each block of a list. Blocks go to the servers
+ * picked for their own key, so that files kept by different servers
+ * share them too.
+ */
+static memcachefs_block_t *memcachefs_blocks(const dedup_list_t *list)
+{
+    memcachefs_block_t *blocks;
+    size_t i;
+
+    blocks = (memcachefs_block_t*)calloc(list->count?list->count:1,
+                                         sizeof(memcachefs_block_t));
+    if(!blocks){
+        return NULL;
+    }
+    for(i=0; i<list->count; i++){
+        blocks[i].nservers = ring_lookup_n(ring, list->blocks[i].key,
+                                           blocks[i].servers, opt.replicas);
+    }
+    return blocks;
+}
+
+static void memcachefs_blocks_free(memcachefs_block_t *blocks, size_t n)
+{
+    size_t i;
+
+    for(i=0; i<n; i++){
+        free(blocks[i].packed);
+    }
+    free(blocks);
+}
+
+/*
+ * Store the blocks of len bytes of buf that their servers do not have
+ * yet, and make the value listing them. The servers are first asked
+ * which blocks they have, without their bytes. Copies of blocks past
+ * the first are best effort. The handle held by the caller is used for
+ * its own server.
+ */
+static int memcachefs_blocks_store(handle_t *held, const char *buf,
+                                   size_t len, char **val, size_t *vallen)
+{
+    dedup_list_t list;
+    dedup_block_t *block;
+    memcachefs_block_t *blocks;
+    conn_req_t *reqs;
+    size_t *which;
+    unsigned int s;
+    unsigned int r;
+    handle_t *handle;
+    size_t n;
+    size_t m;
+    size_t i;
+    int ret = 0;
+
+    if(dedup_split(buf, len, &list)){
+        return -ENOMEM;
+    }
+    blocks = memcachefs_blocks(&list);
+    reqs = (conn_req_t*)malloc(sizeof(conn_req_t) *
+                               (list.count?list.count:1));
+    which = (size_t*)malloc(sizeof(size_t) * (list.count?list.count:1));
+    if(!blocks || !reqs || !which){
+        ret = -ENOMEM;
+    }
+    for(s=0; s<opt.nservers && !ret; s++){
+        n = 0;
+        for(i=0; i<list.count; i++){
+            for(r=0; r<blocks[i].nservers; r++){
+                if(blocks[i].servers[r] == s){
+                    break;
+                }
+            }
+            if(r == blocks[i].nservers){
+                continue;
+            }
+            memset(&reqs[n], 0, sizeof(conn_req_t));
+            reqs[n].op = CONN_STAT;
+            reqs[n].key = list.blocks[i].key;
+            reqs[n].keylen = strlen(list.blocks[i].key);
+            which[n++] = i;
+        }
+        if(!n){
+            continue;
+        }
+        handle = (pools[s] == held->pool)?held:handle_get(pools[s]);
+        if(!handle){
+            for(i=0; i<n; i++){
+                if(blocks[which[i]].servers[0] == s){
+                    ret = -EIO;
+                }
+            }
+            continue;
+        }
+        conn_exec(handle->conn, reqs, n);
+        m = 0;
+        for(i=0; i<n; i++){
+            if(reqs[i].status == CONN_OK){
+                continue;
+            }
+            block = &list.blocks[which[i]];
+            if(!blocks[which[i]].done){
+                blocks[which[i]].packed = pack_value(packer, buf + block->off,
+                                         block->len,
+                                         &blocks[which[i]].packed_len,
+                                         &blocks[which[i]].flags);
+                blocks[which[i]].done = 1;
+            }
+            memset(&reqs[m], 0, sizeof(conn_req_t));
+            reqs[m].op = CONN_SET;
+            reqs[m].key = block->key;
+            reqs[m].keylen = strlen(block->key);
+            if(blocks[which[i]].packed){
+                reqs[m].val = blocks[which[i]].packed;
+                reqs[m].len = blocks[which[i]].packed_len;
+            }else{
+                reqs[m].val = buf + block->off;
+                reqs[m].len = block->len;
+            }
+            reqs[m].flags = blocks[which[i]].flags;
+            which[m++] = which[i];
+        }
+        if(m){
+            conn_exec(handle->conn, reqs, m);
+        }
+        if(handle != held){
+            handle_release(pools[s], handle->index);
+        }
+        for(i=0; i<m; i++){
+            if(reqs[i].status != CONN_OK && blocks[which[i]].servers[0] == s){
+                ret = -EIO;
+            }
+        }
+    }
+    if(!ret){
+        *val = dedup_encode(&list, vallen);
+        if(!*val){
+            ret = -ENOMEM;
+        }
+    }
+    free(which);
+    free(reqs);
+    if(blocks){
+        memcachefs_blocks_free(blocks, list.count);
+    }
+    dedup_list_free(&list);
+    return ret;
+}
+
+/*
+ * Put the blocks listed in a value back together. A block missing from
+ * its first server is looked for on the next ones.
+ */
+static int memcachefs_blocks_fetch(handle_t *held, const char *val,
+                                   size_t vallen, char **out, size_t *len)
+{
+    dedup_list_t list;
+    dedup_block_t *block;
+    memcachefs_block_t *blocks;
+    conn_req_t *reqs;
+    size_t *which;
+    char *buf;
+    char *unpacked;
+    size_t unpacked_len;
+    unsigned int s;
+    unsigned int r;
+    handle_t *handle;
+    size_t n;
+    size_t i;
+    size_t got = 0;
+    int ret = 0;
+
+    if(dedup_decode(val, vallen, &list)){
+        return -EIO;
+    }
+    blocks = memcachefs_blocks(&list);
+    reqs = (conn_req_t*)malloc(sizeof(conn_req_t) *
+                               (list.count?list.count:1));
+    which = (size_t*)malloc(sizeof(size_t) * (list.count?list.count:1));
+    buf = (char*)malloc(list.size?list.size:1);
+    if(!blocks || !reqs || !which || !buf){
+        ret = -ENOMEM;
+    }
+    for(r=0; r<opt.replicas && !ret && got < list.count; r++){
+        for(s=0; s<opt.nservers; s++){
+            n = 0;
+            for(i=0; i<list.count; i++){
+                if(blocks[i].done || r >= blocks[i].nservers ||
+                   blocks[i].servers[r] != s){
+                    continue;
+                }
+                memset(&reqs[n], 0, sizeof(conn_req_t));
+                reqs[n].op = CONN_GET;
+                reqs[n].key = list.blocks[i].key;
+                reqs[n].keylen = strlen(list.blocks[i].key);
+                reqs[n].buf = buf + list.blocks[i].off;
+                reqs[n].bufsize = list.blocks[i].len;
+                which[n++] = i;
+            }
+            if(!n){
+                continue;
+            }
+            handle = (pools[s] == held->pool)?held:handle_get(pools[s]);
+            if(!handle){
+                continue;
+            }
+            conn_exec(handle->conn, reqs, n);
+            if(handle != held){
+                handle_release(pools[s], handle->index);
+            }
+            for(i=0; i<n; i++){
+                if(reqs[i].status != CONN_OK){
+                    continue;
+                }
+                block = &list.blocks[which[i]];
+                if(reqs[i].data != reqs[i].buf){
+                    free(reqs[i].data);
+                    continue;
+                }
+                if(reqs[i].flags & PACK_FLAGS){
+                    unpacked = pack_unpack(packer, reqs[i].data,
+                                           reqs[i].bytes, reqs[i].flags,
+                                           &unpacked_len);
+                    if(!unpacked || unpacked_len != block->len){
+                        free(unpacked);
+                        continue;
+                    }
+                    memcpy(buf + block->off, unpacked, block->len);
+                    free(unpacked);
+                }else if(reqs[i].bytes != block->len){
+                    continue;
+                }
+                blocks[which[i]].done = 1;
+                got++;
+            }
+        }
+    }
+    if(!ret && got < list.count){
+        ret = -EIO;
+    }
+    if(ret){
+        free(buf);
+    }else{
+        *out = buf;
+        *len = list.size;
+    }
+    free(which);
+    free(reqs);
+    if(blocks){
+        memcachefs_blocks_free(blocks, list.count);
+    }
+    dedup_list_free(&list);
+    return ret;
+}
+
+/*
+ * Store a value along with its metadata record. Values larger than
+ * opt.chunk_size are split into chunks; when loaded is given, only the
+ * chunks it flags dirty (and the ones past nloaded) are written, the
+ * others being unchanged on the server. Single values are packed when
+ * that pays. With dedup on, the value is the list of the blocks of buf,
+ * stored first. attr holds the previous layout on entry and gets the new
+ * size, mtime, generation and chunk size.
+ */
+static int memcachefs_store(handle_t *handle, const char *path,
+                            const char *buf, size_t len,
+                            const char *loaded, size_t nloaded, attr_t *attr)
+{
+    int ret;
+    size_t chunk;
+    size_t oldcount;
+    size_t count;
+    size_t *index;
+    size_t n = 0;
+    size_t i;
+    char *packed = NULL;
+    size_t packed_len;
+    unsigned int flags = 0;
+    char *list = NULL;
+    size_t listlen;
+
+    if(vals){
+        val_cache_invalidate(vals, path);
+    }
+    if(opt.dedup){
+        chunk = 0;
+    }else if(attr->chunk && len > attr->chunk){
+        chunk = attr->chunk;
+    }else if(len > opt.chunk_size){
+        chunk = opt.chunk_size;
+    }else{
+        chunk = 0;
+    }
+    // going back to a single value needs the head of the file, and a
+    // list of blocks all of it
+    for(i=0; !chunk && loaded && i<(opt.dedup?nloaded:1); i++){
+        if(!loaded[i]){
+            return -EIO;
+        }
+    }
+    oldcount = attr->chunk?memcachefs_nchunks(attr):1;
+    count = chunk?(len + chunk - 1) / chunk:1;
+
+    index = (size_t*)malloc(sizeof(size_t) * count);
+    if(!index){
+        return -ENOMEM;
+    }
+    for(i=0; i<count; i++){
+        if(!chunk || !loaded || i >= nloaded ||
+           loaded[i] == FILE_CHUNK_DIRTY){
+            index[n++] = i;
+        }
+    }
+    if(opt.dedup){
+        ret = memcachefs_blocks_store(handle, buf, len, &list, &listlen);
+        if(ret){
+            free(index);
+            attr_cache_invalidate(attrs, path);
+            return ret;
+        }
+    }
+    attr->size = len;
+    attr->mtime = time(NULL);
+    attr->gen++;
+    attr->chunk = chunk;
+    if(list){
+        buf = list;
+        len = listlen;
+        flags = DEDUP_FLAG;
+    }else if(!chunk){
+        packed = pack_value(packer, buf, len, &packed_len, &flags);
+    }
+    if(packed){
+        buf = packed;
+        len = packed_len;
+    }
+    ret = memcachefs_put(handle, path, buf, len, flags, index, n, attr,
+                         oldcount, count);
+    if(!ret && opt.replicas > 1){
+        memcachefs_put_replicas(handle, path, buf, len, flags, index, n,
+                                attr, oldcount, count);
+    }
+    free(packed);
+    free(list);
+    free(index);
+    if(ret){
+        attr_cache_invalidate(attrs, path);
+        return -EIO;
+    }
+    attr_cache_set(attrs, path, attr);
+    // files under an inode are in the index item of the top directory
+    if(!attr->ino){
+        dirindex_add(dirs, path + 1);
+    }
+    return 0;
+}
+
+/*
+ * Add len bytes at the end of path, without sending the bytes already
+ * there. attr holds the stored layout on entry and gets the new one.
+ *
+ * A copy is only appended to when its record is the one the first copy
+ * had, since the bytes would land at the wrong place in a copy that
+ * missed a write. Other copies lose their record, and read as missing.
+ */
+static int memcachefs_append(handle_t *handle, const char *path,
+                             const char *buf, size_t len, attr_t *attr)
+{
+    handle_pool_t *replicas[MEMCACHEFS_REPLICA_MAX];
+    unsigned int nreplicas;
+    unsigned int i;
+    handle_t *rhandle;
+    char ikey[META_INODE_KEY_MAX];
+    const char *key = meta_data_key(path + 1, attr, ikey);
+    size_t size = attr->size;
+    attr_t old = *attr;
+    attr_t rattr;
+
+    if(vals){
+        val_cache_invalidate(vals, path);
+    }
+    if(!attr->chunk && size + len > opt.chunk_size){
+        attr->chunk = opt.chunk_size;
+    }
+    attr->size += len;
+    attr->mtime = time(NULL);
+    attr->gen++;
+    if(chunk_append(handle, key, buf, len, size, attr->chunk) ||
+       meta_store(handle->conn, path + 1, attr, 1)){
+        attr_cache_invalidate(attrs, path);
+        return -EIO;
+    }
+    if(opt.replicas > 1){
+        nreplicas = memcachefs_replicas(path, replicas);
+        for(i=0; i<nreplicas; i++){
+            if(replicas[i] == handle->pool){
+                continue;
+            }
+            rhandle = handle_get(replicas[i]);
+            if(!rhandle){
+                continue;
+            }
+            if(meta_fetch(rhandle->conn, path + 1, &rattr) ||
+               rattr.gen != old.gen || rattr.size != old.size ||
+               rattr.chunk != old.chunk || rattr.ino != old.ino ||
+               chunk_append(rhandle, key, buf, len, size, attr->chunk) ||
+               meta_store(rhandle->conn, path + 1, attr, 1)){
+                meta_delete(rhandle->conn, path + 1);
+                if(opt.verbose){
+                    fprintf(stderr, "%s: dropped the copy of %s on %s:%s\n",
+                            __func__, path, replicas[i]->host,
+                            replicas[i]->port);
+                }
+            }
+            handle_release(replicas[i], rhandle->index);
+        }
+    }
+    attr_cache_set(attrs, path, attr);
+    return 0;
+}
+
+/*
+ * Write a batch of queued files, pipelined per server. Entries get an
+ * error when their first copy could not be written; the other copies
+ * are best effort, as with memcachefs_put_replicas.
+ */
+static void memcachefs_writeback(writeback_entry_t **entries, size_t n)
+{
+    handle_pool_t *replicas[MEMCACHEFS_REPLICA_MAX];
+    char mkeys[WRITEBACK_BATCH][MEMCACHEFS_KEY_MAX + 1];
+    char ikeys[WRITEBACK_BATCH][META_INODE_KEY_MAX];
+    const char *keys[WRITEBACK_BATCH];
+    char *packed[WRITEBACK_BATCH];
+    size_t packed_lens[WRITEBACK_BATCH];
+    unsigned int flags[WRITEBACK_BATCH];
+    char records[WRITEBACK_BATCH][META_RECORD_MAX];
+    int mkeylens[WRITEBACK_BATCH];
+    int reclens[WRITEBACK_BATCH];
+    writeback_entry_t *batch[WRITEBACK_BATCH];
+    int primary[WRITEBACK_BATCH];
+    conn_req_t reqs[WRITEBACK_BATCH * 2];
+    unsigned int nreplicas;
+    unsigned int s;
+    unsigned int r;
+    handle_t *handle;
+    size_t count;
+    size_t i;
+    size_t j;
+
+    for(i=0; i<n; i++){
+        entries[i]->error = 0;
+        keys[i] = meta_data_key(entries[i]->path + 1, &entries[i]->attr,
+                                ikeys[i]);
+        mkeylens[i] = meta_key(entries[i]->path + 1, mkeys[i],
+                               sizeof(mkeys[i]));
+        reclens[i] = meta_encode(&entries[i]->attr, records[i],
+                                 sizeof(records[i]));
+        if(mkeylens[i] < 0 || reclens[i] < 0){
+            entries[i]->error = 1;
+        }
+        packed[i] = pack_value(packer, entries[i]->buf, entries[i]->len,
+                               &packed_lens[i], &flags[i]);
+    }
+    for(s=0; s<opt.nservers; s++){
+        count = 0;
+        memset(reqs, 0, sizeof(reqs));
+        for(i=0; i<n; i++){
+            if(entries[i]->error){
+                continue;
+            }
+            nreplicas = memcachefs_replicas(entries[i]->path, replicas);
+            r = 0;
+            while(r < nreplicas && replicas[r] != pools[s]){
+                r++;
+            }
+            if(r == nreplicas){
+                continue;
+            }
+            j = count * 2;
+            reqs[j].op = CONN_SET;
+            reqs[j].key = keys[i];
+            reqs[j].keylen = strlen(reqs[j].key);
+            if(packed[i]){
+                reqs[j].val = packed[i];
+                reqs[j].len = packed_lens[i];
+            }else{
+                reqs[j].val = entries[i]->buf;
+                reqs[j].len = entries[i]->len;
+            }
+            reqs[j].flags = flags[i];
+            reqs[j + 1].op = CONN_SET;
+            reqs[j + 1].key = mkeys[i];
+            reqs[j + 1].keylen = mkeylens[i];
+            reqs[j + 1].val = records[i];
+            reqs[j + 1].len = reclens[i];
+            batch[count] = entries[i];
+            primary[count] = (r == 0);
+            count++;
+        }
+        if(!count){
+            continue;
+        }
+        handle = handle_get(pools[s]);
+        if(handle){
+            conn_exec(handle->conn, reqs, count * 2);
+            handle_release(pools[s], handle->index);
+        }
+        for(i=0; i<count; i++){
+            if(primary[i] && (!handle || reqs[i * 2].status != CONN_OK ||
+                              reqs[i * 2 + 1].status != CONN_OK)){
+                batch[i]->error = 1;
+            }
+        }
+    }
+    for(i=0; i<n; i++){
+        free(packed[i]);
+        if(entries[i]->error){
+            attr_cache_invalidate(attrs, entries[i]->path);
+            if(opt.verbose){
+                fprintf(stderr, "%s: can't write %s\n", __func__,
+                        entries[i]->path);
+            }
+        }else if(!entries[i]->attr.ino){
+            dirindex_add(dirs, entries[i]->path + 1);
+        }
+    }
+}
+
+/*
+ * Make room for size bytes in the file buffer, which must be done before
+ * writing to it: a buffer shared with the value cache is copied first.
+ */
+static int memcachefs_reserve(file_t *file, size_t size)
+{
+    char *buf;
+    size_t buf_size;
+
+    if(file->shared){
+        buf = buf_alloc(bufs, (size > file->buf_len)?size:file->buf_len,
+                        &buf_size);
+        if(!buf){
+            return -1;
+        }
+        memcpy(buf, file->buf, file->buf_len);
+        buf_ref_put(bufs, file->shared);
+        file->shared = NULL;
+        file->buf = buf;
+        file->buf_size = buf_size;
+        return 0;
+    }
+    if(size <= file->buf_size){
+        return 0;
+    }
+    buf = buf_grow(bufs, file->buf, file->buf_len, file->buf_size, size,
+                   &buf_size);
+    if(!buf){
+        return -1;
+    }
+    file->buf = buf;
+    file->buf_size = buf_size;
+    return 0;
+}
+
+/*
+ * Make sure the chunks covering [offset, offset + size) are in the file
+ * buffer. When one is missing, the `ahead' following chunks are fetched
+ * along with it. Called with file->lock held.
+ */
+static int memcachefs_load(file_t *file, const char *path, off_t offset,
+                           size_t size, unsigned int ahead)
+{
+    int ret;
+    handle_pool_t *pool;
+    handle_t *handle;
+    char ikey[META_INODE_KEY_MAX];
+    size_t chunk = file->attr.chunk;
+    size_t first;
+    size_t last;
+    size_t *index;
+    size_t count = 0;
+    size_t i;
+
+    if(!file->loaded || !size){
+        return 0;
+    }
+    first = offset / chunk;
+    last = (offset + size + chunk - 1) / chunk;
+    if(last > file->nchunks){
+        last = file->nchunks;
+    }
+    for(i=first; i<last; i++){
+        if(!file->loaded[i]){
+            break;
+        }
+    }
+    if(i >= last){
+        return 0;
+    }
+    last += ahead;
+    if(last > file->nchunks){
+        last = file->nchunks;
+    }
+
+    index = (size_t*)malloc(sizeof(size_t) * (last - first));
+    if(!index){
+        return -ENOMEM;
+    }
+    for(i=first; i<last; i++){
+        if(!file->loaded[i]){
+            index[count++] = i;
+        }
+    }
+    pool = memcachefs_pool(path);
+    handle = handle_get(pool);
+    if(!handle){
+        free(index);
+        return -EMFILE;
+    }
+    ret = chunk_fetch(pool, handle, meta_data_key(path + 1, &file->attr, ikey),
+                      file->buf, file->attr.size, chunk, index, count,
+                      opt.chunk_threads);
+    handle_release(pool, handle->index);
+    if(!ret){
+        for(i=0; i<count; i++){
+            file->loaded[index[i]] = FILE_CHUNK_LOADED;
+        }
+    }
+    free(index);
+
+    return ret?-EIO:0;
+}
+
+/*
+ * Track the chunk layout of file->attr after the file was stored.
+ * Chunks appended by writes are in the buffer, dirty chunks are clean
+ * now and the others keep their state.
+ */
+static void memcachefs_layout(file_t *file)
+{
+    char *loaded;
+    size_t nchunks;
+    size_t i;
+
+    if(!file->attr.chunk){
+        free(file->loaded);
+        file->loaded = NULL;
+        file->nchunks = 1;
+        return;
+    }
+    nchunks = memcachefs_nchunks(&file->attr);
+    loaded = (char*)realloc(file->loaded, nchunks);
+    if(!loaded){
+        return;
+    }
+    if(!file->loaded){
+        memset(loaded, FILE_CHUNK_LOADED, nchunks);
+    }else{
+        for(i=0; i<nchunks && i<file->nchunks; i++){
+            if(loaded[i] == FILE_CHUNK_DIRTY){
+                loaded[i] = FILE_CHUNK_LOADED;
+            }
+        }
+        if(nchunks > file->nchunks){
+            memset(loaded + file->nchunks, FILE_CHUNK_LOADED,
+                   nchunks - file->nchunks);
+        }
+    }
+    file->loaded = loaded;
+    file->nchunks = nchunks;
+}
+
+/*
+ * Store an open file if it was written to since it was opened or last
+ * stored. Files only read are left alone, so closing them costs nothing.
+ * With write-back on, single values are queued instead and stored later.
+ * Called with file->lock held.
+ */
+static int memcachefs_flush_file(file_t *file, const char *path)
+{
+    int ret;
+    handle_pool_t *pool;
+    handle_t *handle;
+
+    if(!file->dirty){
+        return 0;
+    }
+    // single values go through the write-back queue when it is on
+    if(wback && !opt.dedup && !file->append && !file->attr.chunk &&
+       file->buf_len <= opt.chunk_size){
+        if(vals){
+            val_cache_invalidate(vals, path);
+        }
+        file->attr.size = file->buf_len;
+        file->attr.mtime = time(NULL);
+        file->attr.gen++;
+        ret = writeback_add(wback, path, file->buf, file->buf_len,
+                            &file->attr);
+        if(!ret){
+            attr_cache_set(attrs, path, &file->attr);
+            file->dirty = 0;
+        }
+        return ret;
+    }
+    if(wback){
+        writeback_forget(wback, path);
+    }
+    pool = memcachefs_pool(path);
+    handle = handle_get(pool);
+    if(!handle){
+        return -EMFILE;
+    }
+    if(file->append){
+        ret = memcachefs_append(handle, path, file->buf, file->buf_len,
+                                &file->attr);
+        if(!ret){
+            file->buf_len = 0;
+        }
+    }else{
+        // the blocks are cut over the whole file
+        if(opt.dedup && file->loaded){
+            ret = memcachefs_load(file, path, 0, file->buf_len, 0);
+            if(ret){
+                handle_release(pool, handle->index);
+                return ret;
+            }
+        }
+        ret = memcachefs_store(handle, path, file->buf, file->buf_len,
+                               file->loaded, file->nchunks, &file->attr);
+        if(!ret){
+            memcachefs_layout(file);
+        }
+    }
+    if(!ret){
+        file->dirty = 0;
+    }
+    handle_release(pool, handle->index);
+
+    return ret;
+}
+
+static int memcachefs_store_file(file_t *file, const char *path)
+{
+    int ret;
+
+    pthread_mutex_lock(&file->lock);
+    ret = memcachefs_flush_file(file, path);
+    pthread_mutex_unlock(&file->lock);
+
+    return ret;
+}
+
+static int memcachefs_lookup_fn(handle_t *handle, const char *path,
+                               void *out)
+{
+    return memcachefs_lookup(handle, path, (attr_t*)out);
+}
+
+static int memcachefs_getattr(const char *path, struct stat *stbuf)
+{
+    int ret;
+    attr_t attr;
+
+    if(opt.verbose){
+        fprintf(stderr, "%s(\"%s\")\n", __func__, path);
+    }
+    memset(stbuf, 0, sizeof(struct stat));
+
+    if(!strcmp(path, "/")){
+        stbuf->st_ino = 1;
+        stbuf->st_mode = S_IFDIR | 0755;
+        stbuf->st_uid = fuse_get_context()->uid;
+        stbuf->st_gid = fuse_get_context()->gid;
+        stbuf->st_nlink = 1;
+        stbuf->st_atime = 0;
+        stbuf->st_mtime = 0;
+        stbuf->st_size = 0;
+        return 0;
+    }
+    // read with direct I/O, whatever the size
+    if(!strcmp(path, STATS_DIR) || !strcmp(path, STATS_PATH) ||
+       (tracer && !strcmp(path, TRACE_PATH))){
+        stbuf->st_mode = strcmp(path, STATS_DIR)?S_IFREG | 0444:S_IFDIR | 0555;
+        stbuf->st_nlink = 1;
+        stbuf->st_uid = fuse_get_context()->uid;
+        stbuf->st_gid = fuse_get_context()->gid;
+        return 0;
+    }
+
+    if(!attr_cache_get(attrs, path, &attr)){
+        if(wback){
+            writeback_wait(wback, path);
+        }
+        ret = memcachefs_hedged(path, memcachefs_lookup_fn, &attr,
+                                sizeof(attr_t), NULL);
+        if(ret){
+            return ret;
+        }
+    }
+    if(S_ISDIR(attr.mode)){
+        stbuf->st_mode = attr.mode;
+        stbuf->st_nlink = 2;
+    }else{
+        stbuf->st_mode = S_IFREG | (attr.mode ? attr.mode : 0666);
+        stbuf->st_nlink = 1;
+    }
+    stbuf->st_uid = fuse_get_context()->uid;
+    stbuf->st_gid = fuse_get_context()->gid;
+    stbuf->st_size = attr.size;
+    stbuf->st_mtime = attr.mtime;
+    return 0;
+}
+
+/*
+ * An open directory lists the entries of its index item first. The top
+ * one then lists a snapshot of the index of the keys once it is loaded,
+ * and streams the keys from the servers otherwise, one after the other.
+ */
+typedef struct{
+    char path[MEMCACHEFS_KEY_MAX + 2];
+    dir_list_t *list;
+    dirindex_snap_t *snap;
+    dirstream_t **ds;
+    unsigned int cur;
+    off_t pos;
+    char paths[MEMCACHEFS_PREFETCH][MEMCACHEFS_KEY_MAX + 2];
+    unsigned int npaths;
+}memcachefs_dir_t;
+
+static void memcachefs_dir_free(memcachefs_dir_t *dir)
+{
+    unsigned int i;
+
+    dir_list_free(dir->list);
+    if(dir->snap){
+        dirindex_snap_release(dir->snap);
+    }
+    if(dir->ds){
+        for(i=0; i<opt.nservers; i++){
+            if(dir->ds[i]){
+                dirstream_free(dir->ds[i]);
+            }
+        }
+        free(dir->ds);
+    }
+    free(dir);
+}
+
+static int memcachefs_opendir(const char *path, struct fuse_file_info *fi)
+{
+    int ret;
+    unsigned int i;
+    handle_pool_t *pool;
+    handle_t *handle;
+    memcachefs_dir_t *dir;
+
+    if(opt.verbose){
+        fprintf(stderr, "%s(\"%s\")\n", __func__, path);
+    }
+    if(strlen(path) > MEMCACHEFS_KEY_MAX){
+        return -ENOENT;
+    }
+    if(!strcmp(path, STATS_DIR)){
+        return -EACCES;
+    }
+    dir = (memcachefs_dir_t*)malloc(sizeof(memcachefs_dir_t));
+    if(!dir){
+        return -ENOMEM;
+    }
+    memset(dir, 0, sizeof(memcachefs_dir_t));
+    strcpy(dir->path, path);
+    pool = memcachefs_pool(path);
+    handle = handle_get(pool);
+    if(!handle){
+        memcachefs_dir_free(dir);
+        return -EMFILE;
+    }
+    ret = dir_list(handle->conn, path, &dir->list);
+    handle_release(pool, handle->index);
+    if(ret){
+        memcachefs_dir_free(dir);
+        return ret;
+    }
+    if(strcmp(path, "/")){
+        fi->fh = (uintptr_t)dir;
+        return 0;
+    }
+    dir->snap = dirindex_snapshot(dirs);
+    if(!dir->snap){
+        dir->ds = (dirstream_t**)calloc(opt.nservers, sizeof(dirstream_t*));
+        if(!dir->ds){
+            memcachefs_dir_free(dir);
+            return -ENOMEM;
+        }
+        for(i=0; i<opt.nservers; i++){
+            dir->ds[i] = dirstream_new(pools[i]);
+            if(!dir->ds[i]){
+                memcachefs_dir_free(dir);
+                return -ENOMEM;
+            }
+        }
+    }
+    fi->fh = (uintptr_t)dir;
+    return 0;
+}
+
+/*
+ * Fetch the attributes of the entries just listed into the attribute
+ * cache, so that the getattr calls following a listing (ls -l, find) are
+ * answered locally. The records and the sizes of the values are asked for
+ * in one round-trip per server. Nothing is stored from here: keys without
+ * a record get theirs on their next lookup. The listing streams over
+ * connections of its own, so a handle of the pool is waited for like
+ * anywhere else; a server whose pool stays exhausted is skipped.
+ */
+static void memcachefs_prefetch(memcachefs_dir_t *dir)
+{
+    unsigned int servers[MEMCACHEFS_PREFETCH];
+    char mkeys[MEMCACHEFS_PREFETCH][MEMCACHEFS_KEY_MAX + 1];
+    char records[MEMCACHEFS_PREFETCH][META_RECORD_MAX];
+    conn_req_t reqs[MEMCACHEFS_PREFETCH * 2];
+    size_t first[MEMCACHEFS_PREFETCH];
+    size_t count[MEMCACHEFS_PREFETCH];
+    unsigned int server;
+    unsigned int i;
+    size_t n;
+    int ret;
+    handle_t *handle;
+    attr_t attr;
+
+    for(i=0; i<dir->npaths; i++){
+        servers[i] = ring_lookup(ring, dir->paths[i] + 1);
+    }
+    for(server=0; server<opt.nservers; server++){
+        n = 0;
+        for(i=0; i<dir->npaths; i++){
+            if(servers[i] != server){
+                continue;
+            }
+            first[i] = n;
+            count[i] = memcachefs_probe(dir->paths[i] + 1, mkeys[i],
+                                        records[i], reqs + n);
+            n += count[i];
+        }
+        if(!n){
+            continue;
+        }
+        handle = handle_get(pools[server]);
+        if(!handle){
+            continue;
+        }
+        conn_exec(handle->conn, reqs, n);
+        handle_release(pools[server], handle->index);
+        for(i=0; i<dir->npaths; i++){
+            if(servers[i] != server){
+                continue;
+            }
+            // the size is in the value when packed or a list, left to
+            // getattr
+            ret = memcachefs_probed(reqs + first[i], count[i], records[i],
+                                    &attr);
+            if(ret < 0 || ret == 2){
+                continue;
+            }
+            // written meanwhile, the record fetched may be the old one
+            if(wback && writeback_pending(wback, dir->paths[i])){
+                continue;
+            }
+            attr_cache_set(attrs, dir->paths[i], &attr);
+        }
+    }
+    dir->npaths = 0;
+}
+
+/*
+ * Queue a listed entry for memcachefs_prefetch(), unless its attributes
+ * are cached already.
+ */
+static void memcachefs_listed(memcachefs_dir_t *dir, const char *name)
+{
+    char path[MEMCACHEFS_KEY_MAX + 2];
+    const char *sep = strcmp(dir->path, "/")?"/":"";
+    attr_t attr;
+
+    if(strlen(dir->path) + strlen(sep) + strlen(name) > MEMCACHEFS_KEY_MAX){
+        return;
+    }
+    sprintf(path, "%s%s%s", dir->path, sep, name);
+    if(attr_cache_peek(attrs, path, &attr) ||
+       (wback && writeback_pending(wback, path))){
+        return;
+    }
+    strcpy(dir->paths[dir->npaths], path);
+    if(++dir->npaths == MEMCACHEFS_PREFETCH){
+        memcachefs_prefetch(dir);
+    }
+}
+
+/*
+ * Name and type of the entry at pos when it comes before the keys listed
+ * from the servers: "." and "..", then the ones of the index item. NULL
+ * past them, the keys being files.
+ */
+static const char *memcachefs_dir_entry(memcachefs_dir_t *dir, off_t pos,
+                                        struct stat *st)
+{
+    memset(st, 0, sizeof(struct stat));
+    if(pos < 2){
+        st->st_mode = S_IFDIR;
+        return pos?"..":".";
+    }
+    if(pos - 2 < dir->list->count){
+        st->st_mode = (dir->list->types[pos - 2] == DIR_DIR)?S_IFDIR:S_IFREG;
+        return dir->list->names[pos - 2];
+    }
+    st->st_mode = S_IFREG;
+    return NULL;
+}
+
+static off_t memcachefs_dir_indexed(memcachefs_dir_t *dir)
+{
+    return dir->list->count + 2;
+}
+
+/*
+ * Entries are numbered from 1 on, "." and ".." and the indexed ones
+ * first, so that the kernel can come back for the rest of a large
+ * listing. Reading on from where the last call stopped continues the
+ * stream, any other offset restarts it and skips the entries before.
+ */
+static int memcachefs_readdir_stream(memcachefs_dir_t *dir, void *buf,
+                                     fuse_fill_dir_t filler, off_t offset)
+{
+    int ret;
+    unsigned int i;
+    const char *name;
+    ssize_t size;
+    struct stat st;
+
+    if(offset != dir->pos){
+        for(i=0; i<opt.nservers; i++){
+            dirstream_rewind(dir->ds[i]);
+        }
+        dir->cur = 0;
+        dir->pos = 0;
+    }
+    for(;;){
+        size = -1;
+        name = memcachefs_dir_entry(dir, dir->pos, &st);
+        if(!name){
+            if(dir->cur >= opt.nservers){
+                return 0;
+            }
+            ret = dirstream_next(dir->ds[dir->cur], &name, &size);
+            if(ret < 0){
+                return ret;
+            }
+            if(!ret){
+                dir->cur++;
+                continue;
+            }
+            // reserved, or in a directory
+            if(memcachefs_is_reserved(name) || strchr(name, '/')){
+                continue;
+            }
+        }
+        if(dir->pos >= offset){
+            if(filler(buf, name, &st, dir->pos + 1)){
+                if(dir->pos >= memcachefs_dir_indexed(dir)){
+                    dirstream_unget(dir->ds[dir->cur]);
+                }
+                return 0;
+            }
+            if(dir->pos > 1){
+                memcachefs_listed(dir, name);
+            }
+        }
+        dir->pos++;
+    }
+}
+
+static int memcachefs_readdir(const char *path, void *buf,
+                              fuse_fill_dir_t filler, off_t offset,
+                              struct fuse_file_info *fi)
+{
+    int ret = 0;
+    memcachefs_dir_t *dir = (memcachefs_dir_t*)(uintptr_t)fi->fh;
+    dirindex_snap_t *snap = dir->snap;
+    const char *name;
+    off_t indexed;
+    struct stat st;
+
+    if(opt.verbose){
+        fprintf(stderr, "%s(\"%s\" @%lld)\n", __func__, path,
+                (long long)offset);
+    }
+
+    indexed = memcachefs_dir_indexed(dir);
+    if(dir->ds){
+        ret = memcachefs_readdir_stream(dir, buf, filler, offset);
+    }else{
+        for(; offset < indexed + (snap?(off_t)snap->count:0); offset++){
+            name = memcachefs_dir_entry(dir, offset, &st);
+            if(!name){
+                name = snap->names[offset - indexed];
+            }
+            if(filler(buf, name, &st, offset + 1)){
+                break;
+            }
+            if(offset > 1){
+                memcachefs_listed(dir, name);
+            }
+        }
+    }
+    if(dir->npaths){
+        memcachefs_prefetch(dir);
+    }
+    return ret;
+}
+
+static int memcachefs_releasedir(const char *path, struct fuse_file_info *fi)
+{
+    memcachefs_dir_t *dir = (memcachefs_dir_t*)(uintptr_t)fi->fh;
+
+    if(opt.verbose){
+        fprintf(stderr, "%s(\"%s\")\n", __func__, path);
+    }
+    memcachefs_dir_free(dir);
+    return 0;
+}
+
+/*
+ * Threads do not survive the fork into the background, so the index
+ * starts refreshing and the writers start once the filesystem is up.
+ */
+#if FUSE_USE_VERSION >= 26
+static void *memcachefs_init(struct fuse_conn_info *conn)
+#else
+static void *memcachefs_init(void)
+#endif
+{
+    if(dirindex_start(dirs)){
+        fprintf(stderr, "error: can't start the directory index\n");
+    }
+    if(wback && writeback_start(wback)){
+        fprintf(stderr, "error: can't start the write-back threads\n");
+    }
+    if(tracer && trace_start(tracer)){
+        fprintf(stderr, "error: can't start dumping the trace\n");
+    }
+    return NULL;
+}
+
+static void memcachefs_destroy(void *data)
+{
+    if(tracer){
+        trace_stop(tracer);
+    }
+    if(wback){
+        writeback_stop(wback);
+    }
+    dirindex_stop(dirs);
+}
+
+static int memcachefs_mknod(const char *path, mode_t mode, dev_t rdev)
+{
+    int ret;
+    handle_pool_t *pool;
+    handle_t *handle;
+    attr_t attr;
+
+    if(opt.verbose){
+        fprintf(stderr, "%s(\"%s\", 0%o)\n", __func__, path, mode);
+    }
+    if(!S_ISREG(mode)){
+        return -ENOSYS;
+    }
+    ret = memcachefs_check_key(path);
+    if(ret){
+        return ret;
+    }
+    memset(&attr, 0, sizeof(attr));
+    attr.mode = mode & 07777;
+    if(opt.inodes){
+        attr.ino = memcachefs_inode();
+    }
+    ret = memcachefs_index(path, &attr, 1);
+    if(ret){
+        return ret;
+    }
+
+    pool = memcachefs_pool(path);
+    handle = handle_get(pool);
+    if(!handle){
+        memcachefs_index(path, &attr, 0);
+        return -EMFILE;
+    }
+    ret = memcachefs_store(handle, path, "", 0, NULL, 0, &attr);
+    handle_release(pool, handle->index);
+    if(ret){
+        memcachefs_index(path, &attr, 0);
+    }
+
+    return ret;
+}
+
+/*
+ * A directory is a metadata record with S_IFDIR in its mode, kept on every
+ * replica for getattr, and an index item listing its entries.
+ */
+static int memcachefs_mkdir(const char *path, mode_t mode)
+{
+    int ret;
+    handle_pool_t *replicas[MEMCACHEFS_REPLICA_MAX];
+    unsigned int n;
+    unsigned int i;
+    handle_t *handle;
+    attr_t attr;
+
+    if(opt.verbose){
+        fprintf(stderr, "%s(\"%s\", 0%o)\n", __func__, path, mode);
+    }
+    ret = memcachefs_check_key(path);
+    if(ret){
+        return ret;
+    }
+    memset(&attr, 0, sizeof(attr));
+    attr.mode = S_IFDIR | (mode & 07777);
+    attr.mtime = time(NULL);
+
+    n = memcachefs_replicas(path, replicas);
+    handle = handle_get(replicas[0]);
+    if(!handle){
+        return -EMFILE;
+    }
+    if(meta_store(handle->conn, path + 1, &attr, 0)){
+        handle_release(replicas[0], handle->index);
+        return -EEXIST;
+    }
+    ret = dir_create(handle->conn, path);
+    if(ret){
+        meta_delete(handle->conn, path + 1);
+        handle_release(replicas[0], handle->index);
+        return ret;
+    }
+    handle_release(replicas[0], handle->index);
+    for(i=1; i<n; i++){
+        handle = handle_get(replicas[i]);
+        if(handle){
+            meta_store(handle->conn, path + 1, &attr, 1);
+            handle_release(replicas[i], handle->index);
+        }
+    }
+    ret = memcachefs_index(path, &attr, 1);
+    if(ret){
+        return ret;
+    }
+    attr_cache_set(attrs, path, &attr);
+    return 0;
+}
+
+static int memcachefs_rmdir(const char *path)
+{
+    int ret;
+    handle_pool_t *replicas[MEMCACHEFS_REPLICA_MAX];
+    unsigned int n;
+    unsigned int i;
+    handle_t *handle;
+    attr_t attr;
+
+    if(opt.verbose){
+        fprintf(stderr, "%s(\"%s\")\n", __func__, path);
+    }
+    n = memcachefs_replicas(path, replicas);
+    handle = handle_get(replicas[0]);
+    if(!handle){
+        return -EMFILE;
+    }
+    ret = dir_remove(handle->conn, path);
+    if(!ret){
+        meta_delete(handle->conn, path + 1);
+    }
+    handle_release(replicas[0], handle->index);
+    if(ret){
+        return ret;
+    }
+    for(i=1; i<n; i++){
+        handle = handle_get(replicas[i]);
+        if(handle){
+            meta_delete(handle->conn, path + 1);
+            handle_release(replicas[i], handle->index);
+        }
+    }
+    attr_cache_invalidate(attrs, path);
+    memset(&attr, 0, sizeof(attr));
+    attr.mode = S_IFDIR;
+    return memcachefs_index(path, &attr, 0);
+}
+
+static int memcachefs_unlink(const char *path)
+{
+    int ret;
+    handle_pool_t *pool;
+    handle_t *handle;
+    char *key;
+    attr_t attr;
+    attr_t *found = NULL;
+
+    if(opt.verbose){
+        fprintf(stderr, "%s(\"%s\")\n", __func__, path);
+    }
+    // a queued version would bring the file back
+    if(wback){
+        writeback_forget(wback, path);
+    }
+    pool = memcachefs_pool(path);
+    handle = handle_get(pool);
+    if(!handle){
+        return -EMFILE;
+    }
+    key = (char *)path + 1;
+    if(!memcachefs_lookup(handle, path, &attr)){
+        found = &attr;
+    }
+    ret = memcachefs_remove(handle, path, found);
+    if(opt.replicas > 1){
+        memcachefs_remove_replicas(handle, path, found);
+    }
+    handle_release(pool, handle->index);
+    attr_cache_invalidate(attrs, path);
+    if(vals){
+        val_cache_invalidate(vals, path);
+    }
+    dirindex_remove(dirs, key);
+    if(ret){
+        return -EIO;
+    }
+
+    return memcachefs_index(path, found, 0);
+}
+
+static int memcachefs_chmod(const char* path, mode_t mode)
+{
+    if(opt.verbose){
+        fprintf(stderr, "%s(\"%s\", 0%3o)\n", __func__, path, mode);
+    }
+    return -ENOSYS;
+}
+
+static int memcachefs_chown(const char *path, uid_t uid, gid_t gid)
+{
+    if(opt.verbose){
+        fprintf(stderr, "%s(\"%s\", %d, %d)\n", __func__, path, uid, gid);
+    }
+    return -ENOSYS;
+}
+
+static int memcachefs_truncate(const char* path, off_t length)
+{
+    int ret;
+    handle_pool_t *pool;
+    handle_t *handle;
+    attr_t attr;
+
+    if(opt.verbose){
+        fprintf(stderr, "%s(\"%s\", %lld)\n", __func__, path, length);
+    }
+    if(length != 0){
+        return -ENOSYS;
+    }
+    if(wback){
+        writeback_forget(wback, path);
+    }
+
+    pool = memcachefs_pool(path);
+    handle = handle_get(pool);
+    if(!handle){
+        return -EMFILE;
+    }
+
+    attr_cache_invalidate(attrs, path);
+    ret = memcachefs_lookup(handle, path, &attr);
+    if(!ret){
+        ret = memcachefs_store(handle, path, "", 0, NULL, 0, &attr);
+    }
+    handle_release(pool, handle->index);
+
+    return ret;
+}
+
+static int memcachefs_utime(const char *path, struct utimbuf *time)
+{
+    if(opt.verbose){
+        fprintf(stderr, "%s(\"%s\")\n", __func__, path);
+    }
+    return 0;
+}
+
+typedef struct{
+    char *val;
+    size_t bytes;
+    unsigned long long cas;
+    attr_t attr;
+}memcachefs_value_t;
+
+typedef struct{
+    unsigned long long cas;
+    unsigned int flags;
+}memcachefs_item_t;
+
+/*
+ * Turn the value got by a request, received without a buffer, into the
+ * bytes of the file when it was stored packed or as a list of blocks.
+ * Returns -1 when it can't be.
+ */
+static int memcachefs_decode(handle_t *handle, conn_req_t *req)
+{
+    char *val = NULL;
+    size_t len;
+
+    if(req->status != CONN_OK || !(req->flags & (PACK_FLAGS | DEDUP_FLAG))){
+        return 0;
+    }
+    if(req->flags & DEDUP_FLAG){
+        memcachefs_blocks_fetch(handle, req->data, req->bytes, &val, &len);
+    }else{
+        val = pack_unpack(packer, req->data, req->bytes, req->flags, &len);
+    }
+    free(req->data);
+    req->data = val;
+    if(!val){
+        req->status = CONN_ERROR;
+        return -1;
+    }
+    req->bytes = len;
+    return 0;
+}
+
+/*
+ * Fetch the value of path and its metadata record in a single round-trip.
+ * The value is left malloc'd, the attributes zeroed without a record.
+ * The key of the value is guessed from the cached attributes, and fetched
+ * again when the record says it is another one.
+ */
+static int memcachefs_fetch(handle_t *handle, const char *path, void *out)
+{
+    memcachefs_value_t *value = (memcachefs_value_t*)out;
+    const char *key;
+    char ikey[META_INODE_KEY_MAX];
+    char mkey[MEMCACHEFS_KEY_MAX + 1];
+    int mkeylen;
+    char record[META_RECORD_MAX];
+    conn_req_t reqs[2];
+    size_t n = 1;
+    attr_t hint;
+
+    if(!attr_cache_peek(attrs, path, &hint)){
+        hint.ino = 0;
+    }
+    key = meta_data_key(path + 1, &hint, ikey);
+    memset(reqs, 0, sizeof(reqs));
+    reqs[0].op = CONN_GET;
+    reqs[0].key = key;
+    reqs[0].keylen = strlen(key);
+    mkeylen = meta_key(path + 1, mkey, sizeof(mkey));
+    if(mkeylen >= 0){
+        reqs[1].op = CONN_GET;
+        reqs[1].key = mkey;
+        reqs[1].keylen = mkeylen;
+        reqs[1].buf = record;
+        reqs[1].bufsize = sizeof(record);
+        n = 2;
+    }
+    conn_exec(handle->conn, reqs, n);
+    if(n == 2 && reqs[1].data && reqs[1].data != record){
+        free(reqs[1].data);
+        reqs[1].status = CONN_ERROR;
+    }
+    if(n == 1 || reqs[1].status != CONN_OK ||
+       meta_decode(record, reqs[1].bytes, &value->attr)){
+        memset(&value->attr, 0, sizeof(attr_t));
+    }
+    if(value->attr.ino != hint.ino){
+        free(reqs[0].data);
+        key = meta_data_key(path + 1, &value->attr, ikey);
+        reqs[0].key = key;
+        reqs[0].keylen = strlen(key);
+        conn_exec(handle->conn, reqs, 1);
+    }
+    memcachefs_decode(handle, &reqs[0]);
+    if(reqs[0].status != CONN_OK){
+        free(reqs[0].data);
+        return (reqs[0].status == CONN_MISS)?-ENOENT:-EIO;
+    }
+    value->val = reqs[0].data;
+    value->bytes = reqs[0].bytes;
+    value->cas = reqs[0].cas;
+    return 0;
+}
+
+static void memcachefs_fetch_dispose(void *out)
+{
+    free(((memcachefs_value_t*)out)->val);
+}
+
+/*
+ * Get the CAS and the item flags of the value of path, without the value.
+ */
+static int memcachefs_stat(handle_t *handle, const char *path, void *out)
+{
+    memcachefs_item_t *item = (memcachefs_item_t*)out;
+    int ret;
+    conn_req_t req;
+    char ikey[META_INODE_KEY_MAX];
+    attr_t attr;
+
+    ret = memcachefs_lookup(handle, path, &attr);
+    if(ret){
+        return ret;
+    }
+    memset(&req, 0, sizeof(req));
+    req.op = CONN_STAT;
+    req.key = meta_data_key(path + 1, &attr, ikey);
+    req.keylen = strlen(req.key);
+    conn_exec(handle->conn, &req, 1);
+    if(req.status != CONN_OK){
+        return (req.status == CONN_MISS)?-ENOENT:-EIO;
+    }
+    item->cas = req.cas;
+    item->flags = req.flags;
+    return 0;
+}
+
+/*
+ * Take a value over as the buffer of an open file, no copy.
+ */
+static void memcachefs_adopt(file_t *file, char *val, size_t len)
+{
+    file->attr.chunk = 0;
+    file->attr.size = len;
+    file->nchunks = 1;
+    file->buf_len = len;
+    file->buf_size = len;
+    file->buf = buf_adopt(bufs, val, len);
+}
+
+/*
+ * Make a value held by the value cache the buffer of an open file, no
+ * copy either. The file holds the reference given until it is written.
+ */
+static void memcachefs_share(file_t *file, buf_ref_t *val)
+{
+    file->attr.chunk = 0;
+    file->attr.size = val->len;
+    file->nchunks = 1;
+    file->buf_len = val->len;
+    file->buf_size = val->len;
+    file->buf = val->data;
+    file->shared = val;
+}
+
+/*
+ * Fill the buffer of an open file from the value cache, if the value of
+ * path did not change since it was cached. Returns 1 when it did not.
+ */
+static int memcachefs_reuse(file_t *file, const char *path)
 {
-    int sock;
-    struct in_addr addr;
-    struct hostent *host;
-    struct sockaddr_in serv_addr;
-    unsigned short port;
+    memcachefs_item_t item;
+    unsigned long long cached;
+    buf_ref_t *val;
+
+    if(val_cache_cas(vals, path, &cached)){
+        stats_add(STATS_VAL_MISSES, 1);
+        return 0;
+    }
+    if(memcachefs_hedged(path, memcachefs_stat, &item,
+                         sizeof(memcachefs_item_t), NULL)){
+        val_cache_invalidate(vals, path);
+        stats_add(STATS_VAL_MISSES, 1);
+        return 0;
+    }
+    val = val_cache_get(vals, path, item.cas, &file->attr);
+    if(!val){
+        stats_add(STATS_VAL_MISSES, 1);
+        return 0;
+    }
+    stats_add(STATS_VAL_HITS, 1);
+    memcachefs_share(file, val);
+    return 1;
+}
 
-    memset((char *)&serv_addr, 0, sizeof(serv_addr));
-    serv_addr.sin_family=AF_INET;
+/*
+ * Fill the buffer of an open file with the value of path. Returns 1 when
+ * it is the same as when path was last opened, 0 when it was fetched.
+ */
+static int memcachefs_fill(file_t *file, const char *path)
+{
+    int ret;
+    memcachefs_value_t value;
+    buf_ref_t *val;
 
-    if((addr.s_addr = inet_addr(opt.host))==-1){
-        host = gethostbyname(opt.host);
-        if(!host){
-            return -1;
+    if(wback){
+        writeback_wait(wback, path);
+    }
+    if(vals && memcachefs_reuse(file, path)){
+        attr_cache_set(attrs, path, &file->attr);
+        return 1;
+    }
+    ret = memcachefs_hedged(path, memcachefs_fetch, &value,
+                            sizeof(memcachefs_value_t),
+                            memcachefs_fetch_dispose);
+    if(ret){
+        if(ret == -ENOENT){
+            attr_cache_invalidate(attrs, path);
         }
-        memcpy(&addr, (struct in_addr *)*host->h_addr_list,
-               sizeof(struct in_addr));
+        return ret;
     }
-
-    port = atoi(opt.port);
-    if(port <= 0){
-        return -1;
+    file->attr = value.attr;
+    // the value under the key is the first chunk of a chunked file
+    if(file->attr.chunk && value.bytes == file->attr.chunk &&
+       file->attr.size > file->attr.chunk){
+        file->nchunks = memcachefs_nchunks(&file->attr);
+        file->loaded = (char*)calloc(file->nchunks, 1);
+        if(!file->loaded){
+            free(value.val);
+            return -ENOMEM;
+        }
+        file->loaded[0] = FILE_CHUNK_LOADED;
+        file->buf_len = file->attr.size;
+        if(memcachefs_reserve(file, file->buf_len)){
+            free(value.val);
+            return -ENOMEM;
+        }
+        memcpy(file->buf, value.val, value.bytes);
+        free(value.val);
+    }else if(vals && (val = buf_ref_new(bufs, value.val, value.bytes))){
+        memcachefs_share(file, val);
+        val_cache_set(vals, path, val, value.cas, &file->attr);
+    }else{
+        memcachefs_adopt(file, value.val, value.bytes);
     }
-    serv_addr.sin_port = htons(port);
-    serv_addr.sin_addr = addr;
+    attr_cache_set(attrs, path, &file->attr);
+    return 0;
+}
 
-    if((sock = socket(AF_INET,SOCK_STREAM, 0))<0){
-        return -1;
+/*
+ * Files opened write-only for appending are not fetched: their buffer
+ * only collects the bytes written at the end, which are sent with
+ * memcached's append. This needs the exact size, so the metadata record
+ * is read afresh. A single value larger than the chunk size can't be
+ * extended in chunks, nor can a packed one or a list of blocks be
+ * extended at all: they get the usual treatment.
+ */
+static int memcachefs_open_append(file_t *file, const char *path)
+{
+    int ret;
+    memcachefs_item_t item;
+
+    if(wback){
+        writeback_wait(wback, path);
     }
-    if(connect(sock, (struct sockaddr *)&serv_addr, sizeof(serv_addr))==-1){
-        close(sock);
-        return -1;
+    attr_cache_invalidate(attrs, path);
+    ret = memcachefs_hedged(path, memcachefs_lookup_fn, &file->attr,
+                            sizeof(attr_t), NULL);
+    if(ret){
+        return ret;
+    }
+    item.flags = 0;
+    if(!file->attr.chunk && file->attr.size <= opt.chunk_size &&
+       file->attr.size){
+        ret = memcachefs_hedged(path, memcachefs_stat, &item,
+                                sizeof(memcachefs_item_t), NULL);
+        if(ret){
+            return ret;
+        }
     }
-    return sock;
+    if((!file->attr.chunk && file->attr.size > opt.chunk_size) ||
+       (item.flags & (PACK_FLAGS | DEDUP_FLAG))){
+        ret = memcachefs_fill(file, path);
+        return (ret < 0)?ret:0;
+    }
+    file->append = 1;
+    return 0;
 }
 
-static int memcachefs_cachedump(int sock, char item_index,
-                                fuse_fill_dir_t filler, void *filler_buf)
+/*
+ * Open the statistics of the mount or the dump of its trace, as they
+ * are now.
+ */
+static int memcachefs_open_stats(const char *path, struct fuse_file_info *fi)
 {
-    char cmd[256];
-    char *buf;
-    char *ptr;
-    int memlimit = 2*1024*1024; // see memcached source
-    int len;
-    char line[514];
-    char *line_start;
-    char *line_end;
-    char *key;
-    char *key_end;
+    int ret;
+    file_t *file;
+    FILE *fp;
+    char *buf = NULL;
+    size_t len = 0;
 
-    buf = malloc(memlimit);
-    if(!buf){
-        return -1;
+    if((fi->flags & O_ACCMODE) != O_RDONLY){
+        return -EACCES;
     }
-
-    snprintf(cmd, 256, "stats cachedump %d 0\r\n", item_index);
-    len = write(sock, cmd, strlen(cmd));
-    if(len != len){
+    fp = open_memstream(&buf, &len);
+    if(!fp){
+        return -ENOMEM;
+    }
+    if(!strcmp(path, STATS_PATH)){
+        stats_print(fp);
+        pack_counters(packer, fp);
+        ret = 0;
+    }else{
+        ret = trace_dump(tracer, fp);
+    }
+    if(fclose(fp) || ret){
         free(buf);
-        return -1;
+        return -ENOMEM;
     }
-    ptr = buf;
-    do{
-        len = read(sock, ptr, 512);
-        if(len < 0){
-            return -1;
-        }
-        ptr[len] = '\0';
-        ptr += len;
-    }while(len == 512);
-
-    line_start = buf;
-    line_end = buf;
-    while(*line_start != '\0'){
-        line_end = strchr(line_start, '\n');
-        len = line_end - line_start;
-        len = (len >= 514)?514:len;
-        memcpy(line, line_start, len);
-        line[len] = '\0';
-        if(!strncmp(line, "ITEM ", 5)){
-            key = strchr(line, ' ') + 1;
-            key_end = strchr(key, ' ');
-            *key_end = '\0';
-            filler(filler_buf, key, NULL, 0);
-        }else{
-            break;
-        }
-        line_start = line_end + 1;
+    file = file_new(files);
+    if(!file){
+        free(buf);
+        return -ENFILE;
     }
-
-    free(buf);
+    memcachefs_adopt(file, buf, len);
+    fi->direct_io = 1;
+    fi->fh = file->index;
     return 0;
 }
 
-static int memcachefs_getattr(const char *path, struct stat *stbuf)
+static int memcachefs_open(const char *path, struct fuse_file_info *fi)
 {
-    handle_t *handle;
-    char *key;
-    size_t keylen;
-    void *val;
-    size_t vallen;
+    int ret;
+    file_t *file;
 
     if(opt.verbose){
         fprintf(stderr, "%s(\"%s\")\n", __func__, path);
     }
-    memset(stbuf, 0, sizeof(struct stat));
-
-    if(!strcmp(path, "/")){
-        stbuf->st_ino = 1;
-        stbuf->st_mode = S_IFDIR | 0755;
-        stbuf->st_uid = fuse_get_context()->uid;
-        stbuf->st_gid = fuse_get_context()->gid;
-        stbuf->st_nlink = 1;
-        stbuf->st_atime = 0;
-        stbuf->st_mtime = 0;
-        stbuf->st_size = 0;
-        return 0;
+    if(!strcmp(path, STATS_PATH) || (tracer && !strcmp(path, TRACE_PATH))){
+        return memcachefs_open_stats(path, fi);
     }
 
-    handle = handle_get(pool);
-    if(!handle){
-        return -EMFILE;
+    file = file_new(files);
+    if(!file){
+        return -ENFILE;
     }
-
-    key = (char *)path + 1;
-    keylen = strlen(key);
-    val = (char*)mc_aget2(handle->mc, key, keylen, &vallen);
-    handle_release(pool, handle->index);
-    if(!val){
-        return -ENOENT;
+    if((fi->flags & O_ACCMODE) == O_WRONLY && (fi->flags & O_APPEND)){
+        ret = memcachefs_open_append(file, path);
+    }else{
+        ret = memcachefs_fill(file, path);
     }
-    stbuf->st_mode = S_IFREG | 0666;
-    stbuf->st_uid = fuse_get_context()->uid;
-    stbuf->st_gid = fuse_get_context()->gid;
-    stbuf->st_nlink = 1;
-    stbuf->st_size = vallen;
-    free(val);
+    if(ret < 0){
+        file_release(files, file);
+        return ret;
+    }
+    // the pages the kernel has of an unchanged file are still good
+    fi->keep_cache = (ret > 0);
+    fi->fh = file->index;
+
     return 0;
 }
 
-static int memcachefs_opendir(const char *path, struct fuse_file_info *fi)
+static int memcachefs_read(const char *path, char *buf, size_t size,
+                           off_t offset, struct fuse_file_info *fi)
 {
+    int ret;
+    file_t *file;
+    size_t len;
+
     if(opt.verbose){
-        fprintf(stderr, "%s(\"%s\")\n", __func__, path);
+        fprintf(stderr, "%s(\"%s\" %zu@%llu)\n", __func__, path, size, offset);
     }
-    return 0;
+
+    file = file_get(files, fi->fh);
+    pthread_mutex_lock(&file->lock);
+    if(offset >= file->buf_len){
+        pthread_mutex_unlock(&file->lock);
+        return 0;
+    }
+    len = file->buf_len - offset;
+    len = (len < size)?len:size;
+    ret = memcachefs_load(file, path, offset, len, opt.readahead);
+    if(!ret){
+        memcpy(buf, file->buf + offset, len);
+        ret = len;
+    }
+    pthread_mutex_unlock(&file->lock);
+
+    return ret;
 }
 
-static int memcachefs_readdir(const char *path, void *buf,
-                              fuse_fill_dir_t filler, off_t offset,
-                              struct fuse_file_info *fi)
+/*
+ * Take a write to a file opened for appending. Returns 1 when the write
+ * was added at the end, 0 when it is somewhere else: the file was then
+ * stored, fetched in full and left as any other open file.
+ */
+static int memcachefs_write_append(file_t *file, const char *path,
+                                   const char *buf, size_t size, off_t offset)
 {
-    (void) offset;
-    (void) fi;
-    int sock;
-    static char *cmd = "stats items\r\n";
-    char buf_items[4096]; // see item.c of memcached
-    size_t len;
-    char line[256];
-    char *line_start;
-    char *line_end;
-    char item_index;
-    char *tmp;
+    int ret;
 
-    if(opt.verbose){
-        fprintf(stderr, "%s(\"%s\")\n", __func__, path);
+    if(offset == file->attr.size + file->buf_len){
+        if(memcachefs_reserve(file, file->buf_len + size)){
+            return -EFBIG;
+        }
+        memcpy(file->buf + file->buf_len, buf, size);
+        file->buf_len += size;
+        file->dirty = 1;
+        return 1;
     }
-    if(strcmp(path, "/")){
-        return -ENOENT;
+    ret = memcachefs_flush_file(file, path);
+    if(ret){
+        return ret;
     }
+    buf_release(bufs, file->buf, file->buf_size);
+    file->buf = NULL;
+    file->buf_size = 0;
+    file->buf_len = 0;
+    file->append = 0;
+    ret = memcachefs_fill(file, path);
+    return (ret < 0)?ret:0;
+}
 
-    filler(buf, ".", NULL, 0);
-    filler(buf, "..", NULL, 0);
+static int memcachefs_write(const char *path, const char *buf, size_t size,
+                            off_t offset, struct fuse_file_info *fi)
+{
+    int ret;
+    file_t *file;
+    size_t first;
+    size_t last;
+    size_t start;
 
-    sock = memcachefs_connect();
-    if(sock < 0){
-        fprintf(stderr, "error: can't connect to %s:%s\n", opt.host, opt.port);
-        return -EIO;
+    if(opt.verbose){
+        fprintf(stderr, "%s(\"%s\" %zu@%lld)\n", __func__, path, size, offset);
     }
-    len = write(sock, cmd, strlen(cmd));
-    len = read(sock, buf_items, sizeof(buf_items));
-    buf_items[len] = '\0';
-
-    line_start = buf_items;
-    line_end = buf_items;
-    while(*line_start != '\0'){
-        line_end = strchr(line_start, '\n');
-        len = line_end - line_start;
-        len = (len >= 256)?256:len;
-        memcpy(line, line_start, len);
-        line[len] = '\0';
-        line_start = line_end + 1;
-
-        if(!strncmp(line, "STAT items:", 11)){
-            tmp = (char*)(line + 11);
-            item_index = atoi(tmp);
-            tmp = strchr(tmp, ':');
-            if(strncmp(tmp, ":number", 7)){
-                continue;;
-            }
-            memcachefs_cachedump(sock, item_index, filler, buf);
-        }else if(!strncmp(line, "END", 3)){
-            break;
+
+    file = file_get(files, fi->fh);
+    pthread_mutex_lock(&file->lock);
+    if(file->append){
+        ret = memcachefs_write_append(file, path, buf, size, offset);
+        if(ret){
+            pthread_mutex_unlock(&file->lock);
+            attr_cache_invalidate(attrs, path);
+            return (ret > 0)?size:ret;
         }
     }
-    close(sock);
-    return 0;
+    // chunks partly overwritten have to be fetched first
+    start = (offset < file->buf_len)?offset:file->buf_len;
+    ret = memcachefs_load(file, path, start, 1, 0);
+    if(!ret){
+        ret = memcachefs_load(file, path, offset + size - 1, 1, 0);
+    }
+    if(ret){
+        pthread_mutex_unlock(&file->lock);
+        return ret;
+    }
+    if(memcachefs_reserve(file, offset + size)){
+        pthread_mutex_unlock(&file->lock);
+        return -EFBIG;
+    }
+    if(offset > file->buf_len){
+        memset(file->buf + file->buf_len, 0, offset - file->buf_len);
+    }
+    memcpy(file->buf + offset, buf, size);
+    if(file->buf_len < offset + size){
+        file->buf_len = offset + size;
+    }
+    file->dirty = 1;
+    if(file->loaded){
+        first = start / file->attr.chunk;
+        last = (offset + size + file->attr.chunk - 1) / file->attr.chunk;
+        for(; first < last && first < file->nchunks; first++){
+            file->loaded[first] = FILE_CHUNK_DIRTY;
+        }
+    }
+    pthread_mutex_unlock(&file->lock);
+    attr_cache_invalidate(attrs, path);
+
+    return size;
 }
 
-static int memcachefs_releasedir(const char *path, struct fuse_file_info *fi)
+static int memcachefs_flush(const char *path, struct fuse_file_info *fi)
+{
+    if(opt.verbose){
+        fprintf(stderr, "%s(\"%s\")\n", __func__, path);
+    }
+
+    return memcachefs_store_file(file_get(files, fi->fh), path);
+}
+
+static int memcachefs_release(const char *path, struct fuse_file_info *fi)
 {
     if(opt.verbose){
         fprintf(stderr, "%s(\"%s\")\n", __func__, path);
     }
+
+    file_release(files, file_get(files, fi->fh));
+
     return 0;
 }
 
-static int memcachefs_mknod(const char *path, mode_t mode, dev_t rdev)
+static int memcachefs_fsync(const char *path, int i, struct fuse_file_info *fi)
 {
     int ret;
-    handle_t *handle;
-    char *key;
-    size_t keylen;
 
     if(opt.verbose){
-        fprintf(stderr, "%s(\"%s\", 0%o)\n", __func__, path, mode);
-    }
-    if(!S_ISREG(mode)){
-        return -ENOSYS;
+        fprintf(stderr, "%s(\"%s\", %d)\n", __func__, path, i);
     }
 
-    handle = handle_get(pool);
-    if(!handle){
-        return -EMFILE;
-    }
-    key = (char *)path + 1;
-    keylen = strlen(key);
-    ret = mc_set(handle->mc, key, keylen, "", 0, 0, 0);
-    handle_release(pool, handle->index);
-    if(ret){
-        return -EIO;
+    ret = memcachefs_store_file(file_get(files, fi->fh), path);
+    if(!ret && wback){
+        ret = writeback_wait(wback, path);
     }
-
-    return 0;
+    return ret;
 }
 
-static int memcachefs_mkdir(const char *path, mode_t mode){
+static int memcachefs_link(const char *from, const char *to)
+{
     if(opt.verbose){
-        fprintf(stderr, "%s(\"%s\", 0%o)\n", __func__, path, mode);
+        fprintf(stderr, "%s(%s, %s)\n", __func__, from, to);
     }
     return -ENOSYS;
 }
 
-static int memcachefs_unlink(const char *path)
+static int memcachefs_symlink(const char *from, const char *to)
 {
-    int ret;
-    handle_t *handle;
-    char *key;
-    size_t keylen;
+    if(opt.verbose){
+        fprintf(stderr, "%s(\"%s\" -> \"%s\")\n", __func__, from, to);
+    }
+    return -ENOSYS;
+}
 
+static int memcachefs_readlink(const char *path, char *buf, size_t size)
+{
     if(opt.verbose){
         fprintf(stderr, "%s(\"%s\")\n", __func__, path);
     }
-    handle = handle_get(pool);
-    if(!handle){
-        return -EMFILE;
+    return -ENOSYS;
+}
+
+/*
+ * Whether a and b are kept on the same servers, in the same order.
+ */
+static int memcachefs_colocated(const char *a, const char *b)
+{
+    handle_pool_t *ra[MEMCACHEFS_REPLICA_MAX];
+    handle_pool_t *rb[MEMCACHEFS_REPLICA_MAX];
+    unsigned int n;
+
+    n = memcachefs_replicas(a, ra);
+    return n == memcachefs_replicas(b, rb) &&
+           !memcmp(ra, rb, n * sizeof(handle_pool_t*));
+}
+
+/*
+ * Give the file under an inode named from the name to, on the server of
+ * handle: its record is written under to and dropped under from, in one
+ * round-trip. The value of the file old replaces goes away.
+ */
+static int memcachefs_relink(handle_t *handle, const char *from,
+                             const char *to, const attr_t *attr,
+                             const attr_t *old)
+{
+    char record[META_RECORD_MAX];
+    char tokey[MEMCACHEFS_KEY_MAX + 1];
+    char fromkey[MEMCACHEFS_KEY_MAX + 1];
+    char ikey[META_INODE_KEY_MAX];
+    const char *okey;
+    int reclen;
+    int tolen;
+    int fromlen;
+    conn_req_t reqs[3];
+    size_t n = 2;
+
+    reclen = meta_encode(attr, record, sizeof(record));
+    tolen = meta_key(to + 1, tokey, sizeof(tokey));
+    fromlen = meta_key(from + 1, fromkey, sizeof(fromkey));
+    if(reclen < 0 || tolen < 0 || fromlen < 0){
+        return -1;
     }
-    key = (char *)path + 1;
-    keylen = strlen(key);
-    ret = mc_delete(handle->mc, key, keylen, 0);
-    handle_release(pool, handle->index);
-    if(ret){
-        return -EIO;
+    memset(reqs, 0, sizeof(reqs));
+    reqs[0].op = CONN_SET;
+    reqs[0].key = tokey;
+    reqs[0].keylen = tolen;
+    reqs[0].val = record;
+    reqs[0].len = reclen;
+    reqs[1].op = CONN_DELETE;
+    reqs[1].key = fromkey;
+    reqs[1].keylen = fromlen;
+    if(old && old->ino != attr->ino){
+        okey = meta_data_key(to + 1, old, ikey);
+        if(old->chunk){
+            chunk_delete(handle, okey, 1, memcachefs_nchunks(old));
+        }
+        reqs[2].op = CONN_DELETE;
+        reqs[2].key = okey;
+        reqs[2].keylen = strlen(okey);
+        n = 3;
     }
-
-    return 0;
+    conn_exec(handle->conn, reqs, n);
+    return (reqs[0].status == CONN_OK)?0:-1;
 }
 
-static int memcachefs_chmod(const char* path, mode_t mode)
+/*
+ * Rename a file under an inode without moving its value, on every
+ * replica. from and to must be colocated.
+ */
+static int memcachefs_rename_inode(handle_t *handle, const char *from,
+                                   const char *to, const attr_t *attr,
+                                   const attr_t *old)
 {
-    if(opt.verbose){
-        fprintf(stderr, "%s(\"%s\", 0%3o)\n", __func__, path, mode);
+    handle_pool_t *replicas[MEMCACHEFS_REPLICA_MAX];
+    unsigned int nreplicas;
+    unsigned int i;
+    handle_t *rhandle;
+
+    if(memcachefs_relink(handle, from, to, attr, old)){
+        return -EIO;
     }
-    return -ENOSYS;
+    nreplicas = memcachefs_replicas(from, replicas);
+    for(i=0; i<nreplicas; i++){
+        if(replicas[i] == handle->pool){
+            continue;
+        }
+        rhandle = handle_get(replicas[i]);
+        if(!rhandle){
+            continue;
+        }
+        if(memcachefs_relink(rhandle, from, to, attr, old) && opt.verbose){
+            fprintf(stderr, "%s: can't rename the copy of %s on %s:%s\n",
+                    __func__, from, replicas[i]->host, replicas[i]->port);
+        }
+        handle_release(replicas[i], rhandle->index);
+    }
+    attr_cache_set(attrs, to, attr);
+    if(old && !old->ino){
+        dirindex_remove(dirs, to + 1);
+    }
+    return 0;
 }
 
-static int memcachefs_chown(const char *path, uid_t uid, gid_t gid)
+/*
+ * Copy from to to and remove from, or only move the record of a file
+ * under an inode when both names are on the same servers. The handles
+ * are those of the servers holding each name, possibly the same one.
+ * attr and toattr get the attributes of the file under each name.
+ */
+static int memcachefs_move(handle_t *handle, handle_t *tohandle,
+                           const char *from, const char *to, attr_t *attr,
+                           attr_t *toattr)
 {
-    if(opt.verbose){
-        fprintf(stderr, "%s(\"%s\", %d, %d)\n", __func__, path, uid, gid);
+    int ret;
+    char ikey[META_INODE_KEY_MAX];
+    const char *key;
+    char *val;
+    size_t vallen;
+    size_t *index;
+    size_t i;
+    conn_req_t req;
+    attr_t old;
+    int exists;
+
+    ret = memcachefs_lookup(handle, from, attr);
+    if(ret){
+        return ret;
     }
-    return -ENOSYS;
+    // the keys of everything below would have to move, let mv copy them
+    if(S_ISDIR(attr->mode)){
+        return -EXDEV;
+    }
+    exists = !memcachefs_lookup(tohandle, to, &old);
+    if(exists && S_ISDIR(old.mode)){
+        return -EISDIR;
+    }
+    attr_cache_invalidate(attrs, from);
+    attr_cache_invalidate(attrs, to);
+    if(vals){
+        val_cache_invalidate(vals, from);
+        val_cache_invalidate(vals, to);
+    }
+
+    if(attr->ino && memcachefs_colocated(from, to)){
+        *toattr = *attr;
+        return memcachefs_rename_inode(handle, from, to, attr,
+                                       exists?&old:NULL);
+    }
+
+    if(exists){
+        *toattr = old;
+    }else{
+        memset(toattr, 0, sizeof(attr_t));
+        if(opt.inodes){
+            toattr->ino = memcachefs_inode();
+        }
+    }
+    toattr->mode = attr->mode;
+    key = meta_data_key(from + 1, attr, ikey);
+    if(attr->chunk){
+        vallen = attr->size;
+        val = (char*)malloc(vallen);
+        index = (size_t*)malloc(sizeof(size_t) * memcachefs_nchunks(attr));
+        if(!val || !index){
+            free(val);
+            free(index);
+            return -ENOMEM;
+        }
+        for(i=0; i<memcachefs_nchunks(attr); i++){
+            index[i] = i;
+        }
+        ret = chunk_fetch(handle->pool, handle, key, val, vallen, attr->chunk,
+                          index, i, opt.chunk_threads);
+        free(index);
+        if(ret){
+            free(val);
+            val = NULL;
+        }
+    }else{
+        memset(&req, 0, sizeof(req));
+        req.op = CONN_GET;
+        req.key = key;
+        req.keylen = strlen(key);
+        conn_exec(handle->conn, &req, 1);
+        memcachefs_decode(handle, &req);
+        val = (req.status == CONN_OK)?req.data:NULL;
+        vallen = req.bytes;
+    }
+    if(!val){
+        return -ENOENT;
+    }
+
+    ret = memcachefs_store(tohandle, to, val, vallen, NULL, 0, toattr);
+    free(val);
+    if(ret){
+        return ret;
+    }
+
+    ret = memcachefs_remove(handle, from, attr);
+    if(opt.replicas > 1){
+        memcachefs_remove_replicas(handle, from, attr);
+    }
+    dirindex_remove(dirs, from + 1);
+    if(ret){
+        return -EIO;
+    }
+
+    return 0;
 }
 
-static int memcachefs_truncate(const char* path, off_t length)
+static int memcachefs_rename(const char *from, const char *to)
 {
     int ret;
+    handle_pool_t *pool;
+    handle_pool_t *topool;
     handle_t *handle;
-    char *key;
-    size_t keylen;
+    handle_t *tohandle;
+    attr_t attr;
+    attr_t toattr;
 
     if(opt.verbose){
-        fprintf(stderr, "%s(\"%s\", %lld)\n", __func__, path, length);
+        fprintf(stderr, "%s(%s -> %s)\n", __func__, from, to);
     }
-    if(length != 0){
-        return -ENOSYS;
+    if(!strcmp(from, to)){
+        return 0;
     }
-
+    ret = memcachefs_check_key(to);
+    if(ret){
+        return ret;
+    }
+    if(wback){
+        writeback_forget(wback, from);
+        writeback_forget(wback, to);
+    }
+    pool = memcachefs_pool(from);
+    topool = memcachefs_pool(to);
     handle = handle_get(pool);
     if(!handle){
         return -EMFILE;
     }
+    tohandle = handle;
+    if(topool != pool){
+        tohandle = handle_get(topool);
+        if(!tohandle){
+            handle_release(pool, handle->index);
+            return -EMFILE;
+        }
+    }
+
+    ret = memcachefs_move(handle, tohandle, from, to, &attr, &toattr);
 
-    key = (char *)path + 1;
-    keylen = strlen(key);
-    ret = mc_set(handle->mc, key, keylen, "", 0, 0, 0);
+    if(tohandle != handle){
+        handle_release(topool, tohandle->index);
+    }
     handle_release(pool, handle->index);
     if(ret){
-        return -EIO;
+        return ret;
     }
-
-    return 0;
+    ret = memcachefs_index(to, &toattr, 1);
+    if(ret){
+        return ret;
+    }
+    return memcachefs_index(from, &attr, 0);
 }
 
-static int memcachefs_utime(const char *path, struct utimbuf *time)
+/*
+ * Record an operation that started at start in the trace, if any.
+ */
+static void memcachefs_trace(unsigned int op, const char *path,
+                             uint64_t offset, size_t size,
+                             unsigned long long start, int ret)
 {
-    if(opt.verbose){
-        fprintf(stderr, "%s(\"%s\")\n", __func__, path);
+    if(tracer){
+        trace_add(tracer, op, path, offset, size, start, stats_now(), ret);
     }
-    return 0;
 }
 
-static int memcachefs_open(const char *path, struct fuse_file_info *fi)
+/*
+ * Entry points of the operations timed in the statistics, and of those
+ * only recorded in the trace.
+ */
+static int memcachefs_timed_getattr(const char *path, struct stat *stbuf)
 {
-    handle_t *handle;
-    char *key;
-    size_t keylen;
-    void *val;
-    size_t vallen;
+    unsigned long long start = stats_now();
+    int ret = memcachefs_getattr(path, stbuf);
 
-    if(opt.verbose){
-        fprintf(stderr, "%s(\"%s\")\n", __func__, path);
-    }
+    stats_time(STATS_GETATTR, start, ret < 0);
+    memcachefs_trace(TRACE_GETATTR, path, 0, 0, start, ret);
+    return ret;
+}
 
-    handle = handle_get(pool);
-    if(!handle){
-        return -EMFILE;
-    }
-    fi->fh = handle->index;
+static int memcachefs_timed_open(const char *path, struct fuse_file_info *fi)
+{
+    unsigned long long start = stats_now();
+    int ret = memcachefs_open(path, fi);
 
-    key = (char *)path + 1;
-    keylen = strlen(key);
-    val = mc_aget2(handle->mc, key, keylen, &vallen);
-    if(!val){
-        return -EIO;
-    }
-    memcpy(handle->buf, val, vallen);
-    handle->buf_len = vallen;
+    stats_time(STATS_OPEN, start, ret < 0);
+    memcachefs_trace(TRACE_OPEN, path, 0, 0, start, ret);
+    return ret;
+}
 
-    return 0;
+static int memcachefs_timed_read(const char *path, char *buf, size_t size,
+                                 off_t offset, struct fuse_file_info *fi)
+{
+    unsigned long long start = stats_now();
+    int ret = memcachefs_read(path, buf, size, offset, fi);
+
+    stats_time(STATS_READ, start, ret < 0);
+    memcachefs_trace(TRACE_READ, path, offset, size, start, ret);
+    return ret;
 }
 
-static int memcachefs_read(const char *path, char *buf, size_t size,
-                           off_t offset, struct fuse_file_info *fi)
+static int memcachefs_timed_write(const char *path, const char *buf,
+                                  size_t size, off_t offset,
+                                  struct fuse_file_info *fi)
 {
-    size_t len;
+    unsigned long long start = stats_now();
+    int ret = memcachefs_write(path, buf, size, offset, fi);
 
-    if(opt.verbose){
-        fprintf(stderr, "%s(\"%s\" %zu@%llu)\n", __func__, path, size, offset);
-    }
+    stats_time(STATS_WRITE, start, ret < 0);
+    memcachefs_trace(TRACE_WRITE, path, offset, size, start, ret);
+    return ret;
+}
 
-    len = pool->handles[fi->fh]->buf_len - offset;
-    len = (len < size)?len:size;
-    memcpy(buf, pool->handles[fi->fh]->buf + offset, len);
+static int memcachefs_timed_flush(const char *path, struct fuse_file_info *fi)
+{
+    unsigned long long start = stats_now();
+    int ret = memcachefs_flush(path, fi);
 
-    return len;
+    stats_time(STATS_FLUSH, start, ret < 0);
+    memcachefs_trace(TRACE_FLUSH, path, 0, 0, start, ret);
+    return ret;
 }
 
-static int memcachefs_write(const char *path, const char *buf, size_t size,
-                            off_t offset, struct fuse_file_info *fi)
+static int memcachefs_timed_readdir(const char *path, void *buf,
+                                    fuse_fill_dir_t filler, off_t offset,
+                                    struct fuse_file_info *fi)
 {
-    if(opt.verbose){
-        fprintf(stderr, "%s(\"%s\" %zu@%lld)\n", __func__, path, size, offset);
-    }
+    unsigned long long start = stats_now();
+    int ret = memcachefs_readdir(path, buf, filler, offset, fi);
 
-    // The memcached can be stored up to 1M - 1 or less byte.
-    if(offset + size >= pool->handles[fi->fh]->buf_size){
-        return -EFBIG;
-    }
+    stats_time(STATS_READDIR, start, ret < 0);
+    memcachefs_trace(TRACE_READDIR, path, offset, 0, start, ret);
+    return ret;
+}
 
-    memcpy(pool->handles[fi->fh]->buf + offset, buf, size);
-    if(pool->handles[fi->fh]->buf_len < offset + size){
-        pool->handles[fi->fh]->buf_len = offset + size;
-    }
+static int memcachefs_timed_rename(const char *from, const char *to)
+{
+    unsigned long long start = stats_now();
+    int ret = memcachefs_rename(from, to);
 
-    return size;
+    stats_time(STATS_RENAME, start, ret < 0);
+    memcachefs_trace(TRACE_RENAME, from, trace_hash(to), 0, start, ret);
+    return ret;
 }
 
-static int memcachefs_flush(const char *path, struct fuse_file_info *fi)
+static int memcachefs_traced_release(const char *path,
+                                     struct fuse_file_info *fi)
 {
-    int ret;
-    handle_t *handle;
-    char *key;
-    size_t keylen;
+    unsigned long long start = stats_now();
+    int ret = memcachefs_release(path, fi);
 
-    if(opt.verbose){
-        fprintf(stderr, "%s(\"%s\")\n", __func__, path);
-    }
+    memcachefs_trace(TRACE_RELEASE, path, 0, 0, start, ret);
+    return ret;
+}
 
-    handle = pool->handles[fi->fh];
+static int memcachefs_traced_mknod(const char *path, mode_t mode, dev_t rdev)
+{
+    unsigned long long start = stats_now();
+    int ret = memcachefs_mknod(path, mode, rdev);
 
-    key = (char *)path + 1;
-    keylen = strlen(key);
-    ret = mc_set(handle->mc, key, keylen, handle->buf, handle->buf_len , 0, 0);
-    if(ret){
-        return -EIO;
-    }
+    memcachefs_trace(TRACE_MKNOD, path, 0, 0, start, ret);
+    return ret;
+}
 
-    return 0;
+static int memcachefs_traced_mkdir(const char *path, mode_t mode)
+{
+    unsigned long long start = stats_now();
+    int ret = memcachefs_mkdir(path, mode);
+
+    memcachefs_trace(TRACE_MKDIR, path, 0, 0, start, ret);
+    return ret;
 }
 
-static int memcachefs_release(const char *path, struct fuse_file_info *fi)
+static int memcachefs_traced_unlink(const char *path)
 {
-    if(opt.verbose){
-        fprintf(stderr, "%s(\"%s\")\n", __func__, path);
-    }
+    unsigned long long start = stats_now();
+    int ret = memcachefs_unlink(path);
 
-    handle_release(pool, fi->fh);
+    memcachefs_trace(TRACE_UNLINK, path, 0, 0, start, ret);
+    return ret;
+}
 
-    return 0;
+static int memcachefs_traced_rmdir(const char *path)
+{
+    unsigned long long start = stats_now();
+    int ret = memcachefs_rmdir(path);
+
+    memcachefs_trace(TRACE_RMDIR, path, 0, 0, start, ret);
+    return ret;
 }
 
-static int memcachefs_fsync(const char *path, int i, struct fuse_file_info *fi)
+static int memcachefs_traced_truncate(const char *path, off_t length)
 {
-    int ret;
-    handle_t *handle;
-    char *key;
-    size_t keylen;
+    unsigned long long start = stats_now();
+    int ret = memcachefs_truncate(path, length);
 
-    if(opt.verbose){
-        fprintf(stderr, "%s(\"%s\", %d)\n", __func__, path, i);
-    }
-    handle = pool->handles[fi->fh];
+    memcachefs_trace(TRACE_TRUNCATE, path, length, 0, start, ret);
+    return ret;
+}
 
-    key = (char *)path + 1;
-    keylen = strlen(key);
-    ret = mc_set(handle->mc, key, keylen, handle->buf, handle->buf_len , 0, 0);
-    if(ret){
-        return -EIO;
-    }
+static int memcachefs_traced_fsync(const char *path, int datasync,
+                                   struct fuse_file_info *fi)
+{
+    unsigned long long start = stats_now();
+    int ret = memcachefs_fsync(path, datasync, fi);
 
-    return 0;
+    memcachefs_trace(TRACE_FSYNC, path, 0, 0, start, ret);
+    return ret;
 }
 
-static int memcachefs_link(const char *from, const char *to)
+static int memcachefs_traced_opendir(const char *path,
+                                     struct fuse_file_info *fi)
 {
-    if(opt.verbose){
-        fprintf(stderr, "%s(%s, %s)\n", __func__, from, to);
-    }
-    return -ENOSYS;
+    unsigned long long start = stats_now();
+    int ret = memcachefs_opendir(path, fi);
+
+    memcachefs_trace(TRACE_OPENDIR, path, 0, 0, start, ret);
+    return ret;
 }
 
-static int memcachefs_symlink(const char *from, const char *to)
+static int memcachefs_traced_releasedir(const char *path,
+                                        struct fuse_file_info *fi)
 {
-    if(opt.verbose){
-        fprintf(stderr, "%s(\"%s\" -> \"%s\")\n", __func__, from, to);
-    }
-    return -ENOSYS;
+    unsigned long long start = stats_now();
+    int ret = memcachefs_releasedir(path, fi);
+
+    memcachefs_trace(TRACE_RELEASEDIR, path, 0, 0, start, ret);
+    return ret;
 }
 
-static int memcachefs_readlink(const char *path, char *buf, size_t size)
+static int memcachefs_traced_chmod(const char *path, mode_t mode)
 {
-    if(opt.verbose){
-        fprintf(stderr, "%s(\"%s\")\n", __func__, path);
-    }
-    return -ENOSYS;
+    unsigned long long start = stats_now();
+    int ret = memcachefs_chmod(path, mode);
+
+    memcachefs_trace(TRACE_CHMOD, path, 0, 0, start, ret);
+    return ret;
 }
 
-static int memcachefs_rename(const char *from, const char *to)
+static int memcachefs_traced_chown(const char *path, uid_t uid, gid_t gid)
 {
-    int ret;
-    handle_t *handle;
-    char *key;
-    size_t keylen;
-    void *val;
-    size_t vallen;
+    unsigned long long start = stats_now();
+    int ret = memcachefs_chown(path, uid, gid);
 
-    if(opt.verbose){
-        fprintf(stderr, "%s(%s -> %s)\n", __func__, from, to);
-    }
-    handle = handle_get(pool);
+    memcachefs_trace(TRACE_CHOWN, path, 0, 0, start, ret);
+    return ret;
+}
 
-    key = (char *)from + 1;
-    keylen = strlen(key);
-    val = (char*)mc_aget2(handle->mc, key, keylen, &vallen);
-    if(!val){
-        handle_release(pool, handle->index);
-        return -ENOENT;
-    }
+static int memcachefs_traced_utime(const char *path, struct utimbuf *time)
+{
+    unsigned long long start = stats_now();
+    int ret = memcachefs_utime(path, time);
 
-    key = (char *)to + 1;
-    keylen = strlen(key);
-    ret = mc_set(handle->mc, key, keylen, val, vallen, 0, 0);
-    if(ret){
-        handle_release(pool, handle->index);
-        return -EIO;
-    }
+    memcachefs_trace(TRACE_UTIME, path, 0, 0, start, ret);
+    return ret;
+}
 
-    key = (char *)from + 1;
-    keylen = strlen(key);
-    ret = mc_delete(handle->mc, key, keylen, 0);
-    if(ret){
-        handle_release(pool, handle->index);
-        return -EIO;
-    }
+static int memcachefs_traced_link(const char *from, const char *to)
+{
+    unsigned long long start = stats_now();
+    int ret = memcachefs_link(from, to);
 
-    free(val);
-    return 0;
+    memcachefs_trace(TRACE_LINK, from, trace_hash(to), 0, start, ret);
+    return ret;
+}
+
+static int memcachefs_traced_symlink(const char *from, const char *to)
+{
+    unsigned long long start = stats_now();
+    int ret = memcachefs_symlink(from, to);
+
+    memcachefs_trace(TRACE_SYMLINK, from, trace_hash(to), 0, start, ret);
+    return ret;
+}
+
+static int memcachefs_traced_readlink(const char *path, char *buf,
+                                      size_t size)
+{
+    unsigned long long start = stats_now();
+    int ret = memcachefs_readlink(path, buf, size);
+
+    memcachefs_trace(TRACE_READLINK, path, 0, size, start, ret);
+    return ret;
 }
 
 static struct fuse_operations memcachefs_oper = {
-    .getattr    = memcachefs_getattr,
-    .opendir    = memcachefs_opendir,
-    .readdir    = memcachefs_readdir,
-    .releasedir = memcachefs_releasedir,
-    .mknod      = memcachefs_mknod,
-    .mkdir      = memcachefs_mkdir,
-    .unlink     = memcachefs_unlink,
-    .rmdir      = memcachefs_unlink,
-    .chmod      = memcachefs_chmod,
-    .chown      = memcachefs_chown,
-    .truncate   = memcachefs_truncate,
-    .utime      = memcachefs_utime,
-    .open       = memcachefs_open,
-    .read       = memcachefs_read,
-    .write      = memcachefs_write,
-    .flush      = memcachefs_flush,
-    .release    = memcachefs_release,
-    .fsync      = memcachefs_fsync,
-    .link       = memcachefs_link,
-    .symlink    = memcachefs_symlink,
-    .readlink   = memcachefs_readlink,
-    .rename     = memcachefs_rename,
+    .getattr    = memcachefs_timed_getattr,
+    .opendir    = memcachefs_traced_opendir,
+    .readdir    = memcachefs_timed_readdir,
+    .releasedir = memcachefs_traced_releasedir,
+    .mknod      = memcachefs_traced_mknod,
+    .mkdir      = memcachefs_traced_mkdir,
+    .unlink     = memcachefs_traced_unlink,
+    .rmdir      = memcachefs_traced_rmdir,
+    .chmod      = memcachefs_traced_chmod,
+    .chown      = memcachefs_traced_chown,
+    .truncate   = memcachefs_traced_truncate,
+    .utime      = memcachefs_traced_utime,
+    .open       = memcachefs_timed_open,
+    .read       = memcachefs_timed_read,
+    .write      = memcachefs_timed_write,
+    .flush      = memcachefs_timed_flush,
+    .release    = memcachefs_traced_release,
+    .fsync      = memcachefs_traced_fsync,
+    .link       = memcachefs_traced_link,
+    .symlink    = memcachefs_traced_symlink,
+    .readlink   = memcachefs_traced_readlink,
+    .rename     = memcachefs_timed_rename,
+    .init       = memcachefs_init,
+    .destroy    = memcachefs_destroy,
 };
 
 void usage(){
-    fprintf(stderr, "Usage: memcachefs host[:port] mountpoint\n");
+    fprintf(stderr, "Usage: memcachefs host[:port[:weight]][,...] "
+            "mountpoint\n");
+}
+
+/*
+ * Split the host[:port[:weight]][,...] list into opt.servers. A weight
+ * is a positive decimal number small enough for its points on the ring
+ * to be counted in an unsigned int.
+ */
+static int memcachefs_servers(char *hosts)
+{
+    char *host;
+    char *port;
+    char *weight;
+    char *end;
+    char *next;
+    unsigned long w;
+    server_t *server;
+
+    for(host = hosts; host; host = next){
+        next = strchr(host, ',');
+        if(next){
+            *next++ = '\0';
+        }
+        if(!*host){
+            continue;
+        }
+        server = (server_t*)realloc(opt.servers,
+                                    sizeof(server_t) * (opt.nservers + 1));
+        if(!server){
+            return -1;
+        }
+        opt.servers = server;
+        server += opt.nservers++;
+        server->host = host;
+        server->port = opt.port;
+        server->weight = 1;
+        port = strchr(host, ':');
+        if(port){
+            *port++ = '\0';
+            weight = strchr(port, ':');
+            if(weight){
+                *weight++ = '\0';
+                errno = 0;
+                w = strtoul(weight, &end, 10);
+                // strtoul takes a sign and leading spaces, weights don't
+                if(*weight < '0' || *weight > '9' || *end || errno ||
+                   w > UINT_MAX / RING_POINTS){
+                    w = 0;
+                }
+                server->weight = w;
+            }
+            if(*port){
+                server->port = port;
+            }
+        }
+        if(!server->weight){
+            fprintf(stderr, "bad weight for %s\n", host);
+            return -1;
+        }
+    }
+    return opt.nservers?0:-1;
 }
 
 static int memcachefs_opt_proc(void *data, const char *arg, int key,
@@ -612,18 +3045,75 @@ static int memcachefs_opt_proc(void *data, const char *arg, int key,
         }else if(!strncmp(arg, "maxhandle=", strlen("maxhandle="))){
             str = strchr(arg, '=') + 1;
             opt.maxhandle = atoi(str);
+        }else if(!strncmp(arg, "minhandle=", strlen("minhandle="))){
+            str = strchr(arg, '=') + 1;
+            opt.minhandle = atoi(str);
+        }else if(!strncmp(arg, "handlewait=", strlen("handlewait="))){
+            str = strchr(arg, '=') + 1;
+            opt.handle_wait = atoi(str);
+        }else if(!strncmp(arg, "handlequeue=", strlen("handlequeue="))){
+            str = strchr(arg, '=') + 1;
+            opt.handle_queue = atoi(str);
+        }else if(!strncmp(arg, "attrttl=", strlen("attrttl="))){
+            str = strchr(arg, '=') + 1;
+            opt.attr_timeout = atoi(str);
+        }else if(!strncmp(arg, "chunksize=", strlen("chunksize="))){
+            str = strchr(arg, '=') + 1;
+            opt.chunk_size = atoi(str);
+        }else if(!strncmp(arg, "chunkthreads=", strlen("chunkthreads="))){
+            str = strchr(arg, '=') + 1;
+            opt.chunk_threads = atoi(str);
+        }else if(!strncmp(arg, "readahead=", strlen("readahead="))){
+            str = strchr(arg, '=') + 1;
+            opt.readahead = atoi(str);
+        }else if(!strncmp(arg, "bufcache=", strlen("bufcache="))){
+            str = strchr(arg, '=') + 1;
+            opt.buf_cache = strtoul(str, NULL, 10);
+        }else if(!strncmp(arg, "dirrefresh=", strlen("dirrefresh="))){
+            str = strchr(arg, '=') + 1;
+            opt.dir_refresh = atoi(str);
+        }else if(!strncmp(arg, "replicas=", strlen("replicas="))){
+            str = strchr(arg, '=') + 1;
+            opt.replicas = atoi(str);
+        }else if(!strncmp(arg, "writeback=", strlen("writeback="))){
+            str = strchr(arg, '=') + 1;
+            opt.writeback = atoi(str);
+        }else if(!strncmp(arg, "wbbytes=", strlen("wbbytes="))){
+            str = strchr(arg, '=') + 1;
+            opt.writeback_bytes = strtoul(str, NULL, 10);
+        }else if(!strncmp(arg, "wbage=", strlen("wbage="))){
+            str = strchr(arg, '=') + 1;
+            opt.writeback_age = atoi(str);
+        }else if(!strncmp(arg, "readcache=", strlen("readcache="))){
+            str = strchr(arg, '=') + 1;
+            opt.read_cache = strtoul(str, NULL, 10);
+        }else if(!strncmp(arg, "inodes=", strlen("inodes="))){
+            str = strchr(arg, '=') + 1;
+            opt.inodes = atoi(str);
+        }else if(!strncmp(arg, "compress=", strlen("compress="))){
+            str = strchr(arg, '=') + 1;
+            opt.compress = pack_algo(str);
+        }else if(!strncmp(arg, "compressmin=", strlen("compressmin="))){
+            str = strchr(arg, '=') + 1;
+            opt.compress_min = strtoul(str, NULL, 10);
+        }else if(!strncmp(arg, "dedup=", strlen("dedup="))){
+            str = strchr(arg, '=') + 1;
+            opt.dedup = atoi(str);
+        }else if(!strncmp(arg, "trace=", strlen("trace="))){
+            str = strchr(arg, '=') + 1;
+            opt.trace = atoi(str);
+        }else if(!strncmp(arg, "tracefile=", strlen("tracefile="))){
+            str = strchr(arg, '=') + 1;
+            opt.trace_file = str;
+        }else if(!strncmp(arg, "backend=", strlen("backend="))){
+            str = strchr(arg, '=') + 1;
+            opt.backend = str;
         }else{
             fuse_opt_add_arg(outargs, arg);
        }
     }else if(key == FUSE_OPT_KEY_NONOPT){
-        if(!opt.host){
-            opt.host = (char*)arg;
-            str = strchr(arg, ':');
-            if(str){
-                *str = '\0';
-                str++;
-                opt.port = str;
-            }
+        if(!opt.hosts){
+            opt.hosts = strdup(arg);
         }else{
             fuse_opt_add_arg(outargs, arg);
         }
@@ -631,32 +3121,185 @@ static int memcachefs_opt_proc(void *data, const char *arg, int key,
     return 0;
 }
 
+/*
+ * Check the options and make the objects shared by the operations.
+ */
+static int memcachefs_setup(void)
+{
+    unsigned int i;
+
+    if(!opt.chunk_size || opt.chunk_size >= MEMCACHEFS_ITEM_MAX){
+        fprintf(stderr, "chunksize must be between 1 and %d\n",
+                MEMCACHEFS_ITEM_MAX - 1);
+        return -1;
+    }
+    if(!opt.replicas || opt.replicas > MEMCACHEFS_REPLICA_MAX){
+        fprintf(stderr, "replicas must be between 1 and %d\n",
+                MEMCACHEFS_REPLICA_MAX);
+        return -1;
+    }
+    if(opt.compress < 0){
+        fprintf(stderr, "compress must be none or a method built in\n");
+        return -1;
+    }
+    if(!conn_backend(opt.backend)){
+        fprintf(stderr, "backend must be memcached or memory\n");
+        return -1;
+    }
+
+    pools = (handle_pool_t**)calloc(opt.nservers, sizeof(handle_pool_t*));
+    if(!pools){
+        perror("malloc()");
+        return -1;
+    }
+    for(i=0; i<opt.nservers; i++){
+        pools[i] = handle_pool_new(&opt, &opt.servers[i]);
+        if(!pools[i]){
+            perror("malloc()");
+            return -1;
+        }
+    }
+    ring = ring_new(opt.servers, opt.nservers);
+    if(!ring){
+        perror("malloc()");
+        return -1;
+    }
+    memcachefs_inode_seed();
+    hedge = hedge_new(opt.maxhandle * opt.nservers);
+    if(!hedge){
+        perror("malloc()");
+        return -1;
+    }
+    bufs = buf_pool_new(MEMCACHEFS_ITEM_MAX, opt.buf_cache);
+    if(!bufs){
+        perror("malloc()");
+        return -1;
+    }
+    files = file_table_new(bufs);
+    if(!files){
+        perror("malloc()");
+        return -1;
+    }
+    attrs = attr_cache_new(opt.attr_timeout);
+    if(!attrs){
+        perror("malloc()");
+        return -1;
+    }
+    dirs = dirindex_new(pools, opt.nservers, opt.dir_refresh);
+    if(!dirs){
+        perror("malloc()");
+        return -1;
+    }
+    if(opt.read_cache){
+        vals = val_cache_new(opt.read_cache, bufs);
+        if(!vals){
+            perror("malloc()");
+            return -1;
+        }
+    }
+    packer = pack_new(opt.compress, opt.compress_min);
+    if(!packer){
+        perror("malloc()");
+        return -1;
+    }
+    if(opt.trace){
+        tracer = trace_new(opt.trace, opt.trace_file);
+        if(!tracer){
+            perror("malloc()");
+            return -1;
+        }
+    }
+    if(opt.writeback){
+        wback = writeback_new(opt.writeback, opt.writeback_bytes,
+                              opt.writeback_age, memcachefs_writeback);
+        if(!wback){
+            perror("malloc()");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Free what memcachefs_setup() made, printing the statistics under -v.
+ */
+static void memcachefs_teardown(void)
+{
+    unsigned int i;
+
+    if(wback){
+        if(opt.verbose){
+            writeback_stats(wback, stderr);
+        }
+        writeback_free(wback);
+    }
+    if(vals){
+        if(opt.verbose){
+            val_cache_stats(vals, stderr);
+        }
+        val_cache_free(vals);
+    }
+    dirindex_free(dirs);
+    attr_cache_free(attrs);
+    file_table_free(files);
+    if(opt.verbose){
+        pack_stats(packer, stderr);
+        stats_print(stderr);
+        buf_pool_stats(bufs, stderr);
+        if(opt.replicas > 1){
+            hedge_stats(hedge, stderr);
+        }
+    }
+    pack_free(packer);
+    if(tracer){
+        if(opt.verbose){
+            trace_stats(tracer, stderr);
+        }
+        trace_free(tracer);
+    }
+    buf_pool_free(bufs);
+    hedge_free(hedge);
+    ring_free(ring);
+    for(i=0; i<opt.nservers; i++){
+        handle_pool_free(pools[i]);
+    }
+    free(pools);
+    free(opt.servers);
+    free(opt.hosts);
+}
+
 /*
  * main
  */
 int main(int argc, char *argv[])
 {
+    unsigned int i;
     struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
 
     fuse_opt_parse(&args, &opt, NULL, memcachefs_opt_proc);
 
-    if(!opt.host){
+    if(!opt.hosts){
         usage();
         return EXIT_SUCCESS;
     }
-
-    pool = handle_pool_new(&opt);
-    if(!pool){
-        perror("malloc()");
+    if(memcachefs_servers(opt.hosts)){
+        usage();
+        return EXIT_FAILURE;
+    }
+    if(memcachefs_setup()){
         return EXIT_FAILURE;
     }
 
     if(opt.verbose){
-        fprintf(stderr, "mounting to %s:%s\n", opt.host, opt.port);
+        for(i=0; i<opt.nservers; i++){
+            fprintf(stderr, "mounting to %s:%s (weight %u)\n",
+                    opt.servers[i].host, opt.servers[i].port,
+                    opt.servers[i].weight);
+        }
     }
 
     fuse_main(args.argc, args.argv, &memcachefs_oper);
     fuse_opt_free_args(&args);
-    handle_pool_free(pool);
+    memcachefs_teardown();
     return EXIT_SUCCESS;
 }
@@ -18,9 +18,62 @@
  * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
  */
 
+// memcached refuses longer keys
+#define MEMCACHEFS_KEY_MAX 250
+
+// default memcached item size limit, key and item header included
+#define MEMCACHEFS_ITEM_MAX (1024 * 1024)
+
+// most copies of a file kept on different servers
+#define MEMCACHEFS_REPLICA_MAX 4
+
+// listed entries whose attributes are fetched together
+#define MEMCACHEFS_PREFETCH 64
+
+// keys starting with this prefix are used internally and hidden
+#define MEMCACHEFS_RESERVED "mcfs:"
+
+typedef struct{
+    size_t size;
+    time_t mtime;
+    mode_t mode;
+    unsigned int gen;
+    size_t chunk;       // chunk size, 0 when stored as a single value
+    unsigned long long ino; // value under the key of this inode, 0: own
+}attr_t;
+
 typedef struct{
     char *host;
     char *port;
+    unsigned int weight;
+}server_t;
+
+typedef struct{
+    char *hosts;        // host[:port[:weight]][,...] as given
+    char *port;         // port of the servers given without one
+    server_t *servers;
+    unsigned int nservers;
     short verbose;
     unsigned int maxhandle;
+    unsigned int minhandle;
+    unsigned int handle_wait;
+    unsigned int handle_queue;
+    unsigned int attr_timeout;
+    size_t chunk_size;
+    unsigned int chunk_threads;
+    unsigned int readahead;
+    size_t buf_cache;
+    unsigned int dir_refresh;
+    unsigned int replicas;
+    unsigned int writeback;     // writer threads, 0 to store on flush
+    size_t writeback_bytes;
+    unsigned int writeback_age; // milliseconds
+    size_t read_cache;
+    short inodes;               // store new files under an inode
+    int compress;               // PACK_ method of single values
+    size_t compress_min;        // smaller values are stored raw
+    short dedup;                // store files as lists of shared blocks
+    unsigned int trace;         // records per thread, 0: no trace
+    char *trace_file;           // dumped to on SIGUSR1
+    char *backend;              // conn_backend() name, NULL: memcached
 }memcachefs_opt_t;
@@ -0,0 +1,452 @@
+/*
+ * memstore.c - in-memory item store
+ * Copyright (C) 2012 Benoit Vidis <contact@benoitvidis.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+/*
+ * Items kept in memory and handled like memcached handles the requests
+ * of conn_exec(), CAS and item flags included. The table is split in
+ * stripes so that threads working on different keys seldom wait for
+ * each other. Nothing is ever evicted.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include "memcachefs.h"
+#include "conn.h"
+#include "memstore.h"
+
+static unsigned int memstore_hash(const char *key, size_t keylen)
+{
+    unsigned int hash = 2166136261U;
+    size_t i;
+
+    for(i=0; i<keylen; i++){
+        hash ^= (unsigned char)key[i];
+        hash *= 16777619U;
+    }
+    return hash;
+}
+
+static void memstore_item_free(memstore_item_t *item)
+{
+    free(item->key);
+    free(item->val);
+    free(item);
+}
+
+memstore_t *memstore_new(void)
+{
+    memstore_t *store;
+    unsigned int i;
+
+    store = (memstore_t*)malloc(sizeof(memstore_t));
+    if(!store){
+        return NULL;
+    }
+    memset(store, 0, sizeof(memstore_t));
+    for(i=0; i<MEMSTORE_STRIPES; i++){
+        store->stripes[i].buckets =
+            (memstore_item_t**)calloc(MEMSTORE_BUCKETS,
+                                      sizeof(memstore_item_t*));
+        if(!store->stripes[i].buckets){
+            memstore_free(store);
+            return NULL;
+        }
+        store->stripes[i].nbuckets = MEMSTORE_BUCKETS;
+        pthread_mutex_init(&store->stripes[i].mutex, NULL);
+    }
+    return store;
+}
+
+void memstore_free(memstore_t *store)
+{
+    memstore_stripe_t *stripe;
+    memstore_item_t *item;
+    unsigned int i;
+    size_t j;
+
+    for(i=0; i<MEMSTORE_STRIPES; i++){
+        stripe = &store->stripes[i];
+        if(!stripe->buckets){
+            continue;
+        }
+        for(j=0; j<stripe->nbuckets; j++){
+            while((item = stripe->buckets[j])){
+                stripe->buckets[j] = item->next;
+                memstore_item_free(item);
+            }
+        }
+        free(stripe->buckets);
+        pthread_mutex_destroy(&stripe->mutex);
+    }
+    free(store);
+}
+
+/*
+ * Double the buckets of a stripe, keeping the old ones if that fails.
+ */
+static void memstore_grow(memstore_stripe_t *stripe)
+{
+    memstore_item_t **buckets;
+    memstore_item_t *item;
+    size_t n = stripe->nbuckets * 2;
+    size_t i;
+
+    buckets = (memstore_item_t**)calloc(n, sizeof(memstore_item_t*));
+    if(!buckets){
+        return;
+    }
+    for(i=0; i<stripe->nbuckets; i++){
+        while((item = stripe->buckets[i])){
+            stripe->buckets[i] = item->next;
+            item->next = buckets[(item->hash / MEMSTORE_STRIPES) % n];
+            buckets[(item->hash / MEMSTORE_STRIPES) % n] = item;
+        }
+    }
+    free(stripe->buckets);
+    stripe->buckets = buckets;
+    stripe->nbuckets = n;
+}
+
+/*
+ * The link to the item of a key in its stripe, pointing to NULL when
+ * there is none.
+ */
+static memstore_item_t **memstore_find(memstore_stripe_t *stripe,
+                                       unsigned int hash, const char *key,
+                                       size_t keylen)
+{
+    memstore_item_t **link;
+
+    link = &stripe->buckets[(hash / MEMSTORE_STRIPES) % stripe->nbuckets];
+    for(; *link; link = &(*link)->next){
+        if((*link)->hash == hash && (*link)->keylen == keylen &&
+           !memcmp((*link)->key, key, keylen)){
+            break;
+        }
+    }
+    return link;
+}
+
+/*
+ * Copy the value of an item into the request, as conn_exec() would.
+ */
+static void memstore_get(memstore_item_t *item, conn_req_t *req)
+{
+    char *dst;
+
+    req->bytes = item->len;
+    req->cas = item->cas;
+    req->flags = item->flags;
+    if(req->op == CONN_STAT){
+        req->status = CONN_OK;
+        return;
+    }
+    if(req->buf && item->len <= req->bufsize){
+        dst = req->buf;
+    }else{
+        dst = (char*)malloc(item->len?item->len:1);
+        if(!dst){
+            return;
+        }
+    }
+    memcpy(dst, item->val, item->len);
+    req->data = dst;
+    req->status = CONN_OK;
+}
+
+/*
+ * Store the value of a request, under the lock of the stripe.
+ */
+static void memstore_set(memstore_t *store, memstore_stripe_t *stripe,
+                         memstore_item_t **link, unsigned int hash,
+                         conn_req_t *req)
+{
+    memstore_item_t *item = *link;
+    char *val;
+
+    if(req->cas && (!item || item->cas != req->cas)){
+        req->status = item?CONN_NOTSTORED:CONN_MISS;
+        return;
+    }
+    if((req->op == CONN_ADD && item) || (req->op == CONN_APPEND && !item)){
+        req->status = CONN_NOTSTORED;
+        return;
+    }
+    if(req->op == CONN_APPEND){
+        val = (char*)realloc(item->val, item->len + req->len + 1);
+        if(!val){
+            return;
+        }
+        memcpy(val + item->len, req->val, req->len);
+        item->val = val;
+        item->len += req->len;
+    }else{
+        val = (char*)malloc(req->len + 1);
+        if(!val){
+            return;
+        }
+        memcpy(val, req->val, req->len);
+        if(!item){
+            item = (memstore_item_t*)calloc(1, sizeof(memstore_item_t));
+            if(item){
+                item->key = (char*)malloc(req->keylen);
+            }
+            if(!item || !item->key){
+                free(item);
+                free(val);
+                return;
+            }
+            memcpy(item->key, req->key, req->keylen);
+            item->keylen = req->keylen;
+            item->hash = hash;
+            *link = item;
+            stripe->count++;
+        }
+        free(item->val);
+        item->val = val;
+        item->len = req->len;
+        item->flags = req->flags;
+    }
+    item->cas = __sync_add_and_fetch(&store->cas, 1);
+    req->status = CONN_OK;
+}
+
+/*
+ * Run a batch of requests, filling in their status and results like
+ * conn_exec() does.
+ */
+void memstore_exec(memstore_t *store, conn_req_t *reqs, size_t n)
+{
+    memstore_stripe_t *stripe;
+    memstore_item_t **link;
+    memstore_item_t *item;
+    conn_req_t *req;
+    unsigned int hash;
+    size_t i;
+
+    for(i=0; i<n; i++){
+        req = &reqs[i];
+        req->status = CONN_ERROR;
+        req->data = NULL;
+        req->bytes = 0;
+        if(req->op == CONN_GET || req->op == CONN_STAT){
+            req->cas = 0;
+            req->flags = 0;
+        }
+        hash = memstore_hash(req->key, req->keylen);
+        stripe = &store->stripes[hash % MEMSTORE_STRIPES];
+        pthread_mutex_lock(&stripe->mutex);
+        link = memstore_find(stripe, hash, req->key, req->keylen);
+        item = *link;
+        switch(req->op){
+        case CONN_GET:
+        case CONN_STAT:
+            if(item){
+                memstore_get(item, req);
+            }else{
+                req->status = CONN_MISS;
+            }
+            break;
+        case CONN_DELETE:
+            if(!item){
+                req->status = CONN_MISS;
+            }else if(req->cas && item->cas != req->cas){
+                req->status = CONN_NOTSTORED;
+            }else{
+                *link = item->next;
+                stripe->count--;
+                memstore_item_free(item);
+                req->status = CONN_OK;
+            }
+            break;
+        default:
+            memstore_set(store, stripe, link, hash, req);
+            if(stripe->count > stripe->nbuckets){
+                memstore_grow(stripe);
+            }
+        }
+        pthread_mutex_unlock(&stripe->mutex);
+    }
+}
+
+/*
+ * Call fn with the key and value size of every item, a stripe at a
+ * time and under its lock, until it returns non-zero. Returns what fn
+ * returned last.
+ */
+int memstore_list(memstore_t *store, memstore_list_fn fn, void *arg)
+{
+    memstore_stripe_t *stripe;
+    memstore_item_t *item;
+    unsigned int i;
+    size_t j;
+    int ret = 0;
+
+    for(i=0; i<MEMSTORE_STRIPES && !ret; i++){
+        stripe = &store->stripes[i];
+        pthread_mutex_lock(&stripe->mutex);
+        for(j=0; j<stripe->nbuckets && !ret; j++){
+            for(item = stripe->buckets[j]; item && !ret; item = item->next){
+                ret = fn(item->key, item->keylen, item->len, arg);
+            }
+        }
+        pthread_mutex_unlock(&stripe->mutex);
+    }
+    return ret;
+}
+
+/*
+ * The memory backend: a memstore per server of the mount, each server
+ * naming a shard of the key space rather than a host. Nothing leaves the
+ * process, which makes it a baseline for the cost of the filesystem
+ * itself, and a scratch filesystem lasting as long as the mount.
+ */
+
+static void *memstore_server_new(server_t *server)
+{
+    return memstore_new();
+}
+
+static void memstore_server_free(void *server)
+{
+    memstore_free((memstore_t*)server);
+}
+
+static conn_t *memstore_open(void *server)
+{
+    memstore_conn_t *conn;
+
+    conn = (memstore_conn_t*)malloc(sizeof(memstore_conn_t));
+    if(!conn){
+        return NULL;
+    }
+    memset(conn, 0, sizeof(memstore_conn_t));
+    conn->conn.backend = &memstore_backend;
+    conn->store = (memstore_t*)server;
+    return &conn->conn;
+}
+
+static void memstore_close(conn_t *c)
+{
+    memstore_conn_t *conn = (memstore_conn_t*)c;
+
+    free(conn->keys);
+    conn->keys = NULL;
+    conn->len = 0;
+    conn->size = 0;
+    conn->pos = 0;
+}
+
+static void memstore_conn_free(conn_t *c)
+{
+    memstore_close(c);
+    free(c);
+}
+
+static int memstore_conn_exec(conn_t *c, conn_req_t *reqs, size_t n)
+{
+    memstore_exec(((memstore_conn_t*)c)->store, reqs, n);
+    return 0;
+}
+
+static int memstore_snap(const char *key, size_t keylen, size_t len,
+                         void *arg)
+{
+    memstore_conn_t *conn = (memstore_conn_t*)arg;
+    size_t need = conn->len + sizeof(size_t) + keylen + 1;
+    size_t size;
+    char *keys;
+
+    if(need > conn->size){
+        size = conn->size ? conn->size : 4096;
+        while(size < need){
+            size *= 2;
+        }
+        keys = (char*)realloc(conn->keys, size);
+        if(!keys){
+            return -ENOMEM;
+        }
+        conn->keys = keys;
+        conn->size = size;
+    }
+    memcpy(conn->keys + conn->len, &len, sizeof(size_t));
+    conn->len += sizeof(size_t);
+    memcpy(conn->keys + conn->len, key, keylen);
+    conn->len += keylen;
+    conn->keys[conn->len++] = '\0';
+    return 0;
+}
+
+static int memstore_list_start(conn_t *c)
+{
+    memstore_conn_t *conn = (memstore_conn_t*)c;
+    int ret;
+
+    memstore_close(c);
+    ret = memstore_list(conn->store, memstore_snap, conn);
+    if(ret){
+        memstore_close(c);
+    }
+    return ret;
+}
+
+static int memstore_list_next(conn_t *c, char *key, size_t size,
+                              ssize_t *len)
+{
+    memstore_conn_t *conn = (memstore_conn_t*)c;
+    size_t bytes;
+    size_t keylen;
+
+    if(conn->pos >= conn->len){
+        return 0;
+    }
+    memcpy(&bytes, conn->keys + conn->pos, sizeof(size_t));
+    conn->pos += sizeof(size_t);
+    keylen = strlen(conn->keys + conn->pos);
+    if(keylen >= size){
+        return -EIO;
+    }
+    memcpy(key, conn->keys + conn->pos, keylen + 1);
+    conn->pos += keylen + 1;
+    *len = bytes;
+    return 1;
+}
+
+static void memstore_list_end(conn_t *c, int done)
+{
+    memstore_close(c);
+}
+
+const conn_backend_t memstore_backend = {
+    "memory",
+    memstore_server_new,
+    memstore_server_free,
+    memstore_open,
+    memstore_conn_free,
+    memstore_close,
+    memstore_conn_exec,
+    memstore_list_start,
+    memstore_list_next,
+    memstore_list_end,
+};
@@ -0,0 +1,66 @@
+/*
+ * memstore.h - in-memory item store
+ * Copyright (C) 2012 Benoit Vidis <contact@benoitvidis.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+// each stripe has its own lock and table, picked by the hash of the key
+#define MEMSTORE_STRIPES 64
+// buckets of a stripe to begin with, doubled when it holds more items
+#define MEMSTORE_BUCKETS 64
+
+typedef struct memstore_item{
+    struct memstore_item *next;
+    unsigned int hash;
+    char *key;
+    size_t keylen;
+    char *val;
+    size_t len;
+    unsigned int flags;
+    unsigned long long cas;
+}memstore_item_t;
+
+typedef struct{
+    memstore_item_t **buckets;
+    size_t nbuckets;
+    size_t count;
+    pthread_mutex_t mutex;
+}memstore_stripe_t;
+
+typedef struct{
+    memstore_stripe_t stripes[MEMSTORE_STRIPES];
+    unsigned long long cas;     // last one given
+}memstore_t;
+
+typedef int (*memstore_list_fn)(const char *key, size_t keylen, size_t len,
+                                void *arg);
+
+memstore_t *memstore_new(void);
+void memstore_free(memstore_t *store);
+void memstore_exec(memstore_t *store, conn_req_t *reqs, size_t n);
+int memstore_list(memstore_t *store, memstore_list_fn fn, void *arg);
+
+// a connection of the memory backend
+typedef struct{
+    conn_t conn;
+    memstore_t *store;
+    // listing in progress: records of the value size then the key and its
+    // NUL, taken at the start of the listing
+    char *keys;
+    size_t len;
+    size_t size;
+    size_t pos;
+}memstore_conn_t;
@@ -0,0 +1,169 @@
+/*
+ * meta.c - file metadata records
+ * Copyright (C) 2012 Benoit Vidis <contact@benoitvidis.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+/*
+ * The metadata of a file is kept in a small sidecar item next to its
+ * value, so that getattr only has to transfer a few bytes whatever the
+ * size of the file. The record is a single text line:
+ *
+ *   <size> <mtime> <mode> <generation> [<chunk size> [<inode>]]
+ *
+ * The generation is bumped by every store and lets other parts of the
+ * filesystem tell whether a value changed without fetching it. The chunk
+ * size is only present for files split into several items (see chunk.c).
+ *
+ * The value of a file is stored under its name, unless the record gives
+ * an inode: the value and its chunks are then under the key of the
+ * inode, and renaming the file only moves the record.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include "memcachefs.h"
+#include "conn.h"
+#include "meta.h"
+
+int meta_key(const char *key, char *buf, size_t size)
+{
+    int len;
+
+    len = snprintf(buf, size, "%s%s", META_PREFIX, key);
+    if(len < 0 || len >= size || len > MEMCACHEFS_KEY_MAX){
+        return -1;
+    }
+    return len;
+}
+
+int meta_is_key(const char *key)
+{
+    return !strncmp(key, META_PREFIX, strlen(META_PREFIX));
+}
+
+/*
+ * Key the value of the file key is stored under, in buf when it is the
+ * one of its inode.
+ */
+const char *meta_data_key(const char *key, const attr_t *attr, char *buf)
+{
+    if(!attr || !attr->ino){
+        return key;
+    }
+    snprintf(buf, META_INODE_KEY_MAX, "%s%016llx", META_INODE_PREFIX,
+             attr->ino);
+    return buf;
+}
+
+int meta_encode(const attr_t *attr, char *buf, size_t size)
+{
+    int len;
+
+    if(attr->ino){
+        len = snprintf(buf, size, "%zu %ld %o %u %zu %llx", attr->size,
+                       (long)attr->mtime, (unsigned int)attr->mode, attr->gen,
+                       attr->chunk, attr->ino);
+    }else if(attr->chunk){
+        len = snprintf(buf, size, "%zu %ld %o %u %zu", attr->size,
+                       (long)attr->mtime, (unsigned int)attr->mode, attr->gen,
+                       attr->chunk);
+    }else{
+        len = snprintf(buf, size, "%zu %ld %o %u", attr->size,
+                       (long)attr->mtime, (unsigned int)attr->mode, attr->gen);
+    }
+    if(len < 0 || len >= size){
+        return -1;
+    }
+    return len;
+}
+
+int meta_decode(const char *buf, size_t len, attr_t *attr)
+{
+    char line[META_RECORD_MAX];
+    long mtime;
+    unsigned int mode;
+
+    if(len >= sizeof(line)){
+        return -1;
+    }
+    memcpy(line, buf, len);
+    line[len] = '\0';
+    attr->chunk = 0;
+    attr->ino = 0;
+    if(sscanf(line, "%zu %ld %o %u %zu %llx", &attr->size, &mtime, &mode,
+              &attr->gen, &attr->chunk, &attr->ino) < 4){
+        return -1;
+    }
+    attr->mtime = mtime;
+    attr->mode = mode;
+    return 0;
+}
+
+int meta_fetch(conn_t *conn, const char *key, attr_t *attr)
+{
+    char mkey[MEMCACHEFS_KEY_MAX + 1];
+    int mkeylen;
+    void *val;
+    size_t vallen;
+    int ret;
+
+    mkeylen = meta_key(key, mkey, sizeof(mkey));
+    if(mkeylen < 0){
+        return -1;
+    }
+    val = conn_get(conn, mkey, &vallen);
+    if(!val){
+        return -1;
+    }
+    ret = meta_decode(val, vallen, attr);
+    free(val);
+    return ret;
+}
+
+int meta_store(conn_t *conn, const char *key, const attr_t *attr,
+               int overwrite)
+{
+    char mkey[MEMCACHEFS_KEY_MAX + 1];
+    int mkeylen;
+    char record[META_RECORD_MAX];
+    int len;
+
+    mkeylen = meta_key(key, mkey, sizeof(mkey));
+    if(mkeylen < 0){
+        return -1;
+    }
+    len = meta_encode(attr, record, sizeof(record));
+    if(len < 0){
+        return -1;
+    }
+    return conn_store(conn, overwrite?CONN_SET:CONN_ADD, mkey, record, len);
+}
+
+int meta_delete(conn_t *conn, const char *key)
+{
+    char mkey[MEMCACHEFS_KEY_MAX + 1];
+    int mkeylen;
+
+    mkeylen = meta_key(key, mkey, sizeof(mkey));
+    if(mkeylen < 0){
+        return -1;
+    }
+    return conn_delete(conn, mkey);
+}
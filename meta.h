@@ -0,0 +1,34 @@
+/*
+ * meta.h - file metadata records
+ * Copyright (C) 2012 Benoit Vidis <contact@benoitvidis.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#define META_PREFIX MEMCACHEFS_RESERVED "meta:"
+#define META_INODE_PREFIX MEMCACHEFS_RESERVED "ino:"
+#define META_RECORD_MAX 128
+// key of an inode: the prefix and 16 hex digits
+#define META_INODE_KEY_MAX 32
+
+int meta_key(const char *key, char *buf, size_t size);
+int meta_is_key(const char *key);
+const char *meta_data_key(const char *key, const attr_t *attr, char *buf);
+int meta_encode(const attr_t *attr, char *buf, size_t size);
+int meta_decode(const char *buf, size_t len, attr_t *attr);
+int meta_fetch(conn_t *conn, const char *key, attr_t *attr);
+int meta_store(conn_t *conn, const char *key, const attr_t *attr,
+               int overwrite);
+int meta_delete(conn_t *conn, const char *key);
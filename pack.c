@@ -0,0 +1,289 @@
+/*
+ * pack.c - compression of stored values
+ * Copyright (C) 2012 Benoit Vidis <contact@benoitvidis.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+/*
+ * Single values may be stored packed with LZ4 or zstd, when memcachefs is
+ * built with them. A packed value is marked by a PACK_FLAG_ item flag and
+ * starts with its unpacked length, so it can be read back whatever the
+ * options of the mount reading it. Values below `min' bytes, or which do
+ * not shrink by an eighth, are stored raw. After PACK_PROBE values in a
+ * row did not pack, only one in PACK_PROBE is tried until one does: a run
+ * of already compressed files then costs little CPU.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#if defined(HAVE_LIBLZ4) && defined(HAVE_LZ4_H)
+#define PACK_LZ4_BUILT
+#include <lz4.h>
+#endif
+#if defined(HAVE_LIBZSTD) && defined(HAVE_ZSTD_H)
+#define PACK_ZSTD_BUILT
+#include <zstd.h>
+#endif
+#include "memcachefs.h"
+#include "pack.h"
+
+// zstd level, fast enough to keep up with the network
+#define PACK_ZSTD_LEVEL 3
+
+static unsigned long long pack_clock(void)
+{
+    struct timespec ts;
+
+    if(clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts)){
+        return 0;
+    }
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Returns the PACK_ algorithm called name, -1 when it is unknown or was
+ * not built in.
+ */
+int pack_algo(const char *name)
+{
+    if(!strcmp(name, "none")){
+        return PACK_NONE;
+    }
+#ifdef PACK_LZ4_BUILT
+    if(!strcmp(name, "lz4")){
+        return PACK_LZ4;
+    }
+#endif
+#ifdef PACK_ZSTD_BUILT
+    if(!strcmp(name, "zstd")){
+        return PACK_ZSTD;
+    }
+#endif
+    return -1;
+}
+
+pack_t *pack_new(int algo, size_t min)
+{
+    pack_t *pack;
+
+    pack = (pack_t*)calloc(1, sizeof(pack_t));
+    if(!pack){
+        return NULL;
+    }
+    pack->algo = algo;
+    pack->min = min;
+    pthread_mutex_init(&pack->mutex, NULL);
+    return pack;
+}
+
+void pack_free(pack_t *pack)
+{
+    pthread_mutex_destroy(&pack->mutex);
+    free(pack);
+}
+
+/*
+ * Worth trying to pack a value of len bytes?
+ */
+static int pack_try(pack_t *pack, size_t len)
+{
+    int ret = 1;
+
+    if(pack->algo == PACK_NONE || len < pack->min ||
+       len >= MEMCACHEFS_ITEM_MAX){
+        return 0;
+    }
+    pthread_mutex_lock(&pack->mutex);
+    if(pack->misses >= PACK_PROBE &&
+       (pack->misses - PACK_PROBE) % PACK_PROBE){
+        pack->misses++;
+        pack->skipped++;
+        ret = 0;
+    }
+    pthread_mutex_unlock(&pack->mutex);
+    return ret;
+}
+
+/*
+ * Pack len bytes of buf. Returns the packed value, with its length in
+ * packed and its item flags in flags, or NULL when buf is to be stored
+ * as it is.
+ */
+char *pack_value(pack_t *pack, const char *buf, size_t len, size_t *packed,
+                 unsigned int *flags)
+{
+    char *out;
+    size_t bound = 0;
+    size_t n = 0;
+    unsigned long long start;
+
+    *flags = 0;
+    if(!pack_try(pack, len)){
+        return NULL;
+    }
+#ifdef PACK_LZ4_BUILT
+    if(pack->algo == PACK_LZ4){
+        bound = LZ4_compressBound(len);
+    }
+#endif
+#ifdef PACK_ZSTD_BUILT
+    if(pack->algo == PACK_ZSTD){
+        bound = ZSTD_compressBound(len);
+    }
+#endif
+    out = (char*)malloc(PACK_HEADER + bound);
+    if(!out){
+        return NULL;
+    }
+    start = pack_clock();
+#ifdef PACK_LZ4_BUILT
+    if(pack->algo == PACK_LZ4){
+        n = LZ4_compress_default(buf, out + PACK_HEADER, len, bound);
+        *flags = PACK_FLAG_LZ4;
+    }
+#endif
+#ifdef PACK_ZSTD_BUILT
+    if(pack->algo == PACK_ZSTD){
+        n = ZSTD_compress(out + PACK_HEADER, bound, buf, len,
+                          PACK_ZSTD_LEVEL);
+        if(ZSTD_isError(n)){
+            n = 0;
+        }
+        *flags = PACK_FLAG_ZSTD;
+    }
+#endif
+
+    pthread_mutex_lock(&pack->mutex);
+    pack->pack_ns += pack_clock() - start;
+    if(!n || PACK_HEADER + n > len - len / PACK_SAVING){
+        pack->misses++;
+        pack->bypassed++;
+        pthread_mutex_unlock(&pack->mutex);
+        free(out);
+        *flags = 0;
+        return NULL;
+    }
+    pack->misses = 0;
+    pack->packed++;
+    pack->bytes_in += len;
+    pack->bytes_out += PACK_HEADER + n;
+    pthread_mutex_unlock(&pack->mutex);
+
+    out[0] = len & 0xff;
+    out[1] = (len >> 8) & 0xff;
+    out[2] = (len >> 16) & 0xff;
+    out[3] = (len >> 24) & 0xff;
+    *packed = PACK_HEADER + n;
+    return out;
+}
+
+/*
+ * Returns the unpacked length of a packed value from its first len
+ * bytes, -1 when they can't be one.
+ */
+long pack_length(const char *buf, size_t len)
+{
+    const unsigned char *b = (const unsigned char*)buf;
+    unsigned long n;
+
+    if(len < PACK_HEADER){
+        return -1;
+    }
+    n = b[0] | b[1] << 8 | b[2] << 16 | (unsigned long)b[3] << 24;
+    return (n < MEMCACHEFS_ITEM_MAX)?(long)n:-1;
+}
+
+/*
+ * Unpack a value stored with the given item flags. Returns the value,
+ * with its length in unpacked, or NULL when it is corrupt or packed with
+ * an algorithm which was not built in.
+ */
+char *pack_unpack(pack_t *pack, const char *buf, size_t len,
+                  unsigned int flags, size_t *unpacked)
+{
+    char *out;
+    long n;
+    long got = -1;
+    unsigned long long start;
+
+    n = pack_length(buf, len);
+    if(n < 0){
+        return NULL;
+    }
+    out = (char*)malloc(n?n:1);
+    if(!out){
+        return NULL;
+    }
+    start = pack_clock();
+#ifdef PACK_LZ4_BUILT
+    if(flags & PACK_FLAG_LZ4){
+        got = LZ4_decompress_safe(buf + PACK_HEADER, out,
+                                  len - PACK_HEADER, n);
+    }
+#endif
+#ifdef PACK_ZSTD_BUILT
+    if(flags & PACK_FLAG_ZSTD){
+        size_t ret = ZSTD_decompress(out, n, buf + PACK_HEADER,
+                                     len - PACK_HEADER);
+        got = ZSTD_isError(ret)?-1:(long)ret;
+    }
+#endif
+    pthread_mutex_lock(&pack->mutex);
+    pack->unpack_ns += pack_clock() - start;
+    if(got == n){
+        pack->unpacked++;
+    }
+    pthread_mutex_unlock(&pack->mutex);
+    if(got != n){
+        free(out);
+        return NULL;
+    }
+    *unpacked = n;
+    return out;
+}
+
+void pack_stats(pack_t *pack, FILE *fp)
+{
+    fprintf(fp, "packing: %lu packed, %lu stored raw, %lu not tried, "
+            "%llu bytes in %llu out, %llu us\n",
+            pack->packed, pack->bypassed, pack->skipped, pack->bytes_in,
+            pack->bytes_out, pack->pack_ns / 1000);
+    fprintf(fp, "unpacking: %lu unpacked, %llu us\n", pack->unpacked,
+            pack->unpack_ns / 1000);
+}
+
+/*
+ * The counters as "<name> <value>" lines, for the statistics file.
+ */
+void pack_counters(pack_t *pack, FILE *fp)
+{
+    fprintf(fp, "pack.packed %lu\n", pack->packed);
+    fprintf(fp, "pack.raw %lu\n", pack->bypassed);
+    fprintf(fp, "pack.skipped %lu\n", pack->skipped);
+    fprintf(fp, "pack.bytes_in %llu\n", pack->bytes_in);
+    fprintf(fp, "pack.bytes_out %llu\n", pack->bytes_out);
+    fprintf(fp, "pack.cpu_ns %llu\n", pack->pack_ns);
+    fprintf(fp, "pack.unpacked %lu\n", pack->unpacked);
+    fprintf(fp, "pack.unpack_cpu_ns %llu\n", pack->unpack_ns);
+}
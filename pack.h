@@ -0,0 +1,63 @@
+/*
+ * pack.h - compression of stored values
+ * Copyright (C) 2012 Benoit Vidis <contact@benoitvidis.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+// item flags marking a packed value, above the low bits other memcached
+// clients use for their own encodings
+#define PACK_FLAG_LZ4 0x10000
+#define PACK_FLAG_ZSTD 0x20000
+#define PACK_FLAGS (PACK_FLAG_LZ4 | PACK_FLAG_ZSTD)
+// the unpacked length, little endian, in front of the packed bytes
+#define PACK_HEADER 4
+// values stored raw unless packing saves an eighth of them
+#define PACK_SAVING 8
+// after this many values in a row did not pack, only try one in so many
+#define PACK_PROBE 16
+
+enum{
+    PACK_NONE,
+    PACK_LZ4,
+    PACK_ZSTD,
+};
+
+typedef struct{
+    int algo;
+    size_t min;                 // smaller values are stored raw
+    unsigned int misses;        // values in a row that did not pack
+    // counters
+    unsigned long packed;
+    unsigned long bypassed;     // tried and stored raw
+    unsigned long skipped;      // not tried after too many misses
+    unsigned long unpacked;
+    unsigned long long bytes_in;    // of the values packed, before
+    unsigned long long bytes_out;   // and after
+    unsigned long long pack_ns;     // thread CPU time
+    unsigned long long unpack_ns;
+    pthread_mutex_t mutex;
+}pack_t;
+
+int pack_algo(const char *name);
+pack_t *pack_new(int algo, size_t min);
+void pack_free(pack_t *pack);
+char *pack_value(pack_t *pack, const char *buf, size_t len, size_t *packed,
+                 unsigned int *flags);
+long pack_length(const char *buf, size_t len);
+char *pack_unpack(pack_t *pack, const char *buf, size_t len,
+                  unsigned int flags, size_t *unpacked);
+void pack_stats(pack_t *pack, FILE *fp);
+void pack_counters(pack_t *pack, FILE *fp);
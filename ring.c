@@ -0,0 +1,168 @@
+/*
+ * ring.c - consistent hashing of the keys over the servers
+ * Copyright (C) 2012 Benoit Vidis <contact@benoitvidis.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+/*
+ * Ketama style continuum: every server is given RING_POINTS points per
+ * unit of weight, at the hashes of "<host>:<port>-<n>". A key belongs to
+ * the first point at or after its own hash. Adding a server only moves
+ * the keys that fall just before its points, about 1/n of them.
+ *
+ * The hash is a 32 bit FNV-1a with a final avalanche, not the md5 of
+ * libmemcached, so the placement differs from other ketama clients.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include "memcachefs.h"
+#include "ring.h"
+
+static unsigned int ring_hash(const char *key)
+{
+    unsigned int hash = 2166136261U;
+
+    while(*key){
+        hash ^= (unsigned char)*key++;
+        hash *= 16777619U;
+    }
+    hash ^= hash >> 16;
+    hash *= 0x85ebca6bU;
+    hash ^= hash >> 13;
+    hash *= 0xc2b2ae35U;
+    hash ^= hash >> 16;
+    return hash;
+}
+
+static int ring_point_cmp(const void *a, const void *b)
+{
+    const ring_point_t *pa = (const ring_point_t*)a;
+    const ring_point_t *pb = (const ring_point_t*)b;
+
+    if(pa->hash != pb->hash){
+        return (pa->hash < pb->hash)?-1:1;
+    }
+    return (pa->server < pb->server)?-1:(pa->server > pb->server);
+}
+
+ring_t *ring_new(const server_t *servers, unsigned int nservers)
+{
+    unsigned int i;
+    unsigned int j;
+    size_t n = 0;
+    char name[MEMCACHEFS_KEY_MAX + 32];
+    ring_t *ring;
+
+    ring = (ring_t*)malloc(sizeof(ring_t));
+    if(!ring){
+        return NULL;
+    }
+    memset(ring, 0, sizeof(ring_t));
+    ring->nservers = nservers;
+    for(i=0; i<nservers; i++){
+        ring->npoints += RING_POINTS * servers[i].weight;
+    }
+    ring->points = (ring_point_t*)malloc(sizeof(ring_point_t) *
+                                         (ring->npoints + 1));
+    if(!ring->points){
+        free(ring);
+        return NULL;
+    }
+    for(i=0; i<nservers; i++){
+        for(j=0; j<RING_POINTS * servers[i].weight; j++){
+            snprintf(name, sizeof(name), "%s:%s-%u",
+                     servers[i].host, servers[i].port, j);
+            ring->points[n].hash = ring_hash(name);
+            ring->points[n].server = i;
+            n++;
+        }
+    }
+    qsort(ring->points, n, sizeof(ring_point_t), ring_point_cmp);
+    return ring;
+}
+
+void ring_free(ring_t *ring)
+{
+    free(ring->points);
+    free(ring);
+}
+
+/*
+ * Position of the first point at or after the hash of key.
+ */
+static size_t ring_find(const ring_t *ring, const char *key)
+{
+    unsigned int hash;
+    size_t low = 0;
+    size_t high = ring->npoints;
+    size_t mid;
+
+    hash = ring_hash(key);
+    while(low < high){
+        mid = low + (high - low) / 2;
+        if(ring->points[mid].hash < hash){
+            low = mid + 1;
+        }else{
+            high = mid;
+        }
+    }
+    return (low == ring->npoints)?0:low;
+}
+
+/*
+ * Index of the server holding key.
+ */
+unsigned int ring_lookup(const ring_t *ring, const char *key)
+{
+    if(ring->nservers < 2){
+        return 0;
+    }
+    return ring->points[ring_find(ring, key)].server;
+}
+
+/*
+ * Fill servers with up to n distinct servers for key, the one holding it
+ * first and then the next ones along the ring. Returns how many.
+ */
+unsigned int ring_lookup_n(const ring_t *ring, const char *key,
+                           unsigned int *servers, unsigned int n)
+{
+    size_t pos;
+    size_t i;
+    unsigned int j;
+    unsigned int count = 0;
+    unsigned int server;
+
+    if(n > ring->nservers){
+        n = ring->nservers;
+    }
+    if(ring->nservers < 2){
+        servers[0] = 0;
+        return n;
+    }
+    pos = ring_find(ring, key);
+    for(i=0; i<ring->npoints && count<n; i++){
+        server = ring->points[(pos + i) % ring->npoints].server;
+        for(j=0; j<count && servers[j] != server; j++);
+        if(j == count){
+            servers[count++] = server;
+        }
+    }
+    return count;
+}
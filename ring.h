@@ -0,0 +1,38 @@
+/*
+ * ring.h - consistent hashing of the keys over the servers
+ * Copyright (C) 2012 Benoit Vidis <contact@benoitvidis.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+// points on the ring for each unit of weight of a server
+#define RING_POINTS 160
+
+typedef struct{
+    unsigned int hash;
+    unsigned int server;
+}ring_point_t;
+
+typedef struct{
+    ring_point_t *points;
+    size_t npoints;
+    unsigned int nservers;
+}ring_t;
+
+ring_t *ring_new(const server_t *servers, unsigned int nservers);
+void ring_free(ring_t *ring);
+unsigned int ring_lookup(const ring_t *ring, const char *key);
+unsigned int ring_lookup_n(const ring_t *ring, const char *key,
+                           unsigned int *servers, unsigned int n);
@@ -0,0 +1,173 @@
+/*
+ * stats.c - counters and latency histograms
+ * Copyright (C) 2012 Benoit Vidis <contact@benoitvidis.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+/*
+ * Counters of the whole mount, and a latency histogram for each timer,
+ * updated with atomic adds so that they can be left on. The histograms
+ * are log-linear, as HdrHistogram's: every power of two is split in
+ * STATS_SUB buckets, which keeps percentiles within an eighth of the
+ * actual value. They are read through the STATS_PATH file of the mount,
+ * one "<name> <value>" line each.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/types.h>
+#include "stats.h"
+
+static stats_timer_t stats_timers[STATS_TIMERS];
+static unsigned long long stats_counters[STATS_COUNTERS];
+
+static const char *stats_timer_names[STATS_TIMERS] = {
+    "op.getattr",
+    "op.open",
+    "op.read",
+    "op.write",
+    "op.flush",
+    "op.readdir",
+    "op.rename",
+    "backend.rtt",
+    "handle.wait",
+};
+
+static const char *stats_counter_names[STATS_COUNTERS] = {
+    "cache.attr.hits",
+    "cache.attr.misses",
+    "cache.value.hits",
+    "cache.value.misses",
+    "wire.bytes_sent",
+    "wire.bytes_received",
+};
+
+unsigned long long stats_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static unsigned int stats_bucket(unsigned long long ns)
+{
+    unsigned int exp;
+
+    if(ns < STATS_SUB * 2){
+        return ns;
+    }
+    if(ns >> 40){
+        return STATS_BUCKETS - 1;
+    }
+    exp = 63 - __builtin_clzll(ns);
+    return STATS_SUB * 2 + (exp - STATS_SUB_BITS - 1) * STATS_SUB +
+           ((ns >> (exp - STATS_SUB_BITS)) & (STATS_SUB - 1));
+}
+
+/*
+ * Highest value counted in a bucket.
+ */
+static unsigned long long stats_bucket_max(unsigned int bucket)
+{
+    unsigned int exp;
+    unsigned int sub;
+
+    if(bucket < STATS_SUB * 2){
+        return bucket;
+    }
+    exp = (bucket - STATS_SUB * 2) / STATS_SUB + STATS_SUB_BITS + 1;
+    sub = (bucket - STATS_SUB * 2) % STATS_SUB;
+    return ((unsigned long long)(STATS_SUB + sub + 1) <<
+            (exp - STATS_SUB_BITS)) - 1;
+}
+
+/*
+ * Count an event of timer which began at start, from stats_now().
+ */
+void stats_time(int timer, unsigned long long start, int error)
+{
+    stats_timer_t *t = &stats_timers[timer];
+    unsigned long long ns = stats_now() - start;
+    unsigned long long max;
+
+    __sync_fetch_and_add(&t->count, 1);
+    __sync_fetch_and_add(&t->sum, ns);
+    __sync_fetch_and_add(&t->buckets[stats_bucket(ns)], 1);
+    if(error){
+        __sync_fetch_and_add(&t->errors, 1);
+    }
+    max = t->max;
+    while(ns > max && !__sync_bool_compare_and_swap(&t->max, max, ns)){
+        max = t->max;
+    }
+}
+
+void stats_add(int counter, unsigned long long n)
+{
+    __sync_fetch_and_add(&stats_counters[counter], n);
+}
+
+/*
+ * Value below which the given per mille of the events counted fell.
+ */
+static unsigned long long stats_percentile(const stats_timer_t *t,
+                                           unsigned long long count,
+                                           unsigned int permille)
+{
+    unsigned long long rank = (count * permille + 999) / 1000;
+    unsigned long long seen = 0;
+    unsigned long long value;
+    unsigned int i;
+
+    for(i=0; i<STATS_BUCKETS; i++){
+        seen += t->buckets[i];
+        if(seen >= rank && seen){
+            value = stats_bucket_max(i);
+            return (value < t->max)?value:t->max;
+        }
+    }
+    return t->max;
+}
+
+void stats_print(FILE *fp)
+{
+    static const unsigned int permilles[] = {500, 900, 990, 999};
+    static const char *labels[] = {"p50", "p90", "p99", "p999"};
+    const stats_timer_t *t;
+    unsigned long long count;
+    unsigned int i;
+    unsigned int j;
+
+    fprintf(fp, "# times in nanoseconds\n");
+    for(i=0; i<STATS_TIMERS; i++){
+        t = &stats_timers[i];
+        count = t->count;
+        fprintf(fp, "%s.count %llu\n", stats_timer_names[i], count);
+        fprintf(fp, "%s.errors %llu\n", stats_timer_names[i], t->errors);
+        fprintf(fp, "%s.sum %llu\n", stats_timer_names[i], t->sum);
+        for(j=0; j<sizeof(permilles) / sizeof(permilles[0]); j++){
+            fprintf(fp, "%s.%s %llu\n", stats_timer_names[i], labels[j],
+                    count?stats_percentile(t, count, permilles[j]):0);
+        }
+        fprintf(fp, "%s.max %llu\n", stats_timer_names[i], t->max);
+    }
+    for(i=0; i<STATS_COUNTERS; i++){
+        fprintf(fp, "%s %llu\n", stats_counter_names[i], stats_counters[i]);
+    }
+}
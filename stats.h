@@ -0,0 +1,64 @@
+/*
+ * stats.h - counters and latency histograms
+ * Copyright (C) 2012 Benoit Vidis <contact@benoitvidis.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+// the histogram of a timer is exact below 2^STATS_SUB_BITS nanoseconds,
+// then has 2^STATS_SUB_BITS buckets for each power of two up to 2^40
+#define STATS_SUB_BITS 3
+#define STATS_SUB (1 << STATS_SUB_BITS)
+#define STATS_BUCKETS (STATS_SUB * 2 + (40 - STATS_SUB_BITS - 1) * STATS_SUB)
+
+// where the statistics of a mount can be read
+#define STATS_DIR "/.memcachefs"
+#define STATS_PATH STATS_DIR "/stats"
+
+enum{
+    STATS_GETATTR,
+    STATS_OPEN,
+    STATS_READ,
+    STATS_WRITE,
+    STATS_FLUSH,
+    STATS_READDIR,
+    STATS_RENAME,
+    STATS_RTT,          // a batch of requests to a server and its replies
+    STATS_HANDLE_WAIT,  // a wait for a handle of an exhausted pool
+    STATS_TIMERS,
+};
+
+enum{
+    STATS_ATTR_HITS,
+    STATS_ATTR_MISSES,
+    STATS_VAL_HITS,
+    STATS_VAL_MISSES,
+    STATS_BYTES_SENT,
+    STATS_BYTES_RECEIVED,
+    STATS_COUNTERS,
+};
+
+typedef struct{
+    unsigned long long count;
+    unsigned long long errors;
+    unsigned long long sum;     // nanoseconds
+    unsigned long long max;
+    unsigned long long buckets[STATS_BUCKETS];
+}stats_timer_t;
+
+unsigned long long stats_now(void);
+void stats_time(int timer, unsigned long long start, int error);
+void stats_add(int counter, unsigned long long n);
+void stats_print(FILE *fp);
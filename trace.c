@@ -0,0 +1,361 @@
+/*
+ * trace.c - per-thread rings of binary trace records
+ * Copyright (C) 2012 Benoit Vidis <contact@benoitvidis.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+/*
+ * A record of each operation, cheap enough to be left on where -v is
+ * not: every thread adds to a ring of its own, without locks nor
+ * formatting, and the rings are only read when dumped. A ring has a
+ * single writer, which publishes a record by moving the head past it;
+ * the reader copies a ring and then drops the records that the writer
+ * may have overwritten meanwhile. Dumps are binary, turned into text by
+ * memcachefs-trace.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <sys/types.h>
+#include "trace.h"
+
+static const char *trace_op_names[TRACE_OPS] = {
+    "getattr",
+    "open",
+    "read",
+    "write",
+    "flush",
+    "release",
+    "readdir",
+    "mknod",
+    "mkdir",
+    "unlink",
+    "rmdir",
+    "truncate",
+    "rename",
+    "fsync",
+    "opendir",
+    "releasedir",
+    "chmod",
+    "chown",
+    "utime",
+    "link",
+    "symlink",
+    "readlink",
+};
+
+// the ring of the calling thread, once it has one
+static __thread trace_ring_t *trace_mine;
+
+// the trace dumped on SIGUSR1
+static trace_t *trace_signalled;
+
+/*
+ * FNV-1a, so that paths can be matched against records without being
+ * copied into them.
+ */
+uint32_t trace_hash(const char *path)
+{
+    uint32_t hash = 2166136261U;
+
+    while(*path){
+        hash ^= (unsigned char)*path++;
+        hash *= 16777619U;
+    }
+    return hash;
+}
+
+const char *trace_op_name(unsigned int op)
+{
+    return (op < TRACE_OPS)?trace_op_names[op]:"unknown";
+}
+
+/*
+ * Hand the ring of an exiting thread over to the next thread.
+ */
+static void trace_release(void *arg)
+{
+    trace_ring_t *ring = (trace_ring_t*)arg;
+
+    __atomic_store_n(&ring->free, 1, __ATOMIC_RELEASE);
+}
+
+trace_t *trace_new(unsigned int records, const char *file)
+{
+    trace_t *trace;
+    unsigned int n;
+
+    trace = (trace_t*)malloc(sizeof(trace_t));
+    if(!trace){
+        return NULL;
+    }
+    memset(trace, 0, sizeof(trace_t));
+    for(n = 1; n < records; n <<= 1);
+    trace->records = n;
+    if(file){
+        trace->file = strdup(file);
+        if(!trace->file){
+            free(trace);
+            return NULL;
+        }
+    }
+    if(pthread_key_create(&trace->key, trace_release)){
+        free(trace->file);
+        free(trace);
+        return NULL;
+    }
+    sem_init(&trace->signal, 0, 0);
+    pthread_mutex_init(&trace->mutex, NULL);
+    return trace;
+}
+
+void trace_free(trace_t *trace)
+{
+    unsigned int i;
+
+    trace_stop(trace);
+    pthread_key_delete(trace->key);
+    for(i=0; i<trace->nrings; i++){
+        free(trace->rings[i]);
+    }
+    sem_destroy(&trace->signal);
+    pthread_mutex_destroy(&trace->mutex);
+    free(trace->file);
+    free(trace);
+}
+
+/*
+ * Take the ring of a thread that exited, or a new one.
+ */
+static trace_ring_t *trace_ring(trace_t *trace)
+{
+    trace_ring_t *ring = NULL;
+    unsigned int i;
+
+    pthread_mutex_lock(&trace->mutex);
+    for(i=0; i<trace->nrings; i++){
+        if(__atomic_load_n(&trace->rings[i]->free, __ATOMIC_ACQUIRE)){
+            ring = trace->rings[i];
+            ring->free = 0;
+            break;
+        }
+    }
+    if(!ring && trace->nrings < TRACE_THREADS){
+        ring = (trace_ring_t*)calloc(1, sizeof(trace_ring_t) +
+                                     trace->records * sizeof(trace_rec_t));
+        if(ring){
+            ring->index = trace->nrings;
+            trace->rings[trace->nrings++] = ring;
+        }
+    }
+    pthread_mutex_unlock(&trace->mutex);
+    if(ring){
+        pthread_setspecific(trace->key, ring);
+    }
+    return ring;
+}
+
+void trace_add(trace_t *trace, unsigned int op, const char *path,
+               uint64_t offset, uint32_t size, uint64_t start, uint64_t end,
+               int result)
+{
+    trace_ring_t *ring = trace_mine;
+    trace_rec_t *rec;
+    uint64_t head;
+
+    if(!ring){
+        ring = trace_mine = trace_ring(trace);
+        if(!ring){
+            __sync_fetch_and_add(&trace->untraced, 1);
+            return;
+        }
+    }
+    head = ring->head;
+    rec = &ring->recs[head & (trace->records - 1)];
+    rec->start = start;
+    rec->end = end;
+    rec->offset = offset;
+    rec->path = trace_hash(path);
+    rec->size = size;
+    rec->result = result;
+    rec->op = op;
+    rec->thread = ring->index;
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Copy the records of a ring that were not overwritten while copying,
+ * oldest first, and return how many.
+ */
+static unsigned int trace_copy(trace_t *trace, trace_ring_t *ring,
+                               trace_rec_t *recs)
+{
+    uint64_t head;
+    uint64_t first;
+    uint64_t valid;
+    uint64_t i;
+
+    head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    first = (head > trace->records)?head - trace->records:0;
+    for(i = first; i < head; i++){
+        recs[i - first] = ring->recs[i & (trace->records - 1)];
+    }
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    // the writer may be filling the slot of the record after the head
+    valid = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) + 1;
+    valid = (valid > trace->records)?valid - trace->records:0;
+    if(valid <= first){
+        return head - first;
+    }
+    if(valid >= head){
+        return 0;
+    }
+    memmove(recs, recs + (valid - first),
+            (head - valid) * sizeof(trace_rec_t));
+    return head - valid;
+}
+
+/*
+ * Write a trace_header_t and the records of every ring, ring by ring.
+ */
+int trace_dump(trace_t *trace, FILE *fp)
+{
+    trace_header_t header;
+    trace_rec_t *recs;
+    trace_ring_t *rings[TRACE_THREADS];
+    unsigned int nrings;
+    unsigned int count = 0;
+    unsigned int i;
+    struct timespec ts;
+    int ret = 0;
+
+    pthread_mutex_lock(&trace->mutex);
+    nrings = trace->nrings;
+    memcpy(rings, trace->rings, nrings * sizeof(trace_ring_t*));
+    pthread_mutex_unlock(&trace->mutex);
+
+    recs = (trace_rec_t*)malloc(((size_t)nrings * trace->records + 1) *
+                                sizeof(trace_rec_t));
+    if(!recs){
+        return -1;
+    }
+    for(i=0; i<nrings; i++){
+        count += trace_copy(trace, rings[i], recs + count);
+    }
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+    header.rec_size = sizeof(trace_rec_t);
+    header.count = count;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    header.now = (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    header.wall = (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    if(fwrite(&header, sizeof(header), 1, fp) != 1 ||
+       (count && fwrite(recs, sizeof(trace_rec_t), count, fp) != count)){
+        ret = -1;
+    }
+    free(recs);
+    return ret;
+}
+
+static void trace_signal(int sig)
+{
+    if(trace_signalled){
+        sem_post(&trace_signalled->signal);
+    }
+}
+
+/*
+ * Dump to the trace file every time SIGUSR1 is received.
+ */
+static void *trace_run(void *arg)
+{
+    trace_t *trace = (trace_t*)arg;
+    char name[PATH_MAX];
+    FILE *fp;
+
+    while(1){
+        while(sem_wait(&trace->signal) && errno == EINTR);
+        if(trace->stop){
+            break;
+        }
+        if(trace->file){
+            snprintf(name, sizeof(name), "%s", trace->file);
+        }else{
+            snprintf(name, sizeof(name), TRACE_FILE, (int)getpid());
+        }
+        fp = fopen(name, "w");
+        if(!fp){
+            fprintf(stderr, "error: can't write the trace to %s\n", name);
+            continue;
+        }
+        if(trace_dump(trace, fp) | fclose(fp)){
+            fprintf(stderr, "error: can't write the trace to %s\n", name);
+            continue;
+        }
+        trace->dumps++;
+    }
+    return NULL;
+}
+
+int trace_start(trace_t *trace)
+{
+    struct sigaction sa;
+
+    if(trace->running){
+        return 0;
+    }
+    trace->stop = 0;
+    if(pthread_create(&trace->thread, NULL, trace_run, trace)){
+        return -1;
+    }
+    trace->running = 1;
+    trace_signalled = trace;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = trace_signal;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    return sigaction(SIGUSR1, &sa, NULL);
+}
+
+void trace_stop(trace_t *trace)
+{
+    if(!trace->running){
+        return;
+    }
+    signal(SIGUSR1, SIG_IGN);
+    trace_signalled = NULL;
+    trace->stop = 1;
+    sem_post(&trace->signal);
+    pthread_join(trace->thread, NULL);
+    trace->running = 0;
+}
+
+void trace_stats(trace_t *trace, FILE *fp)
+{
+    fprintf(fp, "trace: %u rings of %u records, %lu dumps, %lu untraced\n",
+            trace->nrings, trace->records, trace->dumps, trace->untraced);
+}
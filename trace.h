@@ -0,0 +1,110 @@
+/*
+ * trace.h - per-thread rings of binary trace records
+ * Copyright (C) 2012 Benoit Vidis <contact@benoitvidis.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+// where the dump of the rings of a mount can be read
+#define TRACE_PATH STATS_DIR "/trace"
+
+// written on SIGUSR1 when no file is given, with the pid of the mount
+#define TRACE_FILE "/tmp/memcachefs.%d.trace"
+
+// a dump starts with a trace_header_t of this magic, then its records
+#define TRACE_MAGIC "MCFSTRC1"
+
+// most threads with a ring of their own, later ones are not traced
+#define TRACE_THREADS 256
+
+enum{
+    TRACE_GETATTR,
+    TRACE_OPEN,
+    TRACE_READ,
+    TRACE_WRITE,
+    TRACE_FLUSH,
+    TRACE_RELEASE,
+    TRACE_READDIR,
+    TRACE_MKNOD,
+    TRACE_MKDIR,
+    TRACE_UNLINK,
+    TRACE_RMDIR,
+    TRACE_TRUNCATE,
+    TRACE_RENAME,       // offset holds the hash of the new path
+    TRACE_FSYNC,
+    TRACE_OPENDIR,
+    TRACE_RELEASEDIR,
+    TRACE_CHMOD,
+    TRACE_CHOWN,
+    TRACE_UTIME,
+    TRACE_LINK,         // offset holds the hash of the new path
+    TRACE_SYMLINK,      // path is the target, offset the hash of the link
+    TRACE_READLINK,
+    TRACE_OPS,
+};
+
+typedef struct{
+    uint64_t start;     // CLOCK_MONOTONIC nanoseconds
+    uint64_t end;
+    uint64_t offset;
+    uint32_t path;      // trace_hash() of the path
+    uint32_t size;
+    int32_t result;     // returned to FUSE, -errno on failure
+    uint16_t op;
+    uint16_t thread;    // ring the record was added to
+}trace_rec_t;
+
+typedef struct{
+    char magic[8];
+    uint32_t rec_size;  // sizeof(trace_rec_t), checked by the decoder
+    uint32_t count;     // records following
+    uint64_t now;       // CLOCK_MONOTONIC and CLOCK_REALTIME nanoseconds
+    uint64_t wall;      // at the time of the dump
+}trace_header_t;
+
+typedef struct{
+    uint64_t head;      // records ever added, written by the owner only
+    int free;           // its thread exited, another one may take it
+    unsigned int index;
+    trace_rec_t recs[];
+}trace_ring_t;
+
+typedef struct{
+    unsigned int records;       // per ring, a power of two
+    char *file;                 // written on SIGUSR1, NULL: TRACE_FILE
+    trace_ring_t *rings[TRACE_THREADS];
+    unsigned int nrings;
+    pthread_key_t key;
+    sem_t signal;
+    int stop;
+    int running;
+    pthread_t thread;
+    // counters
+    unsigned long dumps;
+    unsigned long untraced;     // records of threads without a ring
+    pthread_mutex_t mutex;
+}trace_t;
+
+uint32_t trace_hash(const char *path);
+const char *trace_op_name(unsigned int op);
+trace_t *trace_new(unsigned int records, const char *file);
+void trace_free(trace_t *trace);
+int trace_start(trace_t *trace);
+void trace_stop(trace_t *trace);
+void trace_add(trace_t *trace, unsigned int op, const char *path,
+               uint64_t offset, uint32_t size, uint64_t start, uint64_t end,
+               int result);
+int trace_dump(trace_t *trace, FILE *fp);
+void trace_stats(trace_t *trace, FILE *fp);
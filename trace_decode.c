@@ -0,0 +1,221 @@
+/*
+ * trace_decode.c - turn trace dumps into timelines
+ * Copyright (C) 2012 Benoit Vidis <contact@benoitvidis.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+/*
+ * memcachefs-trace [-s] [-p path]... dump
+ *
+ * Reads a dump of the trace rings, from TRACE_PATH of a mount or from the
+ * file written on SIGUSR1, and prints its records ordered by start time,
+ * one operation a line, with the wall clock time it started at. Paths are
+ * only recorded as hashes: those given with -p are printed by name. With
+ * -s, prints the count, errors, mean and max duration of each operation
+ * instead.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <sys/types.h>
+#include "trace.h"
+
+typedef struct{
+    uint32_t hash;
+    const char *path;
+}trace_name_t;
+
+static trace_name_t *names;
+static unsigned int nnames;
+
+static void usage(void)
+{
+    fprintf(stderr, "Usage: memcachefs-trace [-s] [-p path]... dump\n");
+}
+
+static int trace_decode_cmp(const void *a, const void *b)
+{
+    const trace_rec_t *ra = (const trace_rec_t*)a;
+    const trace_rec_t *rb = (const trace_rec_t*)b;
+
+    if(ra->start != rb->start){
+        return (ra->start < rb->start)?-1:1;
+    }
+    return (int)ra->thread - (int)rb->thread;
+}
+
+static const char *trace_decode_name(uint32_t hash, char *buf, size_t len)
+{
+    unsigned int i;
+
+    for(i=0; i<nnames; i++){
+        if(names[i].hash == hash){
+            return names[i].path;
+        }
+    }
+    snprintf(buf, len, "#%08x", hash);
+    return buf;
+}
+
+/*
+ * "<time> <thread> <op> <path> <offset> <size> <result> <us>" lines.
+ */
+static void trace_decode_timeline(trace_header_t *header, trace_rec_t *recs)
+{
+    unsigned int i;
+    uint64_t wall;
+    time_t sec;
+    struct tm tm;
+    char date[32];
+    char path[16];
+    char to[16];
+    const char *name;
+
+    printf("%-24s %6s %-10s %-32s %12s %8s %8s %10s\n", "start", "thread",
+           "op", "path", "offset", "size", "result", "us");
+    for(i=0; i<header->count; i++){
+        wall = header->wall - (header->now - recs[i].start);
+        sec = wall / 1000000000ULL;
+        localtime_r(&sec, &tm);
+        strftime(date, sizeof(date), "%Y-%m-%d %H:%M:%S", &tm);
+        name = trace_decode_name(recs[i].path, path, sizeof(path));
+        printf("%s.%06u %6u %-10s %-32s ", date,
+               (unsigned int)(wall % 1000000000ULL / 1000), recs[i].thread,
+               trace_op_name(recs[i].op), name);
+        if(recs[i].op == TRACE_RENAME || recs[i].op == TRACE_LINK ||
+           recs[i].op == TRACE_SYMLINK){
+            printf("%-21s", trace_decode_name(recs[i].offset, to,
+                                              sizeof(to)));
+        }else{
+            printf("%12llu %8u", (unsigned long long)recs[i].offset,
+                   recs[i].size);
+        }
+        printf(" %8d %10.3f\n", recs[i].result,
+               (recs[i].end - recs[i].start) / 1000.0);
+    }
+}
+
+static void trace_decode_summary(trace_header_t *header, trace_rec_t *recs)
+{
+    unsigned long count[TRACE_OPS];
+    unsigned long errors[TRACE_OPS];
+    uint64_t sum[TRACE_OPS];
+    uint64_t max[TRACE_OPS];
+    uint64_t ns;
+    unsigned int i;
+
+    memset(count, 0, sizeof(count));
+    memset(errors, 0, sizeof(errors));
+    memset(sum, 0, sizeof(sum));
+    memset(max, 0, sizeof(max));
+    for(i=0; i<header->count; i++){
+        if(recs[i].op >= TRACE_OPS){
+            continue;
+        }
+        ns = recs[i].end - recs[i].start;
+        count[recs[i].op]++;
+        errors[recs[i].op] += recs[i].result < 0;
+        sum[recs[i].op] += ns;
+        if(ns > max[recs[i].op]){
+            max[recs[i].op] = ns;
+        }
+    }
+    printf("%-10s %10s %8s %12s %12s\n", "op", "count", "errors", "mean us",
+           "max us");
+    for(i=0; i<TRACE_OPS; i++){
+        if(count[i]){
+            printf("%-10s %10lu %8lu %12.3f %12.3f\n", trace_op_name(i),
+                   count[i], errors[i], sum[i] / 1000.0 / count[i],
+                   max[i] / 1000.0);
+        }
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    int c;
+    int summary = 0;
+    FILE *fp;
+    trace_header_t header;
+    trace_rec_t *recs;
+
+    names = (trace_name_t*)calloc(argc, sizeof(trace_name_t));
+    if(!names){
+        perror("malloc()");
+        return EXIT_FAILURE;
+    }
+    while((c = getopt(argc, argv, "sp:")) != -1){
+        switch(c){
+        case 's':
+            summary = 1;
+            break;
+        case 'p':
+            names[nnames].hash = trace_hash(optarg);
+            names[nnames++].path = optarg;
+            break;
+        default:
+            usage();
+            return EXIT_FAILURE;
+        }
+    }
+    if(optind != argc - 1){
+        usage();
+        return EXIT_FAILURE;
+    }
+
+    fp = strcmp(argv[optind], "-")?fopen(argv[optind], "r"):stdin;
+    if(!fp){
+        perror(argv[optind]);
+        return EXIT_FAILURE;
+    }
+    if(fread(&header, sizeof(header), 1, fp) != 1 ||
+       memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic))){
+        fprintf(stderr, "%s: not a trace dump\n", argv[optind]);
+        return EXIT_FAILURE;
+    }
+    if(header.rec_size != sizeof(trace_rec_t)){
+        fprintf(stderr, "%s: records of %u bytes, expected %u\n",
+                argv[optind], header.rec_size,
+                (unsigned int)sizeof(trace_rec_t));
+        return EXIT_FAILURE;
+    }
+    recs = (trace_rec_t*)malloc((header.count + 1) * sizeof(trace_rec_t));
+    if(!recs){
+        perror("malloc()");
+        return EXIT_FAILURE;
+    }
+    if(fread(recs, sizeof(trace_rec_t), header.count, fp) != header.count){
+        fprintf(stderr, "%s: truncated dump\n", argv[optind]);
+        return EXIT_FAILURE;
+    }
+    fclose(fp);
+
+    qsort(recs, header.count, sizeof(trace_rec_t), trace_decode_cmp);
+    if(summary){
+        trace_decode_summary(&header, recs);
+    }else{
+        trace_decode_timeline(&header, recs);
+    }
+    free(recs);
+    free(names);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,242 @@
+/*
+ * valcache.c - cache of file values
+ * Copyright (C) 2012 Benoit Vidis <contact@benoitvidis.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+/*
+ * Values of files read lately are kept along with the CAS memcached gave
+ * them, up to `limit' bytes, least recently used first out. Opening a
+ * cached file again only asks the server for the CAS of the value: when
+ * it did not change, the cached copy is used and the kernel may keep its
+ * own page cache of the file. Every store changes the CAS, so a stale
+ * copy is never used, whoever wrote the file. The values are shared
+ * with the files opened from them rather than copied.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include "memcachefs.h"
+#include "buf.h"
+#include "valcache.h"
+
+static unsigned int val_cache_hash(const char *path)
+{
+    unsigned int hash = 2166136261U;
+
+    while(*path){
+        hash ^= (unsigned char)*path++;
+        hash *= 16777619U;
+    }
+    return hash % VAL_CACHE_BUCKETS;
+}
+
+val_cache_t *val_cache_new(size_t limit, buf_pool_t *bufs)
+{
+    val_cache_t *cache;
+
+    cache = (val_cache_t*)malloc(sizeof(val_cache_t));
+    if(!cache){
+        return NULL;
+    }
+    memset(cache, 0, sizeof(val_cache_t));
+    cache->limit = limit;
+    cache->bufs = bufs;
+    pthread_mutex_init(&cache->mutex, NULL);
+    return cache;
+}
+
+static void val_entry_free(val_cache_t *cache, val_entry_t *entry)
+{
+    free(entry->path);
+    buf_ref_put(cache->bufs, entry->val);
+    free(entry);
+}
+
+void val_cache_free(val_cache_t *cache)
+{
+    val_entry_t *entry;
+
+    while((entry = cache->lru_head)){
+        cache->lru_head = entry->lru_next;
+        val_entry_free(cache, entry);
+    }
+    pthread_mutex_destroy(&cache->mutex);
+    free(cache);
+}
+
+static val_entry_t *val_cache_find(val_cache_t *cache, const char *path)
+{
+    val_entry_t *entry;
+
+    entry = cache->buckets[val_cache_hash(path)];
+    while(entry && strcmp(entry->path, path)){
+        entry = entry->next;
+    }
+    return entry;
+}
+
+static void val_lru_unlink(val_cache_t *cache, val_entry_t *entry)
+{
+    if(entry->lru_prev){
+        entry->lru_prev->lru_next = entry->lru_next;
+    }else{
+        cache->lru_head = entry->lru_next;
+    }
+    if(entry->lru_next){
+        entry->lru_next->lru_prev = entry->lru_prev;
+    }else{
+        cache->lru_tail = entry->lru_prev;
+    }
+    entry->lru_prev = NULL;
+    entry->lru_next = NULL;
+}
+
+static void val_lru_push(val_cache_t *cache, val_entry_t *entry)
+{
+    entry->lru_next = cache->lru_head;
+    if(cache->lru_head){
+        cache->lru_head->lru_prev = entry;
+    }else{
+        cache->lru_tail = entry;
+    }
+    cache->lru_head = entry;
+}
+
+static void val_cache_remove(val_cache_t *cache, val_entry_t *entry)
+{
+    val_entry_t **p = &cache->buckets[val_cache_hash(entry->path)];
+
+    while(*p != entry){
+        p = &(*p)->next;
+    }
+    *p = entry->next;
+    val_lru_unlink(cache, entry);
+    cache->bytes -= entry->val->len;
+    val_entry_free(cache, entry);
+}
+
+/*
+ * Get the CAS of the cached value of path. Returns -1 when not cached.
+ */
+int val_cache_cas(val_cache_t *cache, const char *path,
+                  unsigned long long *cas)
+{
+    val_entry_t *entry;
+
+    pthread_mutex_lock(&cache->mutex);
+    entry = val_cache_find(cache, path);
+    if(entry){
+        *cas = entry->cas;
+    }
+    pthread_mutex_unlock(&cache->mutex);
+    return entry?0:-1;
+}
+
+/*
+ * Get a reference to the value of path if it is cached with that CAS,
+ * NULL otherwise. A copy with another CAS is dropped. Give it back with
+ * buf_ref_put().
+ */
+buf_ref_t *val_cache_get(val_cache_t *cache, const char *path,
+                         unsigned long long cas, attr_t *attr)
+{
+    val_entry_t *entry;
+    buf_ref_t *val = NULL;
+
+    pthread_mutex_lock(&cache->mutex);
+    entry = val_cache_find(cache, path);
+    if(entry && entry->cas != cas){
+        cache->stale++;
+        val_cache_remove(cache, entry);
+        entry = NULL;
+    }
+    if(entry){
+        val = buf_ref_get(entry->val);
+        *attr = entry->attr;
+        val_lru_unlink(cache, entry);
+        val_lru_push(cache, entry);
+        cache->hits++;
+    }
+    pthread_mutex_unlock(&cache->mutex);
+    return val;
+}
+
+/*
+ * Keep a reference to the value of path. Values over an eighth of the
+ * limit are not kept, they would push too many others out.
+ */
+void val_cache_set(val_cache_t *cache, const char *path, buf_ref_t *val,
+                   unsigned long long cas, const attr_t *attr)
+{
+    val_entry_t *entry;
+    val_entry_t *old;
+    unsigned int hash;
+    size_t len = val->len;
+
+    if(!cas || len > cache->limit / 8){
+        return;
+    }
+    entry = (val_entry_t*)malloc(sizeof(val_entry_t));
+    if(!entry){
+        return;
+    }
+    memset(entry, 0, sizeof(val_entry_t));
+    entry->path = strdup(path);
+    if(!entry->path){
+        free(entry);
+        return;
+    }
+    entry->val = buf_ref_get(val);
+    entry->cas = cas;
+    entry->attr = *attr;
+
+    pthread_mutex_lock(&cache->mutex);
+    hash = val_cache_hash(path);
+    old = val_cache_find(cache, path);
+    if(old){
+        val_cache_remove(cache, old);
+    }
+    while(cache->lru_tail && cache->bytes + len > cache->limit){
+        val_cache_remove(cache, cache->lru_tail);
+    }
+    entry->next = cache->buckets[hash];
+    cache->buckets[hash] = entry;
+    val_lru_push(cache, entry);
+    cache->bytes += len;
+    pthread_mutex_unlock(&cache->mutex);
+}
+
+void val_cache_invalidate(val_cache_t *cache, const char *path)
+{
+    val_entry_t *entry;
+
+    pthread_mutex_lock(&cache->mutex);
+    entry = val_cache_find(cache, path);
+    if(entry){
+        val_cache_remove(cache, entry);
+    }
+    pthread_mutex_unlock(&cache->mutex);
+}
+
+void val_cache_stats(val_cache_t *cache, FILE *fp)
+{
+    fprintf(fp, "value cache: %lu hits, %lu stale, %zu bytes kept\n",
+            cache->hits, cache->stale, cache->bytes);
+}
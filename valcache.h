@@ -0,0 +1,53 @@
+/*
+ * valcache.h - cache of file values
+ * Copyright (C) 2012 Benoit Vidis <contact@benoitvidis.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#define VAL_CACHE_BUCKETS 1024
+
+typedef struct val_entry{
+    struct val_entry *next;     // hash chain
+    struct val_entry *lru_prev;
+    struct val_entry *lru_next;
+    char *path;
+    buf_ref_t *val;
+    unsigned long long cas;
+    attr_t attr;
+}val_entry_t;
+
+typedef struct{
+    val_entry_t *buckets[VAL_CACHE_BUCKETS];
+    val_entry_t *lru_head;      // most recently used
+    val_entry_t *lru_tail;
+    size_t bytes;
+    size_t limit;
+    buf_pool_t *bufs;
+    unsigned long hits;
+    unsigned long stale;
+    pthread_mutex_t mutex;
+}val_cache_t;
+
+val_cache_t *val_cache_new(size_t limit, buf_pool_t *bufs);
+void val_cache_free(val_cache_t *cache);
+int val_cache_cas(val_cache_t *cache, const char *path,
+                  unsigned long long *cas);
+buf_ref_t *val_cache_get(val_cache_t *cache, const char *path,
+                         unsigned long long cas, attr_t *attr);
+void val_cache_set(val_cache_t *cache, const char *path, buf_ref_t *val,
+                   unsigned long long cas, const attr_t *attr);
+void val_cache_invalidate(val_cache_t *cache, const char *path);
+void val_cache_stats(val_cache_t *cache, FILE *fp);
@@ -0,0 +1,415 @@
+/*
+ * writeback.c - asynchronous write-back queue
+ * Copyright (C) 2012 Benoit Vidis <contact@benoitvidis.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+/*
+ * With write-back on, flushing a file copies its value into a queue and
+ * returns; writer threads take batches off the queue and store them, so
+ * closing a file costs no round-trip. A file flushed again while its
+ * previous version is still queued replaces it in place: only the last
+ * version is sent.
+ *
+ * Writers get up to WRITEBACK_BATCH entries at a time, which the write
+ * function pipelines per server. Callers adding entries are held back
+ * while more than max_bytes are queued, or while the oldest entry waits
+ * for longer than max_age milliseconds, so that neither memory nor
+ * staleness grow without bound when the servers can't keep up.
+ *
+ * writeback_wait() is the barrier for everything reading or changing a
+ * file behind the queue's back: it returns once no version of the file
+ * is queued or being written. A failed write is remembered and reported
+ * by the barriers until the file is written again or forgotten.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include "memcachefs.h"
+#include "writeback.h"
+
+static unsigned int writeback_hash(const char *path)
+{
+    unsigned int hash = 2166136261U;
+
+    while(*path){
+        hash ^= (unsigned char)*path++;
+        hash *= 16777619U;
+    }
+    return hash % WRITEBACK_BUCKETS;
+}
+
+static unsigned long long writeback_now(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return (unsigned long long)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+writeback_t *writeback_new(unsigned int nthreads, size_t max_bytes,
+                           unsigned int max_age, writeback_fn_t fn)
+{
+    writeback_t *wb;
+
+    wb = (writeback_t*)malloc(sizeof(writeback_t));
+    if(!wb){
+        return NULL;
+    }
+    memset(wb, 0, sizeof(writeback_t));
+    wb->threads = (pthread_t*)malloc(sizeof(pthread_t) * nthreads);
+    if(!wb->threads){
+        free(wb);
+        return NULL;
+    }
+    wb->nthreads = nthreads;
+    wb->max_bytes = max_bytes;
+    wb->max_age = max_age;
+    wb->fn = fn;
+    wb->queue_tail = &wb->queue;
+    pthread_mutex_init(&wb->mutex, NULL);
+    pthread_cond_init(&wb->cond, NULL);
+    pthread_cond_init(&wb->done, NULL);
+    return wb;
+}
+
+void writeback_free(writeback_t *wb)
+{
+    unsigned int i;
+    writeback_entry_t *entry;
+
+    writeback_stop(wb);
+    for(i=0; i<WRITEBACK_BUCKETS; i++){
+        while((entry = wb->table[i])){
+            wb->table[i] = entry->hnext;
+            free(entry->buf);
+            free(entry);
+        }
+    }
+    pthread_mutex_destroy(&wb->mutex);
+    pthread_cond_destroy(&wb->cond);
+    pthread_cond_destroy(&wb->done);
+    free(wb->threads);
+    free(wb);
+}
+
+static writeback_entry_t *writeback_find(writeback_t *wb, const char *path,
+                                         int state)
+{
+    writeback_entry_t *entry;
+
+    for(entry = wb->table[writeback_hash(path)]; entry; entry = entry->hnext){
+        if(entry->state == state && !strcmp(entry->path, path)){
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+static void writeback_unlink(writeback_t *wb, writeback_entry_t *entry)
+{
+    writeback_entry_t **p = &wb->table[writeback_hash(entry->path)];
+
+    while(*p != entry){
+        p = &(*p)->hnext;
+    }
+    *p = entry->hnext;
+}
+
+static void writeback_drop(writeback_t *wb, writeback_entry_t *entry)
+{
+    writeback_unlink(wb, entry);
+    free(entry->buf);
+    free(entry);
+}
+
+/*
+ * Store a batch of entries, then drop the ones written and keep the
+ * others as failed. A file keeps one failed entry at most: an older
+ * version may have failed while this one was queued, and goes with
+ * this one written, or takes its error when it failed as well.
+ */
+static void writeback_write(writeback_t *wb, writeback_entry_t **entries,
+                            size_t n)
+{
+    size_t i;
+    writeback_entry_t *failed;
+
+    wb->fn(entries, n);
+
+    pthread_mutex_lock(&wb->mutex);
+    for(i=0; i<n; i++){
+        wb->bytes -= entries[i]->len;
+        wb->pending--;
+        failed = writeback_find(wb, entries[i]->path, WRITEBACK_FAILED);
+        if(entries[i]->error){
+            wb->failed++;
+            if(failed){
+                failed->error = entries[i]->error;
+                writeback_drop(wb, entries[i]);
+                continue;
+            }
+            wb->failures++;
+            entries[i]->state = WRITEBACK_FAILED;
+            free(entries[i]->buf);
+            entries[i]->buf = NULL;
+            entries[i]->len = 0;
+        }else{
+            wb->written++;
+            if(failed){
+                wb->failures--;
+                writeback_drop(wb, failed);
+            }
+            writeback_drop(wb, entries[i]);
+        }
+    }
+    pthread_cond_broadcast(&wb->done);
+    // entries held back behind these ones may go now
+    pthread_cond_broadcast(&wb->cond);
+    pthread_mutex_unlock(&wb->mutex);
+}
+
+/*
+ * Take a batch off the queue. A file whose previous version is still
+ * being written is left for later, so that versions can't overtake each
+ * other on different writers.
+ */
+static size_t writeback_take(writeback_t *wb, writeback_entry_t **entries)
+{
+    writeback_entry_t **p = &wb->queue;
+    writeback_entry_t *entry;
+    size_t n = 0;
+
+    while(*p && n < WRITEBACK_BATCH){
+        entry = *p;
+        if(writeback_find(wb, entry->path, WRITEBACK_BUSY)){
+            p = &entry->next;
+            continue;
+        }
+        *p = entry->next;
+        if(wb->queue_tail == &entry->next){
+            wb->queue_tail = p;
+        }
+        entry->next = NULL;
+        entry->state = WRITEBACK_BUSY;
+        entries[n++] = entry;
+    }
+    return n;
+}
+
+static void *writeback_run(void *arg)
+{
+    writeback_t *wb = (writeback_t*)arg;
+    writeback_entry_t *entries[WRITEBACK_BATCH];
+    size_t n;
+
+    pthread_mutex_lock(&wb->mutex);
+    for(;;){
+        // the queue is drained before stopping
+        if(!wb->queue && wb->stop){
+            break;
+        }
+        n = wb->queue?writeback_take(wb, entries):0;
+        if(!n){
+            pthread_cond_wait(&wb->cond, &wb->mutex);
+            continue;
+        }
+        pthread_mutex_unlock(&wb->mutex);
+        writeback_write(wb, entries, n);
+        pthread_mutex_lock(&wb->mutex);
+    }
+    pthread_mutex_unlock(&wb->mutex);
+    return NULL;
+}
+
+int writeback_start(writeback_t *wb)
+{
+    wb->stop = 0;
+    while(wb->running < wb->nthreads){
+        if(pthread_create(&wb->threads[wb->running], NULL, writeback_run,
+                          wb)){
+            return wb->running?0:-1;
+        }
+        wb->running++;
+    }
+    return 0;
+}
+
+/*
+ * Stop the writers once everything queued was written.
+ */
+void writeback_stop(writeback_t *wb)
+{
+    unsigned int i;
+
+    pthread_mutex_lock(&wb->mutex);
+    wb->stop = 1;
+    pthread_cond_broadcast(&wb->cond);
+    pthread_mutex_unlock(&wb->mutex);
+    for(i=0; i<wb->running; i++){
+        pthread_join(wb->threads[i], NULL);
+    }
+    wb->running = 0;
+}
+
+/*
+ * Queue a version of path, in place of the one already queued if any.
+ * Waits while the queue is over its size or age bound. Without writer
+ * threads (before start or after stop) the entry is written at once.
+ */
+int writeback_add(writeback_t *wb, const char *path, const char *buf,
+                  size_t len, const attr_t *attr)
+{
+    writeback_entry_t *entry;
+    char *copy;
+    unsigned int hash;
+
+    copy = (char*)malloc(len?len:1);
+    if(!copy){
+        return -ENOMEM;
+    }
+    memcpy(copy, buf, len);
+
+    pthread_mutex_lock(&wb->mutex);
+    for(;;){
+        entry = writeback_find(wb, path, WRITEBACK_QUEUED);
+        if(entry){
+            wb->bytes += len - entry->len;
+            wb->coalesced++;
+            free(entry->buf);
+            entry->buf = copy;
+            entry->len = len;
+            entry->attr = *attr;
+            pthread_mutex_unlock(&wb->mutex);
+            return 0;
+        }
+        if(!wb->running || !wb->queue ||
+           (wb->bytes + len <= wb->max_bytes &&
+            writeback_now() - wb->queue->queued <= wb->max_age)){
+            break;
+        }
+        pthread_cond_wait(&wb->done, &wb->mutex);
+    }
+    entry = writeback_find(wb, path, WRITEBACK_FAILED);
+    if(entry){
+        wb->failures--;
+    }else{
+        entry = (writeback_entry_t*)malloc(sizeof(writeback_entry_t) +
+                                           strlen(path) + 1);
+        if(!entry){
+            pthread_mutex_unlock(&wb->mutex);
+            free(copy);
+            return -ENOMEM;
+        }
+        strcpy(entry->path, path);
+        hash = writeback_hash(path);
+        entry->hnext = wb->table[hash];
+        wb->table[hash] = entry;
+    }
+    entry->next = NULL;
+    entry->state = WRITEBACK_QUEUED;
+    entry->error = 0;
+    entry->buf = copy;
+    entry->len = len;
+    entry->attr = *attr;
+    entry->queued = writeback_now();
+    wb->bytes += len;
+    wb->pending++;
+    if(!wb->running){
+        entry->state = WRITEBACK_BUSY;
+        pthread_mutex_unlock(&wb->mutex);
+        writeback_write(wb, &entry, 1);
+        return 0;
+    }
+    *wb->queue_tail = entry;
+    wb->queue_tail = &entry->next;
+    pthread_cond_signal(&wb->cond);
+    pthread_mutex_unlock(&wb->mutex);
+    return 0;
+}
+
+/*
+ * Wait until no version of path is queued or being written. Returns -EIO
+ * when the last one could not be written.
+ */
+int writeback_wait(writeback_t *wb, const char *path)
+{
+    int ret = 0;
+
+    if(!__sync_fetch_and_add(&wb->pending, 0) &&
+       !__sync_fetch_and_add(&wb->failures, 0)){
+        return 0;
+    }
+    pthread_mutex_lock(&wb->mutex);
+    while(writeback_find(wb, path, WRITEBACK_QUEUED) ||
+          writeback_find(wb, path, WRITEBACK_BUSY)){
+        pthread_cond_wait(&wb->done, &wb->mutex);
+    }
+    if(writeback_find(wb, path, WRITEBACK_FAILED)){
+        ret = -EIO;
+    }
+    pthread_mutex_unlock(&wb->mutex);
+    return ret;
+}
+
+/*
+ * Whether a version of path is queued or being written, without waiting.
+ */
+int writeback_pending(writeback_t *wb, const char *path)
+{
+    int ret;
+
+    if(!__sync_fetch_and_add(&wb->pending, 0)){
+        return 0;
+    }
+    pthread_mutex_lock(&wb->mutex);
+    ret = writeback_find(wb, path, WRITEBACK_QUEUED) ||
+          writeback_find(wb, path, WRITEBACK_BUSY);
+    pthread_mutex_unlock(&wb->mutex);
+    return ret;
+}
+
+/*
+ * Wait for path like writeback_wait(), then drop its failed write, e.g.
+ * once the file was removed or stored directly.
+ */
+void writeback_forget(writeback_t *wb, const char *path)
+{
+    writeback_entry_t *entry;
+
+    if(!writeback_wait(wb, path)){
+        return;
+    }
+    pthread_mutex_lock(&wb->mutex);
+    entry = writeback_find(wb, path, WRITEBACK_FAILED);
+    if(entry){
+        wb->failures--;
+        writeback_drop(wb, entry);
+    }
+    pthread_mutex_unlock(&wb->mutex);
+}
+
+void writeback_stats(writeback_t *wb, FILE *fp)
+{
+    fprintf(fp, "write-back: %lu written, %lu coalesced, %lu failed\n",
+            wb->written, wb->coalesced, wb->failed);
+}
@@ -0,0 +1,77 @@
+/*
+ * writeback.h - asynchronous write-back queue
+ * Copyright (C) 2012 Benoit Vidis <contact@benoitvidis.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#define WRITEBACK_BUCKETS 1024
+// entries handed to the write function at a time
+#define WRITEBACK_BATCH 32
+
+enum{
+    WRITEBACK_QUEUED,
+    WRITEBACK_BUSY,     // being written
+    WRITEBACK_FAILED,   // kept until a later write or writeback_forget()
+};
+
+typedef struct writeback_entry{
+    struct writeback_entry *next;   // in the queue
+    struct writeback_entry *hnext;  // in the hash table
+    int state;
+    int error;
+    char *buf;
+    size_t len;
+    attr_t attr;
+    unsigned long long queued;      // milliseconds
+    char path[];
+}writeback_entry_t;
+
+// write a batch of entries, setting error on the ones that failed
+typedef void (*writeback_fn_t)(writeback_entry_t **entries, size_t n);
+
+typedef struct{
+    writeback_entry_t *table[WRITEBACK_BUCKETS];
+    writeback_entry_t *queue;
+    writeback_entry_t **queue_tail;
+    size_t bytes;
+    unsigned int pending;       // entries queued or being written
+    unsigned int failures;      // failed entries kept
+    size_t max_bytes;
+    unsigned int max_age;
+    writeback_fn_t fn;
+    unsigned long written;
+    unsigned long coalesced;
+    unsigned long failed;
+    pthread_t *threads;
+    unsigned int nthreads;
+    unsigned int running;
+    int stop;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;        // work for the writers
+    pthread_cond_t done;        // entries written
+}writeback_t;
+
+writeback_t *writeback_new(unsigned int nthreads, size_t max_bytes,
+                           unsigned int max_age, writeback_fn_t fn);
+void writeback_free(writeback_t *wb);
+int writeback_start(writeback_t *wb);
+void writeback_stop(writeback_t *wb);
+int writeback_add(writeback_t *wb, const char *path, const char *buf,
+                  size_t len, const attr_t *attr);
+int writeback_wait(writeback_t *wb, const char *path);
+int writeback_pending(writeback_t *wb, const char *path);
+void writeback_forget(writeback_t *wb, const char *path);
+void writeback_stats(writeback_t *wb, FILE *fp);